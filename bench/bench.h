@@ -0,0 +1,73 @@
+// Copyright (c) 2021 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+// =============================================================================
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+namespace bench {
+
+// Prevent the compiler from optimizing away a result.
+template <typename T>
+inline void do_not_optimize(const T& v) {
+  asm volatile("" : : "r,m"(v) : "memory");
+}
+
+inline double now_seconds() {
+  using clock = std::chrono::steady_clock;
+  return std::chrono::duration<double>(clock::now().time_since_epoch())
+      .count();
+}
+
+// Run fn(thread_index, iteration) `iters` times on each of `threads` threads
+// which start together, return total calls per second.
+template <typename F>
+double calls_per_second(int threads, long iters, F fn) {
+  std::atomic<int>         ready{0};
+  std::atomic<bool>        go{false};
+  std::vector<std::thread> ts;
+  for (int t = 0; t < threads; ++t) {
+    ts.emplace_back([&, t] {
+      ++ready;
+      while (!go) std::this_thread::yield();
+      for (long i = 0; i < iters; ++i) fn(t, i);
+    });
+  }
+  while (ready < threads) std::this_thread::yield();
+  double start = now_seconds();
+  go           = true;
+  for (auto& th : ts) th.join();
+  double cost = now_seconds() - start;
+  return static_cast<double>(threads) * iters / cost;
+}
+
+// Time of one call of fn in seconds, best of `repeat` runs.
+template <typename F>
+double best_seconds(int repeat, F fn) {
+  double best = 1e100;
+  for (int i = 0; i < repeat; ++i) {
+    double start = now_seconds();
+    fn();
+    double cost = now_seconds() - start;
+    if (cost < best) best = cost;
+  }
+  return best;
+}
+
+}  // namespace bench
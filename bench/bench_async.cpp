@@ -0,0 +1,103 @@
+// Copyright (c) 2021 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+// =============================================================================
+
+// Producer side latency of writing a log line with a container, formatted on
+// the calling thread under a lock, compared with queued to `async_sink`.
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+
+#include "bench.h"
+#include "myostream.h"
+
+namespace {
+
+const int  kThreads = 2;
+const long kIters   = 200000;
+
+using clock_type = std::chrono::steady_clock;
+
+// Run fn(thread_index, iteration) on threads, return latencies of all calls in
+// nanoseconds, sorted.
+template <typename F>
+std::vector<double> latencies(F fn) {
+  std::vector<std::vector<double>> per_thread(kThreads);
+  bench::calls_per_second(kThreads, kIters, [&](int t, long i) {
+    auto start = clock_type::now();
+    fn(t, i);
+    auto cost = clock_type::now() - start;
+    per_thread[t].push_back(
+        std::chrono::duration<double, std::nano>(cost).count());
+  });
+  std::vector<double> all;
+  for (auto& v : per_thread) all.insert(all.end(), v.begin(), v.end());
+  std::sort(all.begin(), all.end());
+  return all;
+}
+
+void report(const char* name, const std::vector<double>& v) {
+  auto at = [&](double q) {
+    return v[static_cast<size_t>(q * (v.size() - 1))];
+  };
+  std::printf("%-8s %10.0f %10.0f %10.0f %10.0f %10.0f\n",
+              name,
+              at(0.5),
+              at(0.9),
+              at(0.99),
+              at(0.999),
+              v.back());
+}
+
+}  // namespace
+
+int main() {
+  std::vector<int> v(16);
+  for (int i = 0; i < 16; ++i) v[i] = i * 1000;
+  std::string s = "request handled";
+
+  myostream::basic_counting_buf<char> sync_buf;
+  myostream::ostream                  sync_os(&sync_buf);
+  const auto&                         fake_fmt =
+      sync_os.const_preferences().fake_fmt;
+  std::mutex mu;
+  auto       sync_lat = latencies([&](int t, long i) {
+    std::lock_guard<std::mutex> lock(mu);
+    sync_os.print(fake_fmt, s, " thread ", t, " seq ", i, ' ', v, '\n');
+  });
+
+  myostream::basic_counting_buf<char> async_buf;
+  myostream::async_options            opt;
+  opt.capacity = 1 << 16;
+  opt.overflow = myostream::async_overflow::grow;
+  myostream::async_sink sink(&async_buf, opt);
+  auto                  async_lat = latencies([&](int t, long i) {
+    sink.write(s, " thread ", t, " seq ", i, ' ', v, '\n');
+  });
+  sink.close();
+
+  std::printf("%d threads, %ld calls each, latency in ns\n", kThreads, kIters);
+  std::printf("%-8s %10s %10s %10s %10s %10s\n",
+              "sink",
+              "p50",
+              "p90",
+              "p99",
+              "p99.9",
+              "max");
+  report("sync", sync_lat);
+  report("async", async_lat);
+  bench::do_not_optimize(sync_buf.count() + async_buf.count());
+  return 0;
+}
@@ -0,0 +1,78 @@
+// Copyright (c) 2021 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+// =============================================================================
+
+// Batch formatting of contiguous numbers in std::vector, compared with the
+// element by element path.
+
+#include <random>
+
+#include "bench.h"
+#include "myostream.h"
+
+namespace {
+
+using oss_t = myostream::basic_ostringstream<myostream::string_builder>;
+
+template <typename T>
+void run(const char* name, const std::vector<T>& v) {
+  oss_t oss;
+  oss.preferences().float_output = myostream::float_format::shortest;
+  const auto& fmt                = oss.preferences().vector_fmt;
+  double      single = bench::best_seconds(5, [&] {
+    oss.clear_buf();
+    oss << fmt.lb;
+    for (size_t i = 0; i < v.size(); ++i) {
+      if (i) oss << fmt.sep;
+      oss << v[i];
+    }
+    oss << fmt.rb;
+    bench::do_not_optimize(oss.size());
+  });
+  double      batch  = bench::best_seconds(5, [&] {
+    oss.clear_buf();
+    oss << v;
+    bench::do_not_optimize(oss.size());
+  });
+  std::printf("%-10s %14.2f %14.2f %8.2f\n",
+              name,
+              single * 1e9 / v.size(),
+              batch * 1e9 / v.size(),
+              single / batch);
+}
+
+}  // namespace
+
+int main() {
+  const size_t          n = 1000000;
+  std::mt19937_64       rng(12345);
+  std::vector<int32_t>  v32(n);
+  std::vector<int64_t>  v64(n);
+  std::vector<double>   vd(n);
+  std::vector<float>    vf(n);
+  for (auto& x : v32) x = static_cast<int32_t>(rng());
+  for (auto& x : v64) x = static_cast<int64_t>(rng());
+  for (auto& x : vd) x = static_cast<double>(rng() % 1000000) / 1000;
+  for (auto& x : vf) x = static_cast<float>(rng() % 100000) / 100;
+  std::printf("%-10s %14s %14s %8s\n",
+              "type",
+              "single ns/it",
+              "batch ns/it",
+              "speedup");
+  run("int32", v32);
+  run("int64", v64);
+  run("double", vd);
+  run("float", vf);
+  return 0;
+}
@@ -0,0 +1,76 @@
+// Copyright (c) 2021 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+// =============================================================================
+
+// Write-combining output of node based containers, compared with writing
+// borders, separators and elements one by one through operator<<.
+
+#include <map>
+#include <random>
+#include <string>
+
+#include "bench.h"
+#include "myostream.h"
+
+namespace {
+
+using oss_t = myostream::basic_ostringstream<myostream::string_builder>;
+
+template <typename MapT>
+void run(const char* name, const MapT& m) {
+  oss_t       oss;
+  const auto& f    = oss.const_preferences().map_fmt;
+  const auto& kv_f = oss.const_preferences().map_kv_fmt;
+  double      single = bench::best_seconds(5, [&] {
+    oss.clear_buf();
+    oss << f.lb;
+    for (auto it = m.begin(); it != m.end(); ++it) {
+      if (it != m.begin()) oss << f.sep;
+      oss << kv_f.lb << it->first << kv_f.sep << it->second << kv_f.rb;
+    }
+    oss << f.rb;
+    bench::do_not_optimize(oss.size());
+  });
+  double      combined = bench::best_seconds(5, [&] {
+    oss.clear_buf();
+    oss << m;
+    bench::do_not_optimize(oss.size());
+  });
+  std::printf("%-16s %14.2f %14.2f %8.2f\n",
+              name,
+              single * 1e9 / m.size(),
+              combined * 1e9 / m.size(),
+              single / combined);
+}
+
+}  // namespace
+
+int main() {
+  const int                  n = 1000000;
+  std::mt19937_64            rng(12345);
+  std::map<int, int>         mii;
+  std::map<int, std::string> mis;
+  for (int i = 0; i < n; ++i) {
+    mii[i] = static_cast<int>(rng());
+    mis[i] = std::string(rng() % 12, 'a' + i % 26);
+  }
+  std::printf("%-16s %14s %14s %8s\n",
+              "type",
+              "single ns/it",
+              "combined ns/it",
+              "speedup");
+  run("map<int,int>", mii);
+  run("map<int,string>", mis);
+  return 0;
+}
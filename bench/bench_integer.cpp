@@ -0,0 +1,76 @@
+// Copyright (c) 2021 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+// =============================================================================
+
+// Formatting vectors of integers by the integer kernel, compared with
+// std::num_put. The num_put path is forced by imbuing a locale which behaves
+// as the classic one but is not the classic one.
+
+#include <random>
+
+#include "bench.h"
+#include "myostream.h"
+
+namespace {
+
+using oss_t = myostream::basic_ostringstream<myostream::string_builder>;
+
+template <typename T>
+double ns_per_item(const std::vector<T>& v, bool kernel) {
+  oss_t oss;
+  if (!kernel) {
+    oss.imbue(std::locale(std::locale::classic(), new std::numpunct<char>));
+  }
+  long   repeat = 10000000 / static_cast<long>(v.size());
+  double cost   = bench::best_seconds(3, [&] {
+    for (long i = 0; i < repeat; ++i) {
+      oss.clear_buf();
+      oss << v;
+      bench::do_not_optimize(oss.size());
+    }
+  });
+  return cost * 1e9 / (static_cast<double>(repeat) * v.size());
+}
+
+template <typename T>
+void run(const char* name) {
+  std::mt19937_64 rng(12345);
+  for (long n = 10; n <= 10000000; n *= 100) {
+    std::vector<T> v(n);
+    for (auto& x : v) x = static_cast<T>(rng());
+    double num_put = ns_per_item(v, false);
+    double kernel  = ns_per_item(v, true);
+    std::printf("%-10s %10ld %14.2f %14.2f %8.2f\n",
+                name,
+                n,
+                num_put,
+                kernel,
+                num_put / kernel);
+  }
+}
+
+}  // namespace
+
+int main() {
+  std::printf("%-10s %10s %14s %14s %8s\n",
+              "type",
+              "size",
+              "num_put ns/it",
+              "kernel ns/it",
+              "speedup");
+  run<int32_t>("int32");
+  run<int64_t>("int64");
+  run<uint64_t>("uint64");
+  return 0;
+}
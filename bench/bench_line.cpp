@@ -0,0 +1,62 @@
+// Copyright (c) 2021 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+// =============================================================================
+
+// Multi-threaded throughput of writing whole lines with containers to one
+// stream buffer: a shared `myostream::ostream` guarded by a mutex per line,
+// compared with `line_ostream` formatting in thread local buffers.
+
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "bench.h"
+#include "myostream.h"
+
+int main() {
+  const long       iters = 200000;
+  std::vector<int> v(16);
+  for (int i = 0; i < 16; ++i) v[i] = i * 1000;
+  std::ofstream null_file("/dev/null");
+
+  int max_threads = static_cast<int>(std::thread::hardware_concurrency());
+  if (max_threads < 4) max_threads = 4;
+  std::printf("%-8s %16s %16s %8s\n",
+              "threads",
+              "shared lines/s",
+              "line lines/s",
+              "speedup");
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    myostream::ostream shared(null_file.rdbuf());
+    std::mutex         mu;
+    double             shared_qps =
+        bench::calls_per_second(threads, iters, [&](int t, long i) {
+          std::lock_guard<std::mutex> lock(mu);
+          shared.println("thread", t, "seq", i, v);
+        });
+
+    myostream::line_ostream line(null_file.rdbuf());
+    double                  line_qps =
+        bench::calls_per_second(threads, iters, [&](int t, long i) {
+          line.println("thread", t, "seq", i, v);
+        });
+    std::printf("%-8d %16.0f %16.0f %8.2f\n",
+                threads,
+                shared_qps,
+                line_qps,
+                line_qps / shared_qps);
+  }
+  return 0;
+}
@@ -0,0 +1,86 @@
+// Copyright (c) 2021 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+// =============================================================================
+
+// Throughput of dumping large containers to a file by `myostream::ostream` over
+// a std::ofstream, compared with over a `mmap_ofstream`. The file is written
+// in the current directory, or the directory given as the first argument, and
+// removed after.
+
+#define MYOSTREAM_ENABLE_MMAP
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+
+#include "bench.h"
+#include "myostream.h"
+
+namespace {
+
+template <typename T>
+void run(const char* name, const T& v, const std::string& path) {
+  size_t size     = 0;
+  double ofstream = bench::best_seconds(3, [&] {
+    std::ofstream      file(path);
+    myostream::ostream out(file.rdbuf());
+    out << v;
+    out.flush();
+    size = static_cast<size_t>(out.tellp());
+    file.close();
+  });
+
+#ifdef MYOSTREAM_HAS_MMAP
+  double mmap = bench::best_seconds(3, [&] {
+    myostream::basic_ostream<myostream::mmap_ofstream> out(path);
+    out << v;
+    out.close();
+  });
+  std::printf("%-24s %8.1f %10.3f %10.3f %8.2f\n",
+              name,
+              size / 1e6,
+              ofstream,
+              mmap,
+              ofstream / mmap);
+#else
+  std::printf("%-24s %8.1f %10.3f %10s\n", name, size / 1e6, ofstream, "-");
+#endif
+  std::remove(path.c_str());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string path = argc > 1 ? std::string(argv[1]) + "/" : std::string();
+  path += "bench_mmap.tmp";
+
+  std::mt19937_64      rng(12345);
+  std::vector<int64_t> v(10000000);
+  for (auto& x : v) x = static_cast<int64_t>(rng());
+  std::map<int, std::vector<double>> m;
+  for (int i = 0; i < 200000; ++i) m[i] = {i * 0.5, i / 3.0, 1e-3 * i};
+
+  std::printf("%-24s %8s %10s %10s %8s\n",
+              "type",
+              "MB",
+              "ofstream",
+              "mmap",
+              "speedup");
+  run("vector<int64_t> 10M", v, path);
+  run("map<int,vector<double>>", m, path);
+  return 0;
+}
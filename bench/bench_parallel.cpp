@@ -0,0 +1,75 @@
+// Copyright (c) 2021 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+// =============================================================================
+
+// Formatting very large containers serially, compared with in parallel by
+// preferences `parallel_min_size` and `parallel_threads`.
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "bench.h"
+#include "myostream.h"
+
+namespace {
+
+using oss_t = myostream::basic_ostringstream<myostream::string_builder>;
+
+template <typename ContainerT>
+double seconds(const ContainerT& c, size_t threads) {
+  oss_t oss;
+  if (threads > 1) {
+    oss.preferences().parallel_min_size = 1024;
+    oss.preferences().parallel_threads  = threads;
+  }
+  return bench::best_seconds(3, [&] {
+    oss.clear_buf();
+    oss << c;
+    bench::do_not_optimize(oss.size());
+  });
+}
+
+template <typename ContainerT>
+void run(const char* name, const ContainerT& c) {
+  size_t max_threads = std::thread::hardware_concurrency();
+  if (max_threads < 4) max_threads = 4;
+  double serial = seconds(c, 1);
+  std::printf("%-26s %8s %10.3f\n", name, "serial", serial);
+  for (size_t threads = 2; threads <= max_threads; threads *= 2) {
+    double cost = seconds(c, threads);
+    std::printf("%-26s %8zu %10.3f %8.2f\n",
+                name,
+                threads,
+                cost,
+                serial / cost);
+  }
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937_64      rng(12345);
+  std::vector<int64_t> v(20000000);
+  for (auto& x : v) x = static_cast<int64_t>(rng());
+  std::unordered_map<int, std::string> m;
+  for (int i = 0; i < 2000000; ++i) m[i] = std::string(rng() % 12, 'a');
+
+  std::printf("%-26s %8s %10s %8s\n", "type", "threads", "seconds", "speedup");
+  run("vector<int64_t> 20M", v);
+  run("unordered_map<int,str> 2M", m);
+  return 0;
+}
@@ -0,0 +1,78 @@
+// Copyright (c) 2021 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+// =============================================================================
+
+// Formatting nested containers, pairs and tuples by format plans, compared
+// with an operator<< call per nested container. A summary size which is never
+// reached turns the plans off without changing the output.
+
+#include <limits>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "bench.h"
+#include "myostream.h"
+
+namespace {
+
+using oss_t = myostream::basic_ostringstream<myostream::string_builder>;
+
+template <typename T>
+double seconds(const T& v, bool planned) {
+  oss_t oss;
+  if (!planned) {
+    oss.preferences().summary_min_size = std::numeric_limits<size_t>::max();
+  }
+  return bench::best_seconds(5, [&] {
+    oss.clear_buf();
+    oss << v;
+    bench::do_not_optimize(oss.size());
+  });
+}
+
+template <typename T>
+void run(const char* name, const T& v) {
+  double unplanned = seconds(v, false);
+  double planned   = seconds(v, true);
+  std::printf("%-36s %10.4f %10.4f %8.2f\n",
+              name,
+              unplanned,
+              planned,
+              unplanned / planned);
+}
+
+}  // namespace
+
+int main() {
+  std::map<std::string, std::vector<std::pair<int, double>>> m;
+  for (int i = 0; i < 20000; ++i) {
+    auto& v = m["key" + std::to_string(i)];
+    for (int j = 0; j < 10; ++j) v.emplace_back(j, j * 0.5);
+  }
+  std::vector<std::tuple<int, std::string, std::vector<int>>> t;
+  for (int i = 0; i < 100000; ++i) {
+    t.emplace_back(i, "name", std::vector<int>{i, i + 1, i + 2});
+  }
+
+  std::printf("%-36s %10s %10s %8s\n",
+              "type",
+              "per-elem",
+              "planned",
+              "speedup");
+  run("map<string,vector<pair<int,double>>>", m);
+  run("vector<tuple<int,string,vector<int>>>", t);
+  return 0;
+}
@@ -0,0 +1,63 @@
+// Copyright (c) 2021 Shuangquan Li. All Rights Reserved.
+//
+// Licensed under the MIT License (the "License"); you may not use this file
+// except in compliance with the License. You may obtain a copy of the License
+// at
+//
+//   http://opensource.org/licenses/MIT
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+// =============================================================================
+
+// Calls per second of tostr on small containers, compared with formatting
+// through a newly created std::ostringstream based stream for each call, which
+// is how tostr worked before the string builder and thread local cache.
+
+#include "bench.h"
+#include "myostream.h"
+
+namespace {
+
+template <typename... Args>
+std::string tostr_by_new_ostringstream(const Args&... args) {
+  using oss_t =
+      myostream::basic_ostringstream_with_const_default_preferences<
+          std::ostringstream>;
+  oss_t oss(myostream::placeholder::with_preferences_ptr{},
+            oss_t::preferences_type::const_ins_ptr());
+  oss.print(oss.preferences().fake_fmt, args...);
+  oss.clear_preferences_ptr();
+  return oss.str();
+}
+
+}  // namespace
+
+int main() {
+  const std::vector<int>           vi{1, 22, 333, 4444, 55555};
+  const std::map<std::string, int> msi{{"alice", 1}, {"bob", 2}};
+  const long                       iters = 200000;
+  std::printf("%-8s %20s %20s %8s\n",
+              "threads",
+              "new_ostringstream/s",
+              "tostr/s",
+              "speedup");
+  for (int threads : {1, 8, 32}) {
+    long   n      = iters / threads + 1;
+    double before = bench::calls_per_second(threads, n, [&](int, long) {
+      bench::do_not_optimize(tostr_by_new_ostringstream("req ", vi, msi));
+    });
+    double after = bench::calls_per_second(threads, n, [&](int, long) {
+      bench::do_not_optimize(myostream::tostr("req ", vi, msi));
+    });
+    std::printf("%-8d %20.0f %20.0f %8.2f\n",
+                threads,
+                before,
+                after,
+                after / before);
+  }
+  return 0;
+}
@@ -21,15 +21,32 @@
  * @brief Convenient output for all item-iterable container types for C++.
  */
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <deque>
+#include <exception>
 #include <forward_list>
+#include <functional>
 #include <initializer_list>
+#include <iterator>
+#include <limits>
 #include <list>
+#include <locale>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <ostream>
 #include <set>
 #include <sstream>
+#include <system_error>
+#include <thread>
 #include <tuple>
 #include <type_traits>
 #include <unordered_map>
@@ -37,6 +54,23 @@
 #include <utility>
 #include <vector>
 
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#define MYOSTREAM_HAS_STRING_VIEW 1
+#endif
+
+// The mmap file stream is opt-in, so the POSIX headers are not included by
+// every user of this header.
+#if defined(MYOSTREAM_ENABLE_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#define MYOSTREAM_HAS_MMAP 1
+#endif
+
 #ifdef MYOSTREAM_NO_ASSERT
 #define MYOSTREAM_ASSERT(x) ((void)0)
 #else
@@ -44,6 +78,13 @@
 #define MYOSTREAM_ASSERT(x) assert(x)
 #endif  // MYOSTREAM_NO_ASSERT
 
+// The tostr family and watch_to_string reuse a thread local string stream for
+// each result type, unless MYOSTREAM_NO_THREAD_LOCAL_CACHE is defined.
+// A cached buffer whose capacity grows beyond this limit is freed after use.
+#ifndef MYOSTREAM_THREAD_LOCAL_CACHE_CAPACITY
+#define MYOSTREAM_THREAD_LOCAL_CACHE_CAPACITY (64 * 1024)
+#endif  // MYOSTREAM_THREAD_LOCAL_CACHE_CAPACITY
+
 namespace myostream {
 
 // type traits
@@ -142,6 +183,29 @@ struct preferences_base;
 template <typename StringT, bool DenseStyle = false>
 struct default_preferences;
 
+/**
+ * @brief Non-owning view of a constant character sequence which can be built
+ * at compile time, used as the string type of `ternary_format` in
+ * `static_preferences`, and as the borrowed result of string builders.
+ * Converts to std::basic_string_view since C++17.
+ * @tparam CharT Character type. e.g. char, wchar_t, etc.
+ * @tparam TraitsT Character traits type.
+ */
+template <typename CharT, typename TraitsT = std::char_traits<CharT>>
+class basic_literal_view;
+
+/**
+ * @brief Compile-time preferences with the same output format as
+ * `default_preferences`. All formats are `static constexpr` members of
+ * `basic_literal_view`, so streams using it construct and allocate nothing for
+ * preferences. Derive from it and redefine some formats to customize.
+ * @tparam StringT Some string type. e.g. std::string, std::wstring, etc.
+ * @tparam DenseStyle Whether use dense style which won't output spaces between
+ * items.
+ */
+template <typename StringT, bool DenseStyle = false>
+struct static_preferences;
+
 /**
  * @brief Instantiate a `default_preferences` with string type corresponding to
  * OstreamBaseT.
@@ -232,6 +296,213 @@ static_assert(std::is_same<wostringstream,
                            basic_ostringstream_by_string<std::wstring>>::value,
               "never happen");
 
+/**
+ * @brief Stream buffer which appends all output directly into an owned string,
+ * so the result can be moved out without any copy.
+ * @tparam StringT Some string type. e.g. std::string, std::wstring, etc.
+ */
+template <typename StringT>
+class basic_string_builder_buf;
+
+/**
+ * @brief A lightweight output stream writing into a `basic_string_builder_buf`.
+ * Can be used as the OstreamBaseT of `basic_ostream` or `basic_ostringstream`.
+ * @tparam StringT Some string type. e.g. std::string, std::wstring, etc.
+ */
+template <typename StringT>
+class basic_string_builder;
+
+using string_builder  = basic_string_builder<std::string>;
+using wstring_builder = basic_string_builder<std::wstring>;
+
+// String streams on string builders, whose results can be borrowed by view()
+// or moved out by release() without copy.
+using builder_ostringstream =
+    basic_ostringstream<string_builder, default_preferences<std::string>>;
+using wbuilder_ostringstream =
+    basic_ostringstream<wstring_builder, default_preferences<std::wstring>>;
+using builder_ostringstream_dense =
+    basic_ostringstream<string_builder,
+                        default_preferences<std::string, true>>;
+using wbuilder_ostringstream_dense =
+    basic_ostringstream<wstring_builder,
+                        default_preferences<std::wstring, true>>;
+
+/**
+ * @brief Strings stored in one contiguous buffer, each accessed as a view by
+ * index. Result of `basic_ostringstream::to_string_list`.
+ * @tparam StringT Some string type. e.g. std::string, std::wstring, etc.
+ */
+template <typename StringT>
+class basic_string_list;
+
+using string_list  = basic_string_list<std::string>;
+using wstring_list = basic_string_list<std::wstring>;
+
+/**
+ * @brief Stream buffer which only counts the characters written to it.
+ * @tparam CharT Character type. e.g. char, wchar_t, etc.
+ * @tparam TraitsT Character traits type.
+ */
+template <typename CharT, typename TraitsT = std::char_traits<CharT>>
+class basic_counting_buf;
+
+/**
+ * @brief An output stream writing into a `basic_counting_buf`, to get the
+ * output size without storing the output. Can be used as the OstreamBaseT of
+ * `basic_ostream`.
+ */
+template <typename CharT, typename TraitsT = std::char_traits<CharT>>
+class basic_counting_ostream;
+
+using counting_ostream  = basic_counting_ostream<char>;
+using wcounting_ostream = basic_counting_ostream<wchar_t>;
+
+#ifdef MYOSTREAM_HAS_MMAP
+/**
+ * @brief Stream buffer writing a file through a memory mapped window, which
+ * is moved forward in large steps as the output grows. The file is truncated
+ * to the written size on close. Only available on POSIX systems.
+ * @tparam CharT Character type. e.g. char, wchar_t, etc.
+ * @tparam TraitsT Character traits type.
+ */
+template <typename CharT, typename TraitsT = std::char_traits<CharT>>
+class basic_mmap_file_buf;
+
+/**
+ * @brief An output stream writing a file by a `basic_mmap_file_buf`. Can be
+ * used as the OstreamBaseT of `basic_ostream`.
+ */
+template <typename CharT, typename TraitsT = std::char_traits<CharT>>
+class basic_mmap_ofstream;
+
+using mmap_ofstream  = basic_mmap_ofstream<char>;
+using wmmap_ofstream = basic_mmap_ofstream<wchar_t>;
+#endif  // MYOSTREAM_HAS_MMAP
+
+/**
+ * @brief Stream buffer which writes characters to an output iterator.
+ * @tparam OutputIt Output iterator type accepting CharT.
+ */
+template <typename OutputIt,
+          typename CharT,
+          typename TraitsT = std::char_traits<CharT>>
+class basic_iterator_buf;
+
+/**
+ * @brief Stream buffer which writes characters into a fixed size array,
+ * discards characters beyond the array but still counts them.
+ */
+template <typename CharT, typename TraitsT = std::char_traits<CharT>>
+class basic_truncating_buf;
+
+/**
+ * @brief Stream buffer which collects characters in a fixed size buffer and
+ * hands each filled chunk to `callback(const CharT* data, size_t n)`, so the
+ * memory used is bounded regardless of the output size. The rest is handed on
+ * flush and on destruction. If the callback throws, the exception is kept in
+ * `error()` and the rest of the output is discarded.
+ * @tparam CallbackT Callable with `(const CharT*, size_t)`.
+ */
+template <typename CallbackT,
+          typename CharT,
+          typename TraitsT = std::char_traits<CharT>>
+class basic_chunk_buf;
+
+/**
+ * @brief An output stream writing into a `basic_chunk_buf` with a
+ * std::function callback. Can be used as the OstreamBaseT of `basic_ostream`.
+ */
+template <typename CharT, typename TraitsT = std::char_traits<CharT>>
+class basic_chunk_ostream;
+
+using chunk_ostream  = basic_chunk_ostream<char>;
+using wchunk_ostream = basic_chunk_ostream<wchar_t>;
+
+/// Result of the `format_to_n` family.
+template <typename OutputIt>
+struct format_to_n_result {
+  /// End of the written characters.
+  OutputIt out;
+  /// Size of the full output, may be greater than the buffer size.
+  size_t size;
+};
+
+/// How `basic_ostream` writes float and double values.
+enum class float_format {
+  /// By the stream's own flags and precision, same as std::ostream.
+  ostream,
+  /// A short string which reads back to the same value, shortest in almost
+  /// all cases, e.g. 0.1 as "0.1", 1.0/3 as "0.3333333333333333", 1e100 as
+  /// "1e+100". Only the width and fill of the stream are respected.
+  shortest,
+};
+
+/**
+ * @brief Limits on output of containers, 0 means no limit. Once a limit is
+ * hit, the rest items of a container are omitted with a marker like
+ * "... (100 more)", or "..." if the container size is unknown.
+ */
+struct output_limits {
+  /// Max number of items printed for each container.
+  size_t max_items = 0;
+  /// Max nesting depth of containers whose items are printed.
+  size_t max_depth = 0;
+  /// Max number of characters printed for an outermost container, checked
+  /// before each item.
+  size_t max_bytes = 0;
+};
+
+/// What `basic_async_sink` does when its ring buffer is full.
+enum class async_overflow {
+  /// Wait until the consumer frees a slot.
+  block,
+  /// Discard the record and count it in `dropped()`.
+  drop,
+  /// Queue the record in an unbounded list, which the consumer drains after
+  /// the records already in the ring.
+  grow,
+};
+
+/// Options of `basic_async_sink`.
+struct async_options {
+  /// Number of slots of the ring buffer, rounded up to a power of 2.
+  size_t         capacity = 1024;
+  async_overflow overflow = async_overflow::block;
+};
+
+/**
+ * @brief Writes args to a stream buffer on a background thread. Producers only
+ * copy or move the args into a record in a lock-free ring buffer, and the
+ * consumer thread formats them by a `basic_ostream`.
+ * @tparam OstreamBaseT Some basic output stream type like std::ostream,
+ * std::wostream, etc.
+ * @tparam PreferencesT Controls the output format.
+ */
+template <typename OstreamBaseT,
+          typename PreferencesT =
+              default_preferences_by_ostream_base<OstreamBaseT>>
+class basic_async_sink;
+
+using async_sink  = basic_async_sink<std::ostream>;
+using wasync_sink = basic_async_sink<std::wostream>;
+
+/**
+ * @brief A stream shared by threads, which formats each line in a thread local
+ * buffer and writes the completed line to the stream buffer by one locked
+ * `sputn`, so lines of different threads never interleave.
+ * @tparam OstreamBaseT Some basic output stream type like std::ostream,
+ * std::wostream, etc.
+ * @tparam PreferencesT Controls the output format, a `default_preferences`.
+ */
+template <typename OstreamBaseT,
+          typename PreferencesT =
+              default_preferences_by_ostream_base<OstreamBaseT>>
+class basic_line_ostream;
+
+using line_ostream  = basic_line_ostream<std::ostream>;
+using wline_ostream = basic_line_ostream<std::wostream>;
+
 namespace placeholder {
 struct no_init_preferences {};
 struct with_preferences_ptr {};
@@ -239,6 +510,13 @@ struct with_preferences_ptr {};
 
 // output methods
 
+// Writes float and double as preferences().float_output says.
+template <typename OstreamBaseT, typename PreferencesT, typename FloatT>
+typename std::enable_if<std::is_same<FloatT, float>::value ||
+                            std::is_same<FloatT, double>::value,
+                        basic_ostream<OstreamBaseT, PreferencesT>&>::type
+operator<<(basic_ostream<OstreamBaseT, PreferencesT>& os, FloatT v);
+
 template <typename OstreamBaseT,
           typename PreferencesT,
           typename FirstT,
@@ -247,10 +525,6 @@ basic_ostream<OstreamBaseT, PreferencesT>& operator<<(
     basic_ostream<OstreamBaseT, PreferencesT>& os,
     const std::pair<FirstT, SecondT>&          p);
 
-template <typename OstreamBaseT, typename PreferencesT>
-basic_ostream<OstreamBaseT, PreferencesT>& operator<<(
-    basic_ostream<OstreamBaseT, PreferencesT>& os, const std::tuple<>& t);
-
 template <typename OstreamBaseT, typename PreferencesT, typename... Args>
 basic_ostream<OstreamBaseT, PreferencesT>& operator<<(
     basic_ostream<OstreamBaseT, PreferencesT>& os,
@@ -285,6 +559,37 @@ MYOSTREAM_DECLARE_OVERLOAD(multimap);
 MYOSTREAM_DECLARE_OVERLOAD(unordered_map);
 MYOSTREAM_DECLARE_OVERLOAD(unordered_multimap);
 
+/// Options of `summary`.
+struct summary_options {
+  /// Number of the first items to print.
+  size_t head = 3;
+  /// Number of the last items to print.
+  size_t tail = 3;
+  /// Whether print quantiles p50, p90 and p99, which costs a copy of items.
+  bool quantiles = true;
+};
+
+/**
+ * @brief Reference to a container of arithmetic values, which is printed as
+ * summary statistics: size, min, max, mean, stddev, quantiles, the first and
+ * last items, in the container's format.
+ */
+template <typename ContainerT>
+struct summary_wrapper {
+  const ContainerT& c;
+  summary_options   options;
+};
+
+/// Print a container of arithmetic values as summary statistics.
+template <typename ContainerT>
+summary_wrapper<ContainerT> summary(
+    const ContainerT& c, const summary_options& options = summary_options());
+
+template <typename OstreamBaseT, typename PreferencesT, typename ContainerT>
+basic_ostream<OstreamBaseT, PreferencesT>& operator<<(
+    basic_ostream<OstreamBaseT, PreferencesT>& os,
+    const summary_wrapper<ContainerT>&         s);
+
 /// Convert all args into std::string joined with "".
 template <typename... Args>
 std::string tostr(const Args&... args);
@@ -321,776 +626,5246 @@ std::string ptostr_dense(const Args&... args);
 template <typename... Args>
 std::wstring ptowstr_dense(const Args&... args);
 
-// ==================== definitions ====================
+/// Size of the result of `tostr` with same args, without allocation.
+template <typename... Args>
+size_t formatted_size(const Args&... args);
 
-template <typename StringT>
-struct ternary_format {
-  using string_type = StringT;
-  using char_type   = typename string_type::value_type;
+/// Size of the result of `ptostr` with same args, without allocation.
+template <typename... Args>
+size_t pformatted_size(const Args&... args);
 
-  ternary_format() {}
+/// Write the result of `tostr` with same args to `out`, return the end.
+template <typename OutputIt, typename... Args>
+OutputIt format_to(OutputIt out, const Args&... args);
 
-  ternary_format(const string_type& left_border,
-                 const string_type& separator,
-                 const string_type& right_border)
-      : lb(left_border), sep(separator), rb(right_border) {}
+/// Write the result of `towstr` with same args to `out`, return the end.
+template <typename OutputIt, typename... Args>
+OutputIt wformat_to(OutputIt out, const Args&... args);
 
-  ternary_format(string_type&& left_border,
-                 string_type&& separator,
-                 string_type&& right_border)
-      : lb(std::move(left_border)),
-        sep(std::move(separator)),
-        rb(std::move(right_border)) {}
+/// Write the result of `ptostr` with same args to `out`, return the end.
+template <typename OutputIt, typename... Args>
+OutputIt pformat_to(OutputIt out, const Args&... args);
 
-  // clang-format off
-  ternary_format& with_lb (const string_type& s) {lb  = s; return *this;}
-  ternary_format& with_sep(const string_type& s) {sep = s; return *this;}
-  ternary_format& with_rb (const string_type& s) {rb  = s; return *this;}
-  ternary_format& with_lb (string_type&& s) {lb  = std::move(s); return *this;}
-  ternary_format& with_sep(string_type&& s) {sep = std::move(s); return *this;}
-  ternary_format& with_rb (string_type&& s) {rb  = std::move(s); return *this;}
-  // clang-format on
+/// Write the result of `ptowstr` with same args to `out`, return the end.
+template <typename OutputIt, typename... Args>
+OutputIt pwformat_to(OutputIt out, const Args&... args);
 
-  ternary_format& with(const string_type& left_border,
-                       const string_type& separator,
-                       const string_type& right_border) {
-    lb  = left_border;
-    sep = separator;
-    rb  = right_border;
-    return *this;
-  }
+/**
+ * @brief Write at most n characters of the result of `tostr` (char) or
+ * `towstr` (wchar_t) with same args to `buf`.
+ * @return End of the written characters and the size of the full result.
+ */
+template <typename CharT, typename... Args>
+format_to_n_result<CharT*> format_to_n(CharT* buf,
+                                       size_t n,
+                                       const Args&... args);
 
-  ternary_format& with(string_type&& left_border,
-                       string_type&& separator,
-                       string_type&& right_border) {
-    lb  = std::move(left_border);
-    sep = std::move(separator);
-    rb  = std::move(right_border);
-    return *this;
-  }
+/// Same as `format_to_n` but with `ptostr`/`ptowstr` semantics.
+template <typename CharT, typename... Args>
+format_to_n_result<CharT*> pformat_to_n(CharT* buf,
+                                        size_t n,
+                                        const Args&... args);
 
-  string_type lb, sep, rb;
-};
+/**
+ * @brief Write the result of `tostr` with same args in chunks of 64K
+ * characters to `callback(const char* data, size_t n)`, without keeping the
+ * whole result in memory. An exception of the callback stops the output and
+ * is rethrown.
+ */
+template <typename CallbackT, typename... Args>
+void format_chunks(CallbackT callback, const Args&... args);
+
+/// Same as `format_chunks` but with `towstr` semantics.
+template <typename CallbackT, typename... Args>
+void wformat_chunks(CallbackT callback, const Args&... args);
+
+/// Same as `format_chunks` but with `ptostr` semantics.
+template <typename CallbackT, typename... Args>
+void pformat_chunks(CallbackT callback, const Args&... args);
+
+/// Same as `format_chunks` but with `ptowstr` semantics.
+template <typename CallbackT, typename... Args>
+void pwformat_chunks(CallbackT callback, const Args&... args);
+
+/**
+ * @brief Convert each object in [first, last) into std::string by `tostr`,
+ * and write the strings to `out` in the input order. The objects are split
+ * into `threads` chunks formatted in parallel, 0 means
+ * std::thread::hardware_concurrency().
+ */
+template <typename ForwardIt, typename OutputIt>
+OutputIt tostr_batch(ForwardIt first,
+                     ForwardIt last,
+                     OutputIt  out,
+                     size_t    threads = 0);
+
+/// Same as `tostr_batch`, but the strings are packed in one buffer.
+template <typename ForwardIt>
+string_list tostr_batch_list(ForwardIt first,
+                             ForwardIt last,
+                             size_t    threads = 0);
+
+// ==================== definitions ====================
 
 template <typename StringT>
-struct preferences_base {
+class basic_string_builder_buf
+    : public std::basic_streambuf<typename StringT::value_type,
+                                  typename StringT::traits_type> {
+  using base_type = std::basic_streambuf<typename StringT::value_type,
+                                         typename StringT::traits_type>;
+
+public:
   using string_type = StringT;
   using char_type   = typename string_type::value_type;
-  using format_type = ternary_format<string_type>;
+  using traits_type = typename string_type::traits_type;
+  using int_type    = typename traits_type::int_type;
+  using pos_type    = typename traits_type::pos_type;
+  using off_type    = typename traits_type::off_type;
+  using size_type   = typename string_type::size_type;
+  using view_type   = basic_literal_view<char_type, traits_type>;
 
-  preferences_base() {}
+  static constexpr size_type min_capacity = 64;
 
-  void reset_sparse() {
-    // clang-format off
-                     pair_fmt.with({'('}, {',', ' '}, {')'});
-                    tuple_fmt.with({'<'}, {',', ' '}, {'>'});
+  basic_string_builder_buf() { reset_put_area(0); }
 
-                    array_fmt.with({'['}, {',', ' '}, {']'});
-                    deque_fmt.with({'['}, {',', ' '}, {']'});
-             forward_list_fmt.with({'['}, {',', ' '}, {']'});
-         initializer_list_fmt.with({'['}, {',', ' '}, {']'});
-                     list_fmt.with({'['}, {',', ' '}, {']'});
-                   vector_fmt.with({'['}, {',', ' '}, {']'});
+  /// Number of characters written.
+  size_type size() const { return this->pptr() - this->pbase(); }
 
-                      set_fmt.with({'{'}, {',', ' '}, {'}'});
-                 multiset_fmt.with({'{'}, {',', ' '}, {'}'});
-            unordered_set_fmt.with({'{'}, {',', ' '}, {'}'});
-       unordered_multiset_fmt.with({'{'}, {',', ' '}, {'}'});
+  /// Number of characters can be written without reallocation.
+  size_type capacity() const { return buf_.size(); }
 
-                      map_fmt.with({'{'}, {',', ' '}, {'}'});
-                   map_kv_fmt.with({   }, {':', ' '}, {   });
-                 multimap_fmt.with({'{'}, {',', ' '}, {'}'});
-              multimap_kv_fmt.with({   }, {':', ' '}, {   });
-            unordered_map_fmt.with({'{'}, {',', ' '}, {'}'});
-         unordered_map_kv_fmt.with({   }, {':', ' '}, {   });
-       unordered_multimap_fmt.with({'{'}, {',', ' '}, {'}'});
-    unordered_multimap_kv_fmt.with({   }, {':', ' '}, {   });
+  const char_type* data() const { return buf_.data(); }
 
-                    print_fmt.with({   }, {',', ' '}, {   });
-              print_range_fmt.with({   }, {',', ' '}, {   });
+  /// Copy of the written characters.
+  string_type str() const {
+    return string_type(buf_.data(), size(), buf_.get_allocator());
+  }
 
-                     fake_fmt.with({   }, {        }, {   });
-    // clang-format on
+  /// The written characters without copy, invalidated by further writes.
+  view_type view() const { return view_type(buf_.data(), size()); }
+
+  void str(const string_type& s) {
+    buf_ = s;
+    reset_put_area(s.size());
   }
 
-  void reset_dense() {
-    // clang-format off
-                     pair_fmt.with({'('}, {','}, {')'});
-                    tuple_fmt.with({'<'}, {','}, {'>'});
+  void str(string_type&& s) {
+    size_type n = s.size();
+    buf_        = std::move(s);
+    reset_put_area(n);
+  }
 
-                    array_fmt.with({'['}, {','}, {']'});
-                    deque_fmt.with({'['}, {','}, {']'});
-             forward_list_fmt.with({'['}, {','}, {']'});
-         initializer_list_fmt.with({'['}, {','}, {']'});
-                     list_fmt.with({'['}, {','}, {']'});
-                   vector_fmt.with({'['}, {','}, {']'});
+  /// Move the written characters out, leaving the buffer empty.
+  string_type release() {
+    buf_.resize(size());
+    string_type ret(std::move(buf_));
+    buf_.clear();
+    reset_put_area(0);
+    return ret;
+  }
 
-                      set_fmt.with({'{'}, {','}, {'}'});
-                 multiset_fmt.with({'{'}, {','}, {'}'});
-            unordered_set_fmt.with({'{'}, {','}, {'}'});
-       unordered_multiset_fmt.with({'{'}, {','}, {'}'});
+  /// Discard the written characters but keep the capacity.
+  void clear() { reset_put_area(0); }
 
-                      map_fmt.with({'{'}, {','}, {'}'});
-                   map_kv_fmt.with({   }, {':'}, {   });
-                 multimap_fmt.with({'{'}, {','}, {'}'});
-              multimap_kv_fmt.with({   }, {':'}, {   });
-            unordered_map_fmt.with({'{'}, {','}, {'}'});
-         unordered_map_kv_fmt.with({   }, {':'}, {   });
-       unordered_multimap_fmt.with({'{'}, {','}, {'}'});
-    unordered_multimap_kv_fmt.with({   }, {':'}, {   });
+  void reserve(size_type n) {
+    if (n > buf_.size()) grow(n);
+  }
 
-                    print_fmt.with({   }, {','}, {   });
-              print_range_fmt.with({   }, {','}, {   });
+  /// Free unused capacity.
+  void shrink_to_fit() {
+    size_type   n = size();
+    string_type tmp(buf_.data(), n, buf_.get_allocator());
+    buf_.swap(tmp);
+    reset_put_area(n);
+  }
 
-                     fake_fmt.with({   }, {   }, {   });
-    // clang-format on
+protected:
+  int_type overflow(int_type c) override {
+    if (traits_type::eq_int_type(c, traits_type::eof())) {
+      return traits_type::not_eof(c);
+    }
+    grow(size() + 1);
+    *this->pptr() = traits_type::to_char_type(c);
+    this->pbump(1);
+    return c;
   }
 
-  // clang-format off
-  format_type
-      pair_fmt,
-      tuple_fmt,
+  std::streamsize xsputn(const char_type* s, std::streamsize n) override {
+    if (n <= 0) return 0;
+    size_type cnt = static_cast<size_type>(n);
+    if (cnt > static_cast<size_type>(this->epptr() - this->pptr())) {
+      grow(size() + cnt);
+    }
+    traits_type::copy(this->pptr(), s, cnt);
+    advance(cnt);
+    return n;
+  }
 
-      array_fmt,
-      deque_fmt,
-      forward_list_fmt,
-      initializer_list_fmt,
-      list_fmt,
-      vector_fmt,
+  // Only supports tellp().
+  pos_type seekoff(off_type                off,
+                   std::ios_base::seekdir  dir,
+                   std::ios_base::openmode which) override {
+    if (off == 0 && dir == std::ios_base::cur && (which & std::ios_base::out)) {
+      return pos_type(off_type(size()));
+    }
+    return pos_type(off_type(-1));
+  }
 
-      set_fmt,
-      multiset_fmt,
-      unordered_set_fmt,
-      unordered_multiset_fmt,
+private:
+  void grow(size_type need) {
+    size_type len = size();
+    size_type cap = buf_.size() * 2;
+    if (cap < min_capacity) cap = min_capacity;
+    if (cap < need) cap = need;
+    buf_.resize(cap);
+    reset_put_area(len);
+  }
 
-      map_fmt,
-      map_kv_fmt,
-      multimap_fmt,
-      multimap_kv_fmt,
-      unordered_map_fmt,
-      unordered_map_kv_fmt,
-      unordered_multimap_fmt,
-      unordered_multimap_kv_fmt,
+  void reset_put_area(size_type len) {
+    char_type* p = buf_.empty() ? nullptr : &buf_[0];
+    this->setp(p, p + buf_.size());
+    advance(len);
+  }
 
-      print_fmt,
-      print_range_fmt,
+  // pbump only accepts int.
+  void advance(size_type n) {
+    const size_type step = static_cast<size_type>(INT_MAX);
+    for (; n > step; n -= step) this->pbump(INT_MAX);
+    this->pbump(static_cast<int>(n));
+  }
 
-      fake_fmt;
-  // clang-format on
+  string_type buf_;
 };
 
-template <typename PreferencesT>
-class preferences_wrapper {
-  using preference_t = PreferencesT;
+template <typename StringT>
+constexpr typename basic_string_builder_buf<StringT>::size_type
+    basic_string_builder_buf<StringT>::min_capacity;
+
+template <typename StringT>
+class basic_string_builder
+    : public std::basic_ostream<typename StringT::value_type,
+                                typename StringT::traits_type> {
+  using base_type = std::basic_ostream<typename StringT::value_type,
+                                       typename StringT::traits_type>;
 
 public:
-  preferences_wrapper() { static_cast<preference_t*>(this)->reset(); }
-  static preference_t& ins() {
-    static preference_t i;
-    return i;
-  }
-  static preference_t*       ins_ptr() { return &ins(); }
-  static const preference_t& const_ins() { return ins(); }
-  static const preference_t* const_ins_ptr() { return &const_ins(); }
-};
+  using string_type    = StringT;
+  using char_type      = typename string_type::value_type;
+  using traits_type    = typename string_type::traits_type;
+  using allocator_type = typename string_type::allocator_type;
+  using size_type      = typename string_type::size_type;
+  using streambuf_type = basic_string_builder_buf<string_type>;
+  using view_type      = typename streambuf_type::view_type;
 
-template <typename StringT, bool DenseStyle>
-struct default_preferences
-    : public preferences_base<StringT>,
-      public preferences_wrapper<default_preferences<StringT, DenseStyle>> {
-  void reset() { preferences_base<StringT>::reset_sparse(); }
-};
+  basic_string_builder() : base_type(nullptr) { this->init(&buf_); }
 
-template <typename StringT>
-struct default_preferences<StringT, true>
-    : public preferences_base<StringT>,
-      public preferences_wrapper<default_preferences<StringT, true>> {
-  void reset() { preferences_base<StringT>::reset_dense(); }
-};
+  streambuf_type* rdbuf() const { return const_cast<streambuf_type*>(&buf_); }
 
-namespace internal {
+  size_type        size() const { return buf_.size(); }
+  size_type        capacity() const { return buf_.capacity(); }
+  const char_type* data() const { return buf_.data(); }
 
-template <typename OstreamT, typename IteratorT, typename FormatT>
-OstreamT& output_all(OstreamT& os, IteratorT b, IteratorT e, const FormatT& f) {
-  os << f.lb;
-  for (IteratorT it = b; it != e; ++it) {
-    if (it != b) os << f.sep;
-    os << *it;
-  }
-  os << f.rb;
-  return os;
-}
+  string_type str() const { return buf_.str(); }
+  void        str(const string_type& s) { buf_.str(s); }
+  void        str(string_type&& s) { buf_.str(std::move(s)); }
 
-template <typename OstreamT, typename IteratorT, typename FormatT>
-OstreamT& output_all(OstreamT&      os,
-                     IteratorT      b,
-                     IteratorT      e,
-                     const FormatT& f,
-                     const FormatT& kv_f) {
-  os << f.lb;
-  for (IteratorT it = b; it != e; ++it) {
-    if (it != b) os << f.sep;
-    os << kv_f.lb;
-    os << it->first;
-    os << kv_f.sep;
-    os << it->second;
-    os << kv_f.rb;
-  }
-  os << f.rb;
-  return os;
-}
+  /// The result without copy, invalidated by further writes.
+  view_type view() const { return buf_.view(); }
 
-template <typename OstreamT, typename TupleT, size_t N>
-struct tuple_printer {
-  static void print(OstreamT& os, const TupleT& t) {
-    tuple_printer<OstreamT, TupleT, N - 1>::print(os, t);
-    os << os.preferences().tuple_fmt.sep;
-    os << std::get<N - 1>(t);
-  }
-};
+  /// Move the result out without copy, leaving this builder empty.
+  string_type release() { return buf_.release(); }
 
-template <typename OstreamT, typename TupleT>
-struct tuple_printer<OstreamT, TupleT, 1> {
-  static void print(OstreamT& os, const TupleT& t) { os << std::get<0>(t); }
+  void clear_buf() { buf_.clear(); }
+  void reserve(size_type n) { buf_.reserve(n); }
+  void shrink_to_fit() { buf_.shrink_to_fit(); }
+
+private:
+  streambuf_type buf_;
 };
 
-}  // namespace internal
+template <typename StringT>
+class basic_string_list {
+public:
+  using string_type = StringT;
+  using char_type   = typename string_type::value_type;
+  using traits_type = typename string_type::traits_type;
+  using size_type   = typename string_type::size_type;
+  using view_type   = basic_literal_view<char_type, traits_type>;
 
-template <typename OstreamBaseT, typename PreferencesT>
-class basic_ostream : public OstreamBaseT {
-  using base_type = OstreamBaseT;
+  basic_string_list() {}
 
-public:
-  using ostream_base_type = OstreamBaseT;
-  using preferences_type  = PreferencesT;
-  using string_type       = typename preferences_type::string_type;
-  using char_type         = typename preferences_type::char_type;
-  using format_type       = typename preferences_type::format_type;
-  using traits_type       = typename string_type::traits_type;
-  using allocator_type    = typename string_type::allocator_type;
+  /// Take the buffer and the end offset of each string in it.
+  basic_string_list(string_type&& buf, std::vector<size_type>&& ends)
+      : buf_(std::move(buf)), ends_(std::move(ends)) {}
 
-  static_assert(
-      std::is_same<typename OstreamBaseT::char_type, char_type>::value,
-      "OstreamBaseT::char_type must be same type as PreferencesT::char_type");
-  static_assert(
-      std::is_same<typename OstreamBaseT::traits_type, traits_type>::value,
-      "OstreamBaseT::traits_type must be same type as traits_type");
+  size_type size() const { return ends_.size(); }
+  bool      empty() const { return ends_.empty(); }
 
-  template <typename... Args>
-  explicit basic_ostream(Args&&... args)
-      : base_type(std::forward<Args>(args)...) {
-    new_preferences_ptr();
+  size_type offset(size_type i) const { return i == 0 ? 0 : ends_[i - 1]; }
+  size_type length(size_type i) const { return ends_[i] - offset(i); }
+
+  view_type operator[](size_type i) const {
+    return view_type(buf_.data() + offset(i), length(i));
   }
 
-  template <typename... Args>
-  explicit basic_ostream(placeholder::no_init_preferences, Args&&... args)
-      : base_type(std::forward<Args>(args)...), preferences_ptr_(nullptr) {}
+  /// Copy of the i-th string.
+  string_type str(size_type i) const {
+    return string_type(buf_.data() + offset(i), length(i));
+  }
 
-  template <typename... Args>
-  explicit basic_ostream(placeholder::with_preferences_ptr,
-                         preferences_type* pref_ptr,
-                         Args&&... args)
-      : base_type(std::forward<Args>(args)...), preferences_ptr_(pref_ptr) {}
+  /// All strings concatenated.
+  const string_type& buffer() const { return buf_; }
 
-  ~basic_ostream() { delete_preferences_ptr(); }
+private:
+  string_type            buf_;
+  std::vector<size_type> ends_;
+};
 
-  template <typename... Args>
-  basic_ostream& print(const Args&... args) {
-    print(preferences().print_fmt, args...);
-    return *this;
-  }
+template <typename CharT, typename TraitsT>
+class basic_counting_buf : public std::basic_streambuf<CharT, TraitsT> {
+public:
+  using char_type   = CharT;
+  using traits_type = TraitsT;
+  using int_type    = typename traits_type::int_type;
+  using pos_type    = typename traits_type::pos_type;
+  using off_type    = typename traits_type::off_type;
 
-  template <typename... Args>
-  basic_ostream& print(const format_type& fmt, const Args&... args) {
-    *this << fmt.lb;
-    __print(fmt, args...);
-    *this << fmt.rb;
-    return *this;
-  }
+  basic_counting_buf() : count_(0) { this->setp(scratch_, scratch_ + 64); }
 
-  template <typename... Args>
-  basic_ostream& println(const Args&... args) {
-    print(args...) << std::endl;
-    return *this;
+  /// Number of characters written.
+  size_t count() const { return count_ + (this->pptr() - this->pbase()); }
+
+  void reset() {
+    count_ = 0;
+    this->setp(scratch_, scratch_ + 64);
   }
 
-  template <typename... Args>
-  basic_ostream& println(const format_type& fmt, const Args&... args) {
-    print(fmt, args...) << std::endl;
-    return *this;
+protected:
+  // Single characters go to the scratch put area, which is counted and reused
+  // when full.
+  int_type overflow(int_type c) override {
+    count_ += this->pptr() - this->pbase();
+    this->setp(scratch_, scratch_ + 64);
+    if (!traits_type::eq_int_type(c, traits_type::eof())) ++count_;
+    return traits_type::not_eof(c);
   }
 
-  template <typename Iterator>
-  basic_ostream& print_range(Iterator begin, Iterator end) {
-    return print_range(begin, end, preferences().print_range_fmt);
+  std::streamsize xsputn(const char_type*, std::streamsize n) override {
+    if (n > 0) count_ += static_cast<size_t>(n);
+    return n;
   }
 
-  template <typename Iterator>
-  basic_ostream& print_range(Iterator           begin,
-                             Iterator           end,
-                             const format_type& range_fmt) {
-    *this << range_fmt.lb;
-    for (auto it = begin; it != end; ++it) {
-      if (it != begin) *this << range_fmt.sep;
-      *this << *it;
+  // Only supports tellp().
+  pos_type seekoff(off_type                off,
+                   std::ios_base::seekdir  dir,
+                   std::ios_base::openmode which) override {
+    if (off == 0 && dir == std::ios_base::cur && (which & std::ios_base::out)) {
+      return pos_type(off_type(count()));
     }
-    *this << range_fmt.rb;
-    return *this;
+    return pos_type(off_type(-1));
   }
 
-  preferences_type&       preferences() { return *preferences_ptr_; }
-  const preferences_type& preferences() const { return *preferences_ptr_; }
+private:
+  size_t    count_;
+  char_type scratch_[64];
+};
 
-  preferences_type*       preferences_ptr() { return preferences_ptr_; }
-  const preferences_type* preferences_ptr() const { return preferences_ptr_; }
+template <typename CharT, typename TraitsT>
+class basic_counting_ostream : public std::basic_ostream<CharT, TraitsT> {
+  using base_type = std::basic_ostream<CharT, TraitsT>;
+
+public:
+  using char_type      = CharT;
+  using traits_type    = TraitsT;
+  using streambuf_type = basic_counting_buf<CharT, TraitsT>;
 
-  void new_preferences_ptr() { preferences_ptr_ = new preferences_type; }
+  basic_counting_ostream() : base_type(nullptr) { this->init(&buf_); }
 
-  void delete_preferences_ptr() {
-    if (preferences_ptr_) {
-      delete preferences_ptr_;
-      preferences_ptr_ = nullptr;
-    }
-  }
+  streambuf_type* rdbuf() const { return const_cast<streambuf_type*>(&buf_); }
 
-  void set_preferences_ptr(preferences_type* v) { preferences_ptr_ = v; }
+  /// Number of characters written.
+  size_t count() const { return buf_.count(); }
 
-  void clear_preferences_ptr() { set_preferences_ptr(nullptr); }
+  void reset() { buf_.reset(); }
 
 private:
-  basic_ostream& __print(const format_type& fmt) { return *this; }
+  streambuf_type buf_;
+};
 
-  template <typename T>
-  basic_ostream& __print(const format_type& fmt, const T& t) {
-    *this << t;
-    return *this;
+template <typename OutputIt, typename CharT, typename TraitsT>
+class basic_iterator_buf : public std::basic_streambuf<CharT, TraitsT> {
+public:
+  using char_type   = CharT;
+  using traits_type = TraitsT;
+  using int_type    = typename traits_type::int_type;
+
+  explicit basic_iterator_buf(OutputIt out) : out_(out) {
+    this->setp(scratch_, scratch_ + scratch_size);
   }
 
-  template <typename T, typename... Args>
-  basic_ostream& __print(const format_type& fmt,
-                         const T&           t,
-                         const Args&... args) {
-    *this << t;
-    *this << fmt.sep;
-    __print(fmt, args...);
-    return *this;
+  /// Flush pending characters and return the iterator past the last one.
+  OutputIt out() {
+    flush_scratch();
+    return out_;
   }
 
-  preferences_type* preferences_ptr_;
-};
+protected:
+  int_type overflow(int_type c) override {
+    flush_scratch();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *this->pptr() = traits_type::to_char_type(c);
+      this->pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
 
-template <typename OstreamBaseT, typename PreferencesT>
-class basic_ostringstream : public basic_ostream<OstreamBaseT, PreferencesT> {
-  using base_type = basic_ostream<OstreamBaseT, PreferencesT>;
+  std::streamsize xsputn(const char_type* s, std::streamsize n) override {
+    if (n <= 0) return 0;
+    if (n <= this->epptr() - this->pptr()) {
+      traits_type::copy(this->pptr(), s, static_cast<size_t>(n));
+      this->pbump(static_cast<int>(n));
+    } else {
+      flush_scratch();
+      out_ = std::copy(s, s + n, out_);
+    }
+    return n;
+  }
+
+  int sync() override {
+    flush_scratch();
+    return 0;
+  }
+
+private:
+  static constexpr int scratch_size = 256;
+
+  void flush_scratch() {
+    out_ = std::copy(this->pbase(), this->pptr(), out_);
+    this->setp(scratch_, scratch_ + scratch_size);
+  }
+
+  OutputIt  out_;
+  char_type scratch_[scratch_size];
+};
 
+template <typename CharT, typename TraitsT>
+class basic_truncating_buf : public std::basic_streambuf<CharT, TraitsT> {
 public:
-  using ostream_base_type  = typename base_type::ostream_base_type;
-  using preferences_type   = typename base_type::preferences_type;
-  using string_type        = typename base_type::string_type;
-  using char_type          = typename base_type::char_type;
-  using format_type        = typename base_type::format_type;
-  using traits_type        = typename base_type::traits_type;
-  using allocator_type     = typename base_type::allocator_type;
-  using string_vector_type = std::vector<string_type>;
+  using char_type   = CharT;
+  using traits_type = TraitsT;
+  using int_type    = typename traits_type::int_type;
 
-  static_assert(
-      std::is_same<typename OstreamBaseT::allocator_type,
-                   allocator_type>::value,
-      "OstreamBaseT::allocator_type must be same type as allocator_type");
+  basic_truncating_buf(char_type* buf, size_t n) : dropped_(0) {
+    this->setp(buf, buf + n);
+  }
 
-  template <typename... Args>
-  basic_ostringstream(Args&&... args)
-      : base_type(std::forward<Args>(args)...) {}
+  /// End of the written characters.
+  char_type* out() const { return this->pptr(); }
 
-  template <typename... Args>
-  explicit basic_ostringstream(placeholder::no_init_preferences no_init_pref,
-                               Args&&... args)
-      : base_type(no_init_pref, std::forward<Args>(args)...) {}
+  /// Number of characters written into the array.
+  size_t written() const { return this->pptr() - this->pbase(); }
 
-  template <typename... Args>
-  explicit basic_ostringstream(placeholder::with_preferences_ptr with_pref_ptr,
-                               preferences_type*                 pref_ptr,
-                               Args&&... args)
-      : base_type(with_pref_ptr, pref_ptr, std::forward<Args>(args)...) {}
+  /// Number of all characters put, including discarded ones.
+  size_t size() const { return written() + dropped_; }
 
-  template <typename... Args>
-  string_vector_type to_string_vector(const Args&... args) {
-    auto old = ostream_base_type::str();
-    clear_buf();
-    string_vector_type ret;
-    __to_string_vector(ret, args...);
-    *this << old;
-    return ret;
+protected:
+  // Only be called when the array is full.
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) ++dropped_;
+    return traits_type::not_eof(c);
   }
 
-  void clear_buf() { ostream_base_type::str(string_type{}); }
+  std::streamsize xsputn(const char_type* s, std::streamsize n) override {
+    if (n <= 0) return 0;
+    size_t len  = static_cast<size_t>(n);
+    size_t room = this->epptr() - this->pptr();
+    size_t w    = len < room ? len : room;
+    traits_type::copy(this->pptr(), s, w);
+    dropped_ += len - w;
+    while (w > 0) {
+      int step = w > INT_MAX ? INT_MAX : static_cast<int>(w);
+      this->pbump(step);
+      w -= step;
+    }
+    return n;
+  }
 
 private:
-  void __to_string_vector(string_vector_type& ret) {}
+  size_t dropped_;
+};
 
-  template <typename T, typename... Args>
-  void __to_string_vector(string_vector_type& ret,
-                          const T&            t,
-                          const Args&... args) {
-    *this << t;
-    ret.push_back(ostream_base_type::str());
-    clear_buf();
-    __to_string_vector(ret, args...);
+template <typename CallbackT, typename CharT, typename TraitsT>
+class basic_chunk_buf : public std::basic_streambuf<CharT, TraitsT> {
+public:
+  using char_type   = CharT;
+  using traits_type = TraitsT;
+  using int_type    = typename traits_type::int_type;
+  using pos_type    = typename traits_type::pos_type;
+  using off_type    = typename traits_type::off_type;
+
+  /// Characters of a chunk on default.
+  static constexpr size_t default_chunk_size = 65536;
+
+  explicit basic_chunk_buf(CallbackT callback,
+                           size_t    chunk_size = default_chunk_size)
+      : callback_(std::forward<CallbackT>(callback)),
+        chunk_size_(chunk_size != 0 ? chunk_size : 1),
+        chunk_(new char_type[chunk_size_]),
+        handed_(0) {
+    this->setp(chunk_.get(), chunk_.get() + chunk_size_);
   }
-};
 
-template <typename OstreamBaseT,
-          typename PreferencesT,
-          typename FirstT,
-          typename SecondT>
-basic_ostream<OstreamBaseT, PreferencesT>& operator<<(
-    basic_ostream<OstreamBaseT, PreferencesT>& os,
-    const std::pair<FirstT, SecondT>&          p) {
-  os << os.preferences().pair_fmt.lb;
-  os << p.first;
-  os << os.preferences().pair_fmt.sep;
-  os << p.second;
-  os << os.preferences().pair_fmt.rb;
-  return os;
-}
+  ~basic_chunk_buf() { hand_chunk(); }
 
-template <typename OstreamBaseT, typename PreferencesT>
-basic_ostream<OstreamBaseT, PreferencesT>& operator<<(
-    basic_ostream<OstreamBaseT, PreferencesT>& os, const std::tuple<>& t) {
-  os << os.preferences().tuple_fmt.lb;
-  os << os.preferences().tuple_fmt.rb;
-  return os;
-}
+  basic_chunk_buf(const basic_chunk_buf&)            = delete;
+  basic_chunk_buf& operator=(const basic_chunk_buf&) = delete;
 
-template <typename OstreamBaseT, typename PreferencesT, typename... Args>
-basic_ostream<OstreamBaseT, PreferencesT>& operator<<(
-    basic_ostream<OstreamBaseT, PreferencesT>& os,
-    const std::tuple<Args...>&                 t) {
-  os << os.preferences().tuple_fmt.lb;
-  internal::tuple_printer<basic_ostream<OstreamBaseT, PreferencesT>,
-                          std::tuple<Args...>,
-                          sizeof...(Args)>::print(os, t);
-  os << os.preferences().tuple_fmt.rb;
-  return os;
-}
+  /// Number of characters written, including the ones not handed yet.
+  size_t size() const { return handed_ + (this->pptr() - this->pbase()); }
 
-template <typename OstreamBaseT,
-          typename PreferencesT,
-          typename T,
-          std::size_t N>
-basic_ostream<OstreamBaseT, PreferencesT>& operator<<(
-    basic_ostream<OstreamBaseT, PreferencesT>& os, const std::array<T, N>& c) {
-  return internal::output_all(
-      os, c.begin(), c.end(), os.preferences().array_fmt);
-}
+  /// Exception thrown by the callback, or null.
+  std::exception_ptr error() const { return error_; }
 
-#define MYOSTREAM_DEFINE_OVERLOAD(container)                       \
-  MYOSTREAM_DECLARE_OVERLOAD(container) {                          \
-    return internal::output_all(                                   \
-        os, c.begin(), c.end(), os.preferences().container##_fmt); \
+protected:
+  // Only be called when the chunk is full.
+  int_type overflow(int_type c) override {
+    if (!hand_chunk()) return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *this->pptr() = traits_type::to_char_type(c);
+      this->pbump(1);
+    }
+    return traits_type::not_eof(c);
   }
 
-#define MYOSTREAM_DEFINE_OVERLOAD_FOR_MAP(container)                  \
-  MYOSTREAM_DECLARE_OVERLOAD(container) {                             \
-    return internal::output_all(os,                                   \
-                                c.begin(),                            \
-                                c.end(),                              \
-                                os.preferences().container##_fmt,     \
-                                os.preferences().container##_kv_fmt); \
+  std::streamsize xsputn(const char_type* s, std::streamsize n) override {
+    std::streamsize done = 0;
+    while (done < n) {
+      if (this->pptr() == this->epptr() && !hand_chunk()) break;
+      std::streamsize room = this->epptr() - this->pptr();
+      std::streamsize len  = n - done < room ? n - done : room;
+      traits_type::copy(this->pptr(), s + done, static_cast<size_t>(len));
+      this->pbump(static_cast<int>(len));
+      done += len;
+    }
+    return done;
   }
 
-MYOSTREAM_DEFINE_OVERLOAD(deque)
-MYOSTREAM_DEFINE_OVERLOAD(forward_list)
-MYOSTREAM_DEFINE_OVERLOAD(initializer_list)
-MYOSTREAM_DEFINE_OVERLOAD(list)
-MYOSTREAM_DEFINE_OVERLOAD(vector)
+  int sync() override { return hand_chunk() ? 0 : -1; }
 
-MYOSTREAM_DEFINE_OVERLOAD(set)
-MYOSTREAM_DEFINE_OVERLOAD(multiset)
-MYOSTREAM_DEFINE_OVERLOAD(unordered_set)
-MYOSTREAM_DEFINE_OVERLOAD(unordered_multiset)
+  // Only supports tellp().
+  pos_type seekoff(off_type                off,
+                   std::ios_base::seekdir  dir,
+                   std::ios_base::openmode which) override {
+    if (off == 0 && dir == std::ios_base::cur && (which & std::ios_base::out)) {
+      return pos_type(off_type(size()));
+    }
+    return pos_type(off_type(-1));
+  }
 
-MYOSTREAM_DEFINE_OVERLOAD_FOR_MAP(map)
-MYOSTREAM_DEFINE_OVERLOAD_FOR_MAP(multimap)
-MYOSTREAM_DEFINE_OVERLOAD_FOR_MAP(unordered_map)
-MYOSTREAM_DEFINE_OVERLOAD_FOR_MAP(unordered_multimap)
+private:
+  bool hand_chunk() {
+    const size_t n = this->pptr() - this->pbase();
+    this->setp(chunk_.get(), chunk_.get() + chunk_size_);
+    if (error_) return false;
+    if (n == 0) return true;
+    try {
+      callback_(static_cast<const char_type*>(chunk_.get()), n);
+    } catch (...) {
+      error_ = std::current_exception();
+      return false;
+    }
+    handed_ += n;
+    return true;
+  }
 
-#undef MYOSTREAM_DEFINE_OVERLOAD_FOR_MAP
-#undef MYOSTREAM_DEFINE_OVERLOAD
-#undef MYOSTREAM_DECLARE_OVERLOAD
+  CallbackT                    callback_;
+  size_t                       chunk_size_;
+  std::unique_ptr<char_type[]> chunk_;
+  size_t                       handed_;
+  std::exception_ptr           error_;
+};
 
-template <typename OstreamBaseT, bool DenseStyle, typename... Args>
-string_type_by_ostream<OstreamBaseT> basic_tostr(const Args&... args) {
-  using oss_t = basic_ostringstream_with_const_default_preferences<OstreamBaseT,
-                                                                   DenseStyle>;
-  oss_t oss(placeholder::with_preferences_ptr{},
-            oss_t::preferences_type::const_ins_ptr());
-  oss.print(oss.preferences().fake_fmt, args...);
-  oss.clear_preferences_ptr();
-  return oss.str();
-}
+template <typename CallbackT, typename CharT, typename TraitsT>
+constexpr size_t basic_chunk_buf<CallbackT, CharT, TraitsT>::default_chunk_size;
 
-template <typename OstreamBaseT, bool DenseStyle, typename... Args>
-string_type_by_ostream<OstreamBaseT> basic_ptostr(const Args&... args) {
-  using oss_t = basic_ostringstream_with_const_default_preferences<OstreamBaseT,
-                                                                   DenseStyle>;
-  oss_t oss(placeholder::with_preferences_ptr{},
-            oss_t::preferences_type::const_ins_ptr());
-  oss.print(args...);
-  oss.clear_preferences_ptr();
-  return oss.str();
-}
+template <typename CharT, typename TraitsT>
+class basic_chunk_ostream : public std::basic_ostream<CharT, TraitsT> {
+  using base_type = std::basic_ostream<CharT, TraitsT>;
 
-template <typename... Args>
-std::string tostr(const Args&... args) {
-  return basic_tostr<std::ostringstream, false>(args...);
-}
+public:
+  using char_type      = CharT;
+  using traits_type    = TraitsT;
+  using callback_type  = std::function<void(const char_type*, size_t)>;
+  using streambuf_type = basic_chunk_buf<callback_type, CharT, TraitsT>;
+
+  explicit basic_chunk_ostream(
+      callback_type callback,
+      size_t        chunk_size = streambuf_type::default_chunk_size)
+      : base_type(nullptr), buf_(std::move(callback), chunk_size) {
+    this->init(&buf_);
+  }
 
-template <typename... Args>
-std::wstring towstr(const Args&... args) {
+  streambuf_type* rdbuf() const { return const_cast<streambuf_type*>(&buf_); }
+
+  /// Number of characters written.
+  size_t size() const { return buf_.size(); }
+
+private:
+  streambuf_type buf_;
+};
+
+#ifdef MYOSTREAM_HAS_MMAP
+template <typename CharT, typename TraitsT>
+class basic_mmap_file_buf : public std::basic_streambuf<CharT, TraitsT> {
+public:
+  using char_type   = CharT;
+  using traits_type = TraitsT;
+  using int_type    = typename traits_type::int_type;
+  using pos_type    = typename traits_type::pos_type;
+  using off_type    = typename traits_type::off_type;
+
+  /// Bytes mapped at a time on default.
+  static constexpr size_t default_window_bytes = size_t(64) << 20;
+
+  /// The window is rounded up to whole pages, and is at most 1 GiB.
+  explicit basic_mmap_file_buf(size_t window_bytes = default_window_bytes)
+      : fd_(-1), window_bytes_(round_window(window_bytes)), offset_(0) {}
+
+  ~basic_mmap_file_buf() { close(); }
+
+  basic_mmap_file_buf(const basic_mmap_file_buf&)            = delete;
+  basic_mmap_file_buf& operator=(const basic_mmap_file_buf&) = delete;
+
+  /// Create or truncate the file, return null on failure.
+  basic_mmap_file_buf* open(const char* path) {
+    if (is_open()) return nullptr;
+    fd_ = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd_ < 0) return nullptr;
+    offset_ = 0;
+    if (!map_window()) {
+      ::close(fd_);
+      fd_ = -1;
+      return nullptr;
+    }
+    return this;
+  }
+
+  basic_mmap_file_buf* open(const std::string& path) {
+    return open(path.c_str());
+  }
+
+  bool is_open() const { return fd_ >= 0; }
+
+  /// Number of characters written.
+  size_t size() const {
+    return offset_ / sizeof(char_type) + (this->pptr() - this->pbase());
+  }
+
+  /// Unmap the window, truncate the file to the written size and close it.
+  /// Return null on failure.
+  basic_mmap_file_buf* close() {
+    if (!is_open()) return nullptr;
+    const off_t end = static_cast<off_t>(size() * sizeof(char_type));
+    bool        ok  = unmap_window();
+    ok              = ::ftruncate(fd_, end) == 0 && ok;
+    ok              = ::close(fd_) == 0 && ok;
+    fd_             = -1;
+    offset_         = 0;
+    return ok ? this : nullptr;
+  }
+
+protected:
+  // Only be called when the window is full.
+  int_type overflow(int_type c) override {
+    if (!next_window()) return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *this->pptr() = traits_type::to_char_type(c);
+      this->pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char_type* s, std::streamsize n) override {
+    std::streamsize done = 0;
+    while (done < n) {
+      if (this->pptr() == this->epptr() && !next_window()) break;
+      std::streamsize room = this->epptr() - this->pptr();
+      std::streamsize len  = n - done < room ? n - done : room;
+      traits_type::copy(this->pptr(), s + done, static_cast<size_t>(len));
+      this->pbump(static_cast<int>(len));
+      done += len;
+    }
+    return done;
+  }
+
+  // Only supports tellp().
+  pos_type seekoff(off_type                off,
+                   std::ios_base::seekdir  dir,
+                   std::ios_base::openmode which) override {
+    if (off == 0 && dir == std::ios_base::cur && (which & std::ios_base::out)) {
+      return pos_type(off_type(size()));
+    }
+    return pos_type(off_type(-1));
+  }
+
+private:
+  static size_t round_window(size_t bytes) {
+    const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    const size_t max  = size_t(1) << 30;
+    if (bytes > max) bytes = max;
+    return bytes < page ? page : (bytes + page - 1) / page * page;
+  }
+
+  // Allocate the file blocks of the window first, so a full disk fails here
+  // rather than by SIGBUS when writing the mapped pages.
+  bool reserve_window() {
+#ifdef __linux__
+    if (::fallocate(fd_,
+                    0,
+                    static_cast<off_t>(offset_),
+                    static_cast<off_t>(window_bytes_)) == 0) {
+      return true;
+    }
+    if (errno != EOPNOTSUPP) return false;
+#endif
+    return ::ftruncate(fd_, static_cast<off_t>(offset_ + window_bytes_)) == 0;
+  }
+
+  bool map_window() {
+    this->setp(nullptr, nullptr);
+    if (!reserve_window()) return false;
+    void* p = ::mmap(nullptr,
+                     window_bytes_,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED,
+                     fd_,
+                     static_cast<off_t>(offset_));
+    if (p == MAP_FAILED) return false;
+    char_type* b = static_cast<char_type*>(p);
+    this->setp(b, b + window_bytes_ / sizeof(char_type));
+    return true;
+  }
+
+  bool unmap_window() {
+    char_type* b = this->pbase();
+    if (b == nullptr) return true;
+    offset_ += (this->pptr() - b) * sizeof(char_type);
+    this->setp(nullptr, nullptr);
+    return ::munmap(b, window_bytes_) == 0;
+  }
+
+  bool next_window() { return is_open() && unmap_window() && map_window(); }
+
+  int    fd_;
+  size_t window_bytes_;
+  // File offset of the window in bytes, also the bytes written before it.
+  size_t offset_;
+};
+
+template <typename CharT, typename TraitsT>
+constexpr size_t basic_mmap_file_buf<CharT, TraitsT>::default_window_bytes;
+
+template <typename CharT, typename TraitsT>
+class basic_mmap_ofstream : public std::basic_ostream<CharT, TraitsT> {
+  using base_type = std::basic_ostream<CharT, TraitsT>;
+
+public:
+  using char_type      = CharT;
+  using traits_type    = TraitsT;
+  using streambuf_type = basic_mmap_file_buf<CharT, TraitsT>;
+
+  basic_mmap_ofstream() : base_type(nullptr) { this->init(&buf_); }
+
+  explicit basic_mmap_ofstream(
+      const std::string& path,
+      size_t             window_bytes = streambuf_type::default_window_bytes)
+      : base_type(nullptr), buf_(window_bytes) {
+    this->init(&buf_);
+    open(path);
+  }
+
+  void open(const std::string& path) {
+    if (buf_.open(path)) {
+      this->clear();
+    } else {
+      this->setstate(std::ios_base::failbit);
+    }
+  }
+
+  void close() {
+    if (!buf_.close()) this->setstate(std::ios_base::failbit);
+  }
+
+  bool is_open() const { return buf_.is_open(); }
+
+  streambuf_type* rdbuf() const { return const_cast<streambuf_type*>(&buf_); }
+
+  /// Number of characters written.
+  size_t size() const { return buf_.size(); }
+
+private:
+  streambuf_type buf_;
+};
+#endif  // MYOSTREAM_HAS_MMAP
+
+template <typename CharT, typename TraitsT>
+class basic_literal_view {
+public:
+  using value_type  = CharT;
+  using traits_type = TraitsT;
+  using size_type   = size_t;
+
+  constexpr basic_literal_view() : data_(nullptr), size_(0) {}
+
+  /// From a null-terminated character array, e.g. a string literal.
+  template <size_t N>
+  constexpr basic_literal_view(const value_type (&s)[N])
+      : data_(s), size_(N - 1) {}
+
+  constexpr basic_literal_view(const value_type* s, size_type n)
+      : data_(s), size_(n) {}
+
+  constexpr const value_type* data() const { return data_; }
+  constexpr size_type         size() const { return size_; }
+  constexpr bool              empty() const { return size_ == 0; }
+  constexpr const value_type* begin() const { return data_; }
+  constexpr const value_type* end() const { return data_ + size_; }
+
+  constexpr const value_type& operator[](size_type i) const { return data_[i]; }
+
+#ifdef MYOSTREAM_HAS_STRING_VIEW
+  constexpr operator std::basic_string_view<value_type, traits_type>() const {
+    return {data_, size_};
+  }
+#endif  // MYOSTREAM_HAS_STRING_VIEW
+
+private:
+  const value_type* data_;
+  size_type         size_;
+};
+
+template <typename CharT, typename TraitsT>
+std::basic_ostream<CharT, TraitsT>& operator<<(
+    std::basic_ostream<CharT, TraitsT>&          os,
+    const basic_literal_view<CharT, TraitsT>& v) {
+  if (os.width() == 0) {
+    os.write(v.data(), v.size());
+  } else {
+    os << std::basic_string<CharT, TraitsT>(v.data(), v.size());
+  }
+  return os;
+}
+
+template <typename StringT>
+struct ternary_format {
+  using string_type = StringT;
+  using char_type   = typename string_type::value_type;
+
+  ternary_format() {}
+
+  constexpr ternary_format(const string_type& left_border,
+                           const string_type& separator,
+                           const string_type& right_border)
+      : lb(left_border), sep(separator), rb(right_border) {}
+
+  // static_cast rather than std::move, which is not constexpr in C++11.
+  constexpr ternary_format(string_type&& left_border,
+                           string_type&& separator,
+                           string_type&& right_border)
+      : lb(static_cast<string_type&&>(left_border)),
+        sep(static_cast<string_type&&>(separator)),
+        rb(static_cast<string_type&&>(right_border)) {}
+
+  // clang-format off
+  ternary_format& with_lb (const string_type& s) {lb  = s; return *this;}
+  ternary_format& with_sep(const string_type& s) {sep = s; return *this;}
+  ternary_format& with_rb (const string_type& s) {rb  = s; return *this;}
+  ternary_format& with_lb (string_type&& s) {lb  = std::move(s); return *this;}
+  ternary_format& with_sep(string_type&& s) {sep = std::move(s); return *this;}
+  ternary_format& with_rb (string_type&& s) {rb  = std::move(s); return *this;}
+  // clang-format on
+
+  ternary_format& with(const string_type& left_border,
+                       const string_type& separator,
+                       const string_type& right_border) {
+    lb  = left_border;
+    sep = separator;
+    rb  = right_border;
+    return *this;
+  }
+
+  ternary_format& with(string_type&& left_border,
+                       string_type&& separator,
+                       string_type&& right_border) {
+    lb  = std::move(left_border);
+    sep = std::move(separator);
+    rb  = std::move(right_border);
+    return *this;
+  }
+
+  string_type lb, sep, rb;
+};
+
+template <typename StringT>
+struct preferences_base {
+  using string_type = StringT;
+  using char_type   = typename string_type::value_type;
+  using format_type = ternary_format<string_type>;
+
+  preferences_base() {}
+
+  void reset_sparse() {
+    // clang-format off
+                     pair_fmt.with({'('}, {',', ' '}, {')'});
+                    tuple_fmt.with({'<'}, {',', ' '}, {'>'});
+
+                    array_fmt.with({'['}, {',', ' '}, {']'});
+                    deque_fmt.with({'['}, {',', ' '}, {']'});
+             forward_list_fmt.with({'['}, {',', ' '}, {']'});
+         initializer_list_fmt.with({'['}, {',', ' '}, {']'});
+                     list_fmt.with({'['}, {',', ' '}, {']'});
+                   vector_fmt.with({'['}, {',', ' '}, {']'});
+
+                      set_fmt.with({'{'}, {',', ' '}, {'}'});
+                 multiset_fmt.with({'{'}, {',', ' '}, {'}'});
+            unordered_set_fmt.with({'{'}, {',', ' '}, {'}'});
+       unordered_multiset_fmt.with({'{'}, {',', ' '}, {'}'});
+
+                      map_fmt.with({'{'}, {',', ' '}, {'}'});
+                   map_kv_fmt.with({   }, {':', ' '}, {   });
+                 multimap_fmt.with({'{'}, {',', ' '}, {'}'});
+              multimap_kv_fmt.with({   }, {':', ' '}, {   });
+            unordered_map_fmt.with({'{'}, {',', ' '}, {'}'});
+         unordered_map_kv_fmt.with({   }, {':', ' '}, {   });
+       unordered_multimap_fmt.with({'{'}, {',', ' '}, {'}'});
+    unordered_multimap_kv_fmt.with({   }, {':', ' '}, {   });
+
+                    print_fmt.with({   }, {',', ' '}, {   });
+              print_range_fmt.with({   }, {',', ' '}, {   });
+
+                     fake_fmt.with({   }, {        }, {   });
+    // clang-format on
+    float_output      = float_format::ostream;
+    limits            = output_limits();
+    summary_min_size  = 0;
+    parallel_min_size = 0;
+    parallel_threads  = 0;
+  }
+
+  void reset_dense() {
+    // clang-format off
+                     pair_fmt.with({'('}, {','}, {')'});
+                    tuple_fmt.with({'<'}, {','}, {'>'});
+
+                    array_fmt.with({'['}, {','}, {']'});
+                    deque_fmt.with({'['}, {','}, {']'});
+             forward_list_fmt.with({'['}, {','}, {']'});
+         initializer_list_fmt.with({'['}, {','}, {']'});
+                     list_fmt.with({'['}, {','}, {']'});
+                   vector_fmt.with({'['}, {','}, {']'});
+
+                      set_fmt.with({'{'}, {','}, {'}'});
+                 multiset_fmt.with({'{'}, {','}, {'}'});
+            unordered_set_fmt.with({'{'}, {','}, {'}'});
+       unordered_multiset_fmt.with({'{'}, {','}, {'}'});
+
+                      map_fmt.with({'{'}, {','}, {'}'});
+                   map_kv_fmt.with({   }, {':'}, {   });
+                 multimap_fmt.with({'{'}, {','}, {'}'});
+              multimap_kv_fmt.with({   }, {':'}, {   });
+            unordered_map_fmt.with({'{'}, {','}, {'}'});
+         unordered_map_kv_fmt.with({   }, {':'}, {   });
+       unordered_multimap_fmt.with({'{'}, {','}, {'}'});
+    unordered_multimap_kv_fmt.with({   }, {':'}, {   });
+
+                    print_fmt.with({   }, {','}, {   });
+              print_range_fmt.with({   }, {','}, {   });
+
+                     fake_fmt.with({   }, {   }, {   });
+    // clang-format on
+    float_output      = float_format::ostream;
+    limits            = output_limits();
+    summary_min_size  = 0;
+    parallel_min_size = 0;
+    parallel_threads  = 0;
+  }
+
+  // clang-format off
+  format_type
+      pair_fmt,
+      tuple_fmt,
+
+      array_fmt,
+      deque_fmt,
+      forward_list_fmt,
+      initializer_list_fmt,
+      list_fmt,
+      vector_fmt,
+
+      set_fmt,
+      multiset_fmt,
+      unordered_set_fmt,
+      unordered_multiset_fmt,
+
+      map_fmt,
+      map_kv_fmt,
+      multimap_fmt,
+      multimap_kv_fmt,
+      unordered_map_fmt,
+      unordered_map_kv_fmt,
+      unordered_multimap_fmt,
+      unordered_multimap_kv_fmt,
+
+      print_fmt,
+      print_range_fmt,
+
+      fake_fmt;
+  // clang-format on
+
+  float_format float_output;
+
+  output_limits limits;
+
+  // Print numeric vectors and arrays with at least this many items as
+  // `summary`, 0 means never.
+  size_t summary_min_size;
+
+  // Format containers with at least this many items in parallel, 0 means
+  // never. The output is the same as serial.
+  size_t parallel_min_size;
+
+  // Number of threads for parallel formatting, 0 means
+  // std::thread::hardware_concurrency().
+  size_t parallel_threads;
+};
+
+template <typename PreferencesT>
+class preferences_wrapper {
+  using preference_t = PreferencesT;
+
+public:
+  preferences_wrapper() { static_cast<preference_t*>(this)->reset(); }
+  static preference_t& ins() {
+    static preference_t i;
+    return i;
+  }
+  static preference_t*       ins_ptr() { return &ins(); }
+  static const preference_t& const_ins() { return ins(); }
+  static const preference_t* const_ins_ptr() { return &const_ins(); }
+};
+
+template <typename StringT, bool DenseStyle>
+struct default_preferences
+    : public preferences_base<StringT>,
+      public preferences_wrapper<default_preferences<StringT, DenseStyle>> {
+  void reset() { preferences_base<StringT>::reset_sparse(); }
+};
+
+template <typename StringT>
+struct default_preferences<StringT, true>
+    : public preferences_base<StringT>,
+      public preferences_wrapper<default_preferences<StringT, true>> {
+  void reset() { preferences_base<StringT>::reset_dense(); }
+};
+
+/**
+ * @brief Holds preferences which can be replaced at runtime while other threads
+ * are printing by them. Each version is an immutable object: writers publish a
+ * new one, readers keep a snapshot of the one they got. A version is deleted
+ * when its last snapshot is released.
+ *
+ * A stream bound to a holder by `basic_ostream::bind_preferences` checks the
+ * version at the start of each output, by one atomic load, and takes a new
+ * snapshot only after a change. So it prints with no lock and no reference
+ * counting, and one output never mixes two versions.
+ * @tparam PreferencesT A `default_preferences`.
+ */
+template <typename PreferencesT>
+class basic_preferences_holder {
+public:
+  using preferences_type = PreferencesT;
+  using snapshot_type    = std::shared_ptr<const preferences_type>;
+
+  basic_preferences_holder()
+      : current_(std::make_shared<const preferences_type>()), version_(1) {}
+
+  explicit basic_preferences_holder(const preferences_type& p)
+      : current_(std::make_shared<const preferences_type>(p)), version_(1) {}
+
+  basic_preferences_holder(const basic_preferences_holder&)            = delete;
+  basic_preferences_holder& operator=(const basic_preferences_holder&) = delete;
+
+  /// Increased by each publication, lock free.
+  uint64_t version() const { return version_.load(std::memory_order_acquire); }
+
+  /// The current preferences, which stays valid while the snapshot is held.
+  snapshot_type load() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return current_;
+  }
+
+  /// Publish a copy of p.
+  void store(const preferences_type& p) {
+    publish(std::make_shared<const preferences_type>(p));
+  }
+
+  /// Publish a copy of the current preferences modified by f, which is called
+  /// with a `preferences_type&`. Concurrent updates are applied one by one.
+  template <typename F>
+  void update(F f) {
+    std::lock_guard<std::mutex> lock(update_mu_);
+    std::shared_ptr<preferences_type> next =
+        std::make_shared<preferences_type>(*load());
+    f(*next);
+    publish(std::move(next));
+  }
+
+private:
+  void publish(snapshot_type next) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      current_.swap(next);
+      version_.fetch_add(1, std::memory_order_release);
+    }
+    // The old version is released here, outside of the lock.
+  }
+
+  mutable std::mutex    mu_;
+  std::mutex            update_mu_;
+  snapshot_type         current_;
+  std::atomic<uint64_t> version_;
+};
+
+template <typename StringT, bool DenseStyle = false>
+using preferences_holder =
+    basic_preferences_holder<default_preferences<StringT, DenseStyle>>;
+
+namespace internal {
+
+// Base of compile-time preferences, which have no mutable state.
+struct static_preferences_tag {};
+
+template <typename PreferencesT>
+using is_static_preferences =
+    std::is_base_of<static_preferences_tag,
+                    typename std::remove_const<PreferencesT>::type>;
+
+template <typename PreferencesT>
+struct preferences_traits {
+  using value_type = typename std::remove_const<PreferencesT>::type;
+
+  // Whether a stream copies the shared default before exposing it mutably.
+  static constexpr bool copy_on_write =
+      !std::is_const<PreferencesT>::value &&
+      !is_static_preferences<PreferencesT>::value;
+
+  // Default instance shared by streams, never modified.
+  static PreferencesT* shared_default() {
+    static value_type i;
+    return &i;
+  }
+};
+
+// Null-terminated border and separator literals of each character type.
+template <typename CharT>
+struct static_literals {
+  static constexpr CharT empty[]       = {0};
+  static constexpr CharT lparen[]      = {'(', 0};
+  static constexpr CharT rparen[]      = {')', 0};
+  static constexpr CharT langle[]      = {'<', 0};
+  static constexpr CharT rangle[]      = {'>', 0};
+  static constexpr CharT lbracket[]    = {'[', 0};
+  static constexpr CharT rbracket[]    = {']', 0};
+  static constexpr CharT lbrace[]      = {'{', 0};
+  static constexpr CharT rbrace[]      = {'}', 0};
+  static constexpr CharT comma[]       = {',', 0};
+  static constexpr CharT comma_space[] = {',', ' ', 0};
+  static constexpr CharT colon[]       = {':', 0};
+  static constexpr CharT colon_space[] = {':', ' ', 0};
+};
+
+#define MYOSTREAM_DEFINE_STATIC_LITERAL(name, size) \
+  template <typename CharT>                         \
+  constexpr CharT static_literals<CharT>::name[size];
+
+MYOSTREAM_DEFINE_STATIC_LITERAL(empty, 1)
+MYOSTREAM_DEFINE_STATIC_LITERAL(lparen, 2)
+MYOSTREAM_DEFINE_STATIC_LITERAL(rparen, 2)
+MYOSTREAM_DEFINE_STATIC_LITERAL(langle, 2)
+MYOSTREAM_DEFINE_STATIC_LITERAL(rangle, 2)
+MYOSTREAM_DEFINE_STATIC_LITERAL(lbracket, 2)
+MYOSTREAM_DEFINE_STATIC_LITERAL(rbracket, 2)
+MYOSTREAM_DEFINE_STATIC_LITERAL(lbrace, 2)
+MYOSTREAM_DEFINE_STATIC_LITERAL(rbrace, 2)
+MYOSTREAM_DEFINE_STATIC_LITERAL(comma, 2)
+MYOSTREAM_DEFINE_STATIC_LITERAL(comma_space, 3)
+MYOSTREAM_DEFINE_STATIC_LITERAL(colon, 2)
+MYOSTREAM_DEFINE_STATIC_LITERAL(colon_space, 3)
+
+#undef MYOSTREAM_DEFINE_STATIC_LITERAL
+
+}  // namespace internal
+
+template <typename StringT, bool DenseStyle>
+struct static_preferences : public internal::static_preferences_tag {
+  using string_type = StringT;
+  using char_type   = typename string_type::value_type;
+  using view_type =
+      basic_literal_view<char_type, typename string_type::traits_type>;
+  using format_type = ternary_format<view_type>;
+
+  constexpr static_preferences() {}
+
+private:
+  using lit = internal::static_literals<char_type>;
+
+  static constexpr view_type item_sep =
+      DenseStyle ? view_type(lit::comma) : view_type(lit::comma_space);
+  static constexpr view_type kv_sep =
+      DenseStyle ? view_type(lit::colon) : view_type(lit::colon_space);
+
+public:
+  // clang-format off
+  static constexpr format_type                  pair_fmt{lit::lparen,   item_sep, lit::rparen  };
+  static constexpr format_type                 tuple_fmt{lit::langle,   item_sep, lit::rangle  };
+
+  static constexpr format_type                 array_fmt{lit::lbracket, item_sep, lit::rbracket};
+  static constexpr format_type                 deque_fmt{lit::lbracket, item_sep, lit::rbracket};
+  static constexpr format_type          forward_list_fmt{lit::lbracket, item_sep, lit::rbracket};
+  static constexpr format_type      initializer_list_fmt{lit::lbracket, item_sep, lit::rbracket};
+  static constexpr format_type                  list_fmt{lit::lbracket, item_sep, lit::rbracket};
+  static constexpr format_type                vector_fmt{lit::lbracket, item_sep, lit::rbracket};
+
+  static constexpr format_type                   set_fmt{lit::lbrace,   item_sep, lit::rbrace  };
+  static constexpr format_type              multiset_fmt{lit::lbrace,   item_sep, lit::rbrace  };
+  static constexpr format_type         unordered_set_fmt{lit::lbrace,   item_sep, lit::rbrace  };
+  static constexpr format_type    unordered_multiset_fmt{lit::lbrace,   item_sep, lit::rbrace  };
+
+  static constexpr format_type                   map_fmt{lit::lbrace,   item_sep, lit::rbrace  };
+  static constexpr format_type                map_kv_fmt{lit::empty,    kv_sep,   lit::empty   };
+  static constexpr format_type              multimap_fmt{lit::lbrace,   item_sep, lit::rbrace  };
+  static constexpr format_type           multimap_kv_fmt{lit::empty,    kv_sep,   lit::empty   };
+  static constexpr format_type         unordered_map_fmt{lit::lbrace,   item_sep, lit::rbrace  };
+  static constexpr format_type      unordered_map_kv_fmt{lit::empty,    kv_sep,   lit::empty   };
+  static constexpr format_type    unordered_multimap_fmt{lit::lbrace,   item_sep, lit::rbrace  };
+  static constexpr format_type unordered_multimap_kv_fmt{lit::empty,    kv_sep,   lit::empty   };
+
+  static constexpr format_type                 print_fmt{lit::empty,    item_sep, lit::empty   };
+  static constexpr format_type           print_range_fmt{lit::empty,    item_sep, lit::empty   };
+
+  static constexpr format_type                  fake_fmt{lit::empty,    lit::empty, lit::empty };
+  // clang-format on
+
+  static constexpr float_format float_output = float_format::ostream;
+
+  static constexpr output_limits limits{};
+
+  static constexpr size_t summary_min_size = 0;
+
+  static constexpr size_t parallel_min_size = 0;
+
+  static constexpr size_t parallel_threads = 0;
+};
+
+template <typename StringT, bool DenseStyle>
+constexpr typename static_preferences<StringT, DenseStyle>::view_type
+    static_preferences<StringT, DenseStyle>::item_sep;
+template <typename StringT, bool DenseStyle>
+constexpr typename static_preferences<StringT, DenseStyle>::view_type
+    static_preferences<StringT, DenseStyle>::kv_sep;
+template <typename StringT, bool DenseStyle>
+constexpr float_format static_preferences<StringT, DenseStyle>::float_output;
+template <typename StringT, bool DenseStyle>
+constexpr output_limits static_preferences<StringT, DenseStyle>::limits;
+template <typename StringT, bool DenseStyle>
+constexpr size_t static_preferences<StringT, DenseStyle>::summary_min_size;
+template <typename StringT, bool DenseStyle>
+constexpr size_t static_preferences<StringT, DenseStyle>::parallel_min_size;
+template <typename StringT, bool DenseStyle>
+constexpr size_t static_preferences<StringT, DenseStyle>::parallel_threads;
+
+#define MYOSTREAM_DEFINE_STATIC_FORMAT(name)                           \
+  template <typename StringT, bool DenseStyle>                         \
+  constexpr typename static_preferences<StringT, DenseStyle>::format_type \
+      static_preferences<StringT, DenseStyle>::name;
+
+MYOSTREAM_DEFINE_STATIC_FORMAT(pair_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(tuple_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(array_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(deque_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(forward_list_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(initializer_list_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(list_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(vector_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(set_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(multiset_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(unordered_set_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(unordered_multiset_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(map_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(map_kv_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(multimap_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(multimap_kv_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(unordered_map_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(unordered_map_kv_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(unordered_multimap_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(unordered_multimap_kv_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(print_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(print_range_fmt)
+MYOSTREAM_DEFINE_STATIC_FORMAT(fake_fmt)
+
+#undef MYOSTREAM_DEFINE_STATIC_FORMAT
+
+namespace internal {
+
+// The string builder which produces the same string type as OstreamBaseT.
+template <typename OstreamBaseT>
+using string_builder_by_ostream =
+    basic_string_builder<string_type_by_ostream<OstreamBaseT>>;
+
+// integer kernel
+
+// Integral types which std::basic_ostream prints as numbers, not characters.
+template <typename T>
+struct is_numeric_integer
+    : public std::integral_constant<
+          bool,
+          std::is_integral<T>::value && !std::is_same<T, bool>::value &&
+              !std::is_same<T, char>::value &&
+              !std::is_same<T, signed char>::value &&
+              !std::is_same<T, unsigned char>::value &&
+              !std::is_same<T, wchar_t>::value &&
+              !std::is_same<T, char16_t>::value &&
+              !std::is_same<T, char32_t>::value && sizeof(T) <= 8> {};
+
+template <typename Dummy = void>
+struct integer_tables {
+  // "00", "01", ..., "99"
+  static constexpr char digit_pairs[201] =
+      "0001020304050607080910111213141516171819"
+      "2021222324252627282930313233343536373839"
+      "4041424344454647484950515253545556575859"
+      "6061626364656667686970717273747576777879"
+      "8081828384858687888990919293949596979899";
+
+  // 0 and 10^1 ... 10^19
+  static constexpr uint64_t powers_of_10[20] = {0,
+                                                10ULL,
+                                                100ULL,
+                                                1000ULL,
+                                                10000ULL,
+                                                100000ULL,
+                                                1000000ULL,
+                                                10000000ULL,
+                                                100000000ULL,
+                                                1000000000ULL,
+                                                10000000000ULL,
+                                                100000000000ULL,
+                                                1000000000000ULL,
+                                                10000000000000ULL,
+                                                100000000000000ULL,
+                                                1000000000000000ULL,
+                                                10000000000000000ULL,
+                                                100000000000000000ULL,
+                                                1000000000000000000ULL,
+                                                10000000000000000000ULL};
+};
+
+template <typename Dummy>
+constexpr char integer_tables<Dummy>::digit_pairs[201];
+
+template <typename Dummy>
+constexpr uint64_t integer_tables<Dummy>::powers_of_10[20];
+
+// Number of decimal digits of n.
+inline int count_digits(uint64_t n) {
+#if defined(__GNUC__) || defined(__clang__)
+  // Approximate log10 by bit width, then correct it by one comparison.
+  int t = (64 - __builtin_clzll(n | 1)) * 1233 >> 12;
+  return t - (n < integer_tables<>::powers_of_10[t]) + 1;
+#else
+  int r = 1;
+  for (;;) {
+    if (n < 10) return r;
+    if (n < 100) return r + 1;
+    if (n < 1000) return r + 2;
+    if (n < 10000) return r + 3;
+    n /= 10000u;
+    r += 4;
+  }
+#endif
+}
+
+// Write the digits of n into [p, p + len), where len == count_digits(n).
+// UIntT is uint32_t or uint64_t, the former makes faster divisions.
+template <typename CharT, typename UIntT>
+inline void format_decimal(CharT* p, UIntT n, int len) {
+  const char* pairs = integer_tables<>::digit_pairs;
+  CharT*      q     = p + len;
+  while (n >= 100) {
+    unsigned idx = static_cast<unsigned>(n % 100) * 2;
+    n /= 100;
+    *--q = static_cast<CharT>(pairs[idx + 1]);
+    *--q = static_cast<CharT>(pairs[idx]);
+  }
+  if (n < 10) {
+    *--q = static_cast<CharT>('0' + n);
+  } else {
+    unsigned idx = static_cast<unsigned>(n) * 2;
+    *--q         = static_cast<CharT>(pairs[idx + 1]);
+    *--q         = static_cast<CharT>(pairs[idx]);
+  }
+}
+
+// Max buffer size needed by format_integer.
+constexpr int max_integer_chars = 21;
+
+// Write v in decimal into p, return number of characters written.
+template <typename CharT, typename T>
+inline int format_integer(CharT* p, T v) {
+  using unsigned_type = typename std::make_unsigned<T>::type;
+  uint64_t n          = static_cast<unsigned_type>(v);
+  int      sign       = 0;
+  if (v < 0) {
+    n    = 0 - static_cast<uint64_t>(static_cast<int64_t>(v));
+    *p   = static_cast<CharT>('-');
+    sign = 1;
+  }
+  int len = count_digits(n);
+  if (n <= UINT32_MAX) {
+    format_decimal(p + sign, static_cast<uint32_t>(n), len);
+  } else {
+    format_decimal(p + sign, n, len);
+  }
+  return sign + len;
+}
+
+// Whether integers written by the kernel are same as by std::num_put, which
+// is true for the classic locale with decimal base and no padding or sign.
+template <typename OstreamT>
+inline bool integer_kernel_applicable(const OstreamT& os) {
+  const std::ios_base::fmtflags flags = os.flags();
+  const std::ios_base::fmtflags base  = flags & std::ios_base::basefield;
+  if (base != std::ios_base::dec && base != std::ios_base::fmtflags(0)) {
+    return false;
+  }
+  if (flags & std::ios_base::showpos) return false;
+  if (os.width() != 0) return false;
+  return os.getloc() == std::locale::classic();
+}
+
+// shortest round-trip floating-point formatting, by the Grisu2 algorithm from
+// Florian Loitsch, "Printing Floating-Point Numbers Quickly and Accurately
+// with Integers", PLDI 2010. The result always reads back to the same value,
+// and is the shortest one in the vast majority of cases.
+
+// A floating-point number f * 2^e.
+struct diyfp {
+  diyfp(uint64_t f_, int e_) : f(f_), e(e_) {}
+
+  static diyfp sub(const diyfp& x, const diyfp& y) {
+    MYOSTREAM_ASSERT(x.e == y.e && x.f >= y.f);
+    return diyfp(x.f - y.f, x.e);
+  }
+
+  // Rounded upper 64 bits of the 128-bit product.
+  static diyfp mul(const diyfp& x, const diyfp& y) {
+    const uint64_t u_lo = x.f & 0xFFFFFFFFu;
+    const uint64_t u_hi = x.f >> 32;
+    const uint64_t v_lo = y.f & 0xFFFFFFFFu;
+    const uint64_t v_hi = y.f >> 32;
+
+    const uint64_t p0 = u_lo * v_lo;
+    const uint64_t p1 = u_lo * v_hi;
+    const uint64_t p2 = u_hi * v_lo;
+    const uint64_t p3 = u_hi * v_hi;
+
+    uint64_t q = (p0 >> 32) + (p1 & 0xFFFFFFFFu) + (p2 & 0xFFFFFFFFu);
+    q += uint64_t{1} << 31;
+    const uint64_t h = p3 + (p1 >> 32) + (p2 >> 32) + (q >> 32);
+    return diyfp(h, x.e + y.e + 64);
+  }
+
+  static diyfp normalize(diyfp x) {
+    MYOSTREAM_ASSERT(x.f != 0);
+    while ((x.f >> 63) == 0) {
+      x.f <<= 1;
+      --x.e;
+    }
+    return x;
+  }
+
+  static diyfp normalize_to(const diyfp& x, int target_exponent) {
+    const int delta = x.e - target_exponent;
+    MYOSTREAM_ASSERT(delta >= 0 && ((x.f << delta) >> delta) == x.f);
+    return diyfp(x.f << delta, target_exponent);
+  }
+
+  uint64_t f;
+  int      e;
+};
+
+// The normalized value w and its boundaries, where any number between the
+// boundaries reads back to the value.
+struct float_boundaries {
+  diyfp w, minus, plus;
+};
+
+template <typename FloatT>
+inline float_boundaries compute_boundaries(FloatT value) {
+  static_assert(std::numeric_limits<FloatT>::is_iec559,
+                "requires IEEE 754 floating-point");
+  using bits_type =
+      typename std::conditional<sizeof(FloatT) == 4, uint32_t, uint64_t>::type;
+  constexpr int precision = std::numeric_limits<FloatT>::digits;
+  constexpr int bias =
+      std::numeric_limits<FloatT>::max_exponent - 1 + (precision - 1);
+  constexpr int      min_exp    = 1 - bias;
+  constexpr uint64_t hidden_bit = uint64_t{1} << (precision - 1);
+
+  bits_type bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const uint64_t e = static_cast<uint64_t>(bits) >> (precision - 1);
+  const uint64_t f = static_cast<uint64_t>(bits) & (hidden_bit - 1);
+
+  const diyfp v = e == 0 ? diyfp(f, min_exp)
+                         : diyfp(f + hidden_bit, static_cast<int>(e) - bias);
+  // The lower boundary is closer if v is a power of 2 and not the smallest
+  // normalized number.
+  const bool  lower_closer = f == 0 && e > 1;
+  const diyfp m_plus(2 * v.f + 1, v.e - 1);
+  const diyfp m_minus = lower_closer ? diyfp(4 * v.f - 1, v.e - 2)
+                                     : diyfp(2 * v.f - 1, v.e - 1);
+
+  const diyfp w_plus  = diyfp::normalize(m_plus);
+  const diyfp w_minus = diyfp::normalize_to(m_minus, w_plus.e);
+  return {diyfp::normalize(v), w_minus, w_plus};
+}
+
+// Range of the binary exponent of the scaled numbers.
+constexpr int grisu_alpha = -60;
+constexpr int grisu_gamma = -32;
+
+// f * 2^e ~= 10^k
+struct cached_power {
+  uint64_t f;
+  int      e;
+  int      k;
+};
+
+template <typename Dummy = void>
+struct cached_powers_table {
+  static constexpr int          min_dec_exp  = -300;
+  static constexpr int          dec_exp_step = 8;
+  static constexpr cached_power powers[79]   = {
+        {0xAB70FE17C79AC6CAULL, -1060, -300},
+        {0xFF77B1FCBEBCDC4FULL, -1034, -292},
+        {0xBE5691EF416BD60CULL, -1007, -284},
+        {0x8DD01FAD907FFC3CULL, -980, -276},
+        {0xD3515C2831559A83ULL, -954, -268},
+        {0x9D71AC8FADA6C9B5ULL, -927, -260},
+        {0xEA9C227723EE8BCBULL, -901, -252},
+        {0xAECC49914078536DULL, -874, -244},
+        {0x823C12795DB6CE57ULL, -847, -236},
+        {0xC21094364DFB5637ULL, -821, -228},
+        {0x9096EA6F3848984FULL, -794, -220},
+        {0xD77485CB25823AC7ULL, -768, -212},
+        {0xA086CFCD97BF97F4ULL, -741, -204},
+        {0xEF340A98172AACE5ULL, -715, -196},
+        {0xB23867FB2A35B28EULL, -688, -188},
+        {0x84C8D4DFD2C63F3BULL, -661, -180},
+        {0xC5DD44271AD3CDBAULL, -635, -172},
+        {0x936B9FCEBB25C996ULL, -608, -164},
+        {0xDBAC6C247D62A584ULL, -582, -156},
+        {0xA3AB66580D5FDAF6ULL, -555, -148},
+        {0xF3E2F893DEC3F126ULL, -529, -140},
+        {0xB5B5ADA8AAFF80B8ULL, -502, -132},
+        {0x87625F056C7C4A8BULL, -475, -124},
+        {0xC9BCFF6034C13053ULL, -449, -116},
+        {0x964E858C91BA2655ULL, -422, -108},
+        {0xDFF9772470297EBDULL, -396, -100},
+        {0xA6DFBD9FB8E5B88FULL, -369, -92},
+        {0xF8A95FCF88747D94ULL, -343, -84},
+        {0xB94470938FA89BCFULL, -316, -76},
+        {0x8A08F0F8BF0F156BULL, -289, -68},
+        {0xCDB02555653131B6ULL, -263, -60},
+        {0x993FE2C6D07B7FACULL, -236, -52},
+        {0xE45C10C42A2B3B06ULL, -210, -44},
+        {0xAA242499697392D3ULL, -183, -36},
+        {0xFD87B5F28300CA0EULL, -157, -28},
+        {0xBCE5086492111AEBULL, -130, -20},
+        {0x8CBCCC096F5088CCULL, -103, -12},
+        {0xD1B71758E219652CULL, -77, -4},
+        {0x9C40000000000000ULL, -50, 4},
+        {0xE8D4A51000000000ULL, -24, 12},
+        {0xAD78EBC5AC620000ULL, 3, 20},
+        {0x813F3978F8940984ULL, 30, 28},
+        {0xC097CE7BC90715B3ULL, 56, 36},
+        {0x8F7E32CE7BEA5C70ULL, 83, 44},
+        {0xD5D238A4ABE98068ULL, 109, 52},
+        {0x9F4F2726179A2245ULL, 136, 60},
+        {0xED63A231D4C4FB27ULL, 162, 68},
+        {0xB0DE65388CC8ADA8ULL, 189, 76},
+        {0x83C7088E1AAB65DBULL, 216, 84},
+        {0xC45D1DF942711D9AULL, 242, 92},
+        {0x924D692CA61BE758ULL, 269, 100},
+        {0xDA01EE641A708DEAULL, 295, 108},
+        {0xA26DA3999AEF774AULL, 322, 116},
+        {0xF209787BB47D6B85ULL, 348, 124},
+        {0xB454E4A179DD1877ULL, 375, 132},
+        {0x865B86925B9BC5C2ULL, 402, 140},
+        {0xC83553C5C8965D3DULL, 428, 148},
+        {0x952AB45CFA97A0B3ULL, 455, 156},
+        {0xDE469FBD99A05FE3ULL, 481, 164},
+        {0xA59BC234DB398C25ULL, 508, 172},
+        {0xF6C69A72A3989F5CULL, 534, 180},
+        {0xB7DCBF5354E9BECEULL, 561, 188},
+        {0x88FCF317F22241E2ULL, 588, 196},
+        {0xCC20CE9BD35C78A5ULL, 614, 204},
+        {0x98165AF37B2153DFULL, 641, 212},
+        {0xE2A0B5DC971F303AULL, 667, 220},
+        {0xA8D9D1535CE3B396ULL, 694, 228},
+        {0xFB9B7CD9A4A7443CULL, 720, 236},
+        {0xBB764C4CA7A44410ULL, 747, 244},
+        {0x8BAB8EEFB6409C1AULL, 774, 252},
+        {0xD01FEF10A657842CULL, 800, 260},
+        {0x9B10A4E5E9913129ULL, 827, 268},
+        {0xE7109BFBA19C0C9DULL, 853, 276},
+        {0xAC2820D9623BF429ULL, 880, 284},
+        {0x80444B5E7AA7CF85ULL, 907, 292},
+        {0xBF21E44003ACDD2DULL, 933, 300},
+        {0x8E679C2F5E44FF8FULL, 960, 308},
+        {0xD433179D9C8CB841ULL, 986, 316},
+        {0x9E19DB92B4E31BA9ULL, 1013, 324}};
+};
+
+template <typename Dummy>
+constexpr int cached_powers_table<Dummy>::min_dec_exp;
+
+template <typename Dummy>
+constexpr int cached_powers_table<Dummy>::dec_exp_step;
+
+template <typename Dummy>
+constexpr cached_power cached_powers_table<Dummy>::powers[79];
+
+// Get a cached power c, such that alpha <= e + c.e + 64 <= gamma.
+inline cached_power get_cached_power_for_binary_exponent(int e) {
+  using table = cached_powers_table<>;
+  // Same as k = ceil((alpha - e - 1) * log10(2)) for |e| <= 1500.
+  const int f = grisu_alpha - e - 1;
+  const int k = (f * 78913) / (1 << 18) + static_cast<int>(f > 0);
+  const int index = (-table::min_dec_exp + k + (table::dec_exp_step - 1)) /
+                    table::dec_exp_step;
+  MYOSTREAM_ASSERT(index >= 0 && index < 79);
+  const cached_power cached = table::powers[index];
+  MYOSTREAM_ASSERT(grisu_alpha <= cached.e + e + 64);
+  MYOSTREAM_ASSERT(grisu_gamma >= cached.e + e + 64);
+  return cached;
+}
+
+// Number of digits of n, and set pow10 = 10^(digits - 1).
+inline int find_largest_pow10(uint32_t n, uint32_t& pow10) {
+  pow10 = 1000000000;
+  for (int k = 10; k > 1; --k, pow10 /= 10) {
+    if (n >= pow10) return k;
+  }
+  pow10 = 1;
+  return 1;
+}
+
+// Move the last digit towards w while the result stays in the range.
+inline void grisu2_round(char*    buf,
+                         int      len,
+                         uint64_t dist,
+                         uint64_t delta,
+                         uint64_t rest,
+                         uint64_t ten_k) {
+  while (rest < dist && delta - rest >= ten_k &&
+         (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+    --buf[len - 1];
+    rest += ten_k;
+  }
+}
+
+// Generate digits of V = buf * 10^dec_exp with m_minus <= V <= m_plus.
+inline void grisu2_digit_gen(char*        buf,
+                             int&         len,
+                             int&         dec_exp,
+                             const diyfp& m_minus,
+                             const diyfp& w,
+                             const diyfp& m_plus) {
+  uint64_t delta = diyfp::sub(m_plus, m_minus).f;
+  uint64_t dist  = diyfp::sub(m_plus, w).f;
+
+  const diyfp one(uint64_t{1} << -m_plus.e, m_plus.e);
+  uint32_t    p1 = static_cast<uint32_t>(m_plus.f >> -one.e);
+  uint64_t    p2 = m_plus.f & (one.f - 1);
+
+  // integral part
+  uint32_t pow10;
+  int      n = find_largest_pow10(p1, pow10);
+  while (n > 0) {
+    const uint32_t d = p1 / pow10;
+    p1 %= pow10;
+    buf[len++] = static_cast<char>('0' + d);
+    --n;
+    const uint64_t rest = (uint64_t{p1} << -one.e) + p2;
+    if (rest <= delta) {
+      dec_exp += n;
+      grisu2_round(buf, len, dist, delta, rest, uint64_t{pow10} << -one.e);
+      return;
+    }
+    pow10 /= 10;
+  }
+
+  // fractional part
+  int m = 0;
+  for (;;) {
+    p2 *= 10;
+    const uint64_t d = p2 >> -one.e;
+    p2 &= one.f - 1;
+    buf[len++] = static_cast<char>('0' + d);
+    ++m;
+    delta *= 10;
+    dist *= 10;
+    if (p2 <= delta) break;
+  }
+  dec_exp -= m;
+  grisu2_round(buf, len, dist, delta, p2, one.f);
+}
+
+// Generate the shortest digits of a finite positive value, where
+// value == buf[0, len) * 10^dec_exp. At most 17 digits.
+template <typename FloatT>
+inline void grisu2(char* buf, int& len, int& dec_exp, FloatT value) {
+  const float_boundaries b = compute_boundaries(value);
+
+  const cached_power cached = get_cached_power_for_binary_exponent(b.plus.e);
+  const diyfp        c_minus_k(cached.f, cached.e);
+
+  const diyfp w       = diyfp::mul(b.w, c_minus_k);
+  const diyfp w_minus = diyfp::mul(b.minus, c_minus_k);
+  const diyfp w_plus  = diyfp::mul(b.plus, c_minus_k);
+
+  // Shrink the range by 1 ulp on each side for the errors of the products.
+  const diyfp m_minus(w_minus.f + 1, w_minus.e);
+  const diyfp m_plus(w_plus.f - 1, w_plus.e);
+
+  len     = 0;
+  dec_exp = -cached.k;
+  grisu2_digit_gen(buf, len, dec_exp, m_minus, w, m_plus);
+}
+
+// Max buffer size needed by format_shortest.
+constexpr int max_float_chars = 32;
+
+// Write v as the shortest string which reads back to the same value into p,
+// return number of characters written. Uses fixed notation if the decimal
+// exponent is in [-4, 16), otherwise scientific notation like "1e+16" or
+// "2.5e-07". NaN and infinity are written as "nan" and "inf".
+template <typename CharT, typename FloatT>
+inline int format_shortest(CharT* p, FloatT v) {
+  char  digits[24];
+  char  tmp[max_float_chars];
+  char* q = tmp;
+  if (std::signbit(v)) *q++ = '-';
+  if (std::isnan(v)) {
+    q = std::copy_n("nan", 3, q);
+  } else if (std::isinf(v)) {
+    q = std::copy_n("inf", 3, q);
+  } else if (v == 0) {
+    *q++ = '0';
+  } else {
+    int len, dec_exp;
+    grisu2(digits, len, dec_exp, std::fabs(v));
+    // value == 0.d1d2...dlen * 10^point
+    const int point = len + dec_exp;
+    if (point > -4 && point <= 16) {
+      if (point <= 0) {
+        *q++ = '0';
+        *q++ = '.';
+        q    = std::fill_n(q, -point, '0');
+        q    = std::copy_n(digits, len, q);
+      } else if (point < len) {
+        q    = std::copy_n(digits, point, q);
+        *q++ = '.';
+        q    = std::copy_n(digits + point, len - point, q);
+      } else {
+        q = std::copy_n(digits, len, q);
+        q = std::fill_n(q, point - len, '0');
+      }
+    } else {
+      *q++ = digits[0];
+      if (len > 1) {
+        *q++ = '.';
+        q    = std::copy_n(digits + 1, len - 1, q);
+      }
+      int exp = point - 1;
+      *q++    = 'e';
+      *q++    = exp < 0 ? '-' : '+';
+      if (exp < 0) exp = -exp;
+      if (exp >= 100) *q++ = static_cast<char>('0' + exp / 100);
+      *q++ = static_cast<char>('0' + exp / 10 % 10);
+      *q++ = static_cast<char>('0' + exp % 10);
+    }
+  }
+  const int n = static_cast<int>(q - tmp);
+  for (int i = 0; i < n; ++i) p[i] = static_cast<CharT>(tmp[i]);
+  return n;
+}
+
+// write-combining output of containers
+
+template <typename T>
+struct is_batch_number
+    : public std::integral_constant<bool,
+                                    is_numeric_integer<T>::value ||
+                                        std::is_same<T, float>::value ||
+                                        std::is_same<T, double>::value> {};
+
+template <typename OstreamT, typename T>
+inline typename std::enable_if<is_numeric_integer<T>::value, bool>::type
+batch_kernel_applicable(const OstreamT& os) {
+  return integer_kernel_applicable(os);
+}
+
+template <typename OstreamT, typename T>
+inline typename std::enable_if<!is_numeric_integer<T>::value, bool>::type
+batch_kernel_applicable(const OstreamT& os) {
+  return os.const_preferences_ptr() &&
+         os.const_preferences().float_output == float_format::shortest &&
+         os.width() == 0;
+}
+
+template <typename CharT, typename T>
+inline typename std::enable_if<is_numeric_integer<T>::value, int>::type
+format_number(CharT* p, T v) {
+  return format_integer(p, v);
+}
+
+template <typename CharT, typename T>
+inline typename std::enable_if<!is_numeric_integer<T>::value, int>::type
+format_number(CharT* p, T v) {
+  return format_shortest(p, v);
+}
+
+/**
+ * @brief A fixed size character buffer in front of a stream, so many small
+ * pieces go to the stream by one write. It must be flushed before anything
+ * else writes to the stream, and is flushed on destruction.
+ */
+template <typename OstreamT>
+class batch_writer {
+  using char_type   = typename OstreamT::char_type;
+  using traits_type = typename OstreamT::traits_type;
+
+public:
+  static constexpr size_t capacity = 2048;
+
+  explicit batch_writer(OstreamT& os) : os_(os), size_(0) {}
+
+  // Owners flush explicitly, so the rest is only written here on unwinding,
+  // where an exception of the stream must not escape.
+  ~batch_writer() {
+    if (size_ == 0) return;
+    try {
+      flush();
+    } catch (...) {
+    }
+  }
+
+  batch_writer(const batch_writer&)            = delete;
+  batch_writer& operator=(const batch_writer&) = delete;
+
+  template <typename StringT>
+  void append(const StringT& s) {
+    if (s.size() > capacity - size_) {
+      flush();
+      if (s.size() > capacity / 4) {
+        os_.write(s.data(), s.size());
+        return;
+      }
+    }
+    traits_type::copy(buf_ + size_, s.data(), s.size());
+    size_ += s.size();
+  }
+
+  // Same as `os << s`, which pads s if the stream width is set.
+  template <typename StringT>
+  void put(const StringT& s) {
+    if (os_.width() == 0) {
+      append(s);
+    } else {
+      flush();
+      os_ << s;
+    }
+  }
+
+  void put(char_type c) {
+    if (os_.width() != 0) {
+      flush();
+      os_ << c;
+      return;
+    }
+    if (size_ == capacity) flush();
+    buf_[size_++] = c;
+  }
+
+  template <typename T>
+  void append_number(T v) {
+    constexpr size_t max_chars = max_integer_chars > max_float_chars
+                                     ? max_integer_chars
+                                     : max_float_chars;
+    if (capacity - size_ < max_chars) flush();
+    size_ += format_number(buf_ + size_, v);
+  }
+
+  void flush() {
+    if (size_ == 0) return;
+    os_.write(buf_, size_);
+    size_ = 0;
+  }
+
+  /// Number of characters not yet written to the stream.
+  size_t size() const { return size_; }
+
+private:
+  OstreamT& os_;
+  size_t    size_;
+  char_type buf_[capacity];
+};
+
+template <typename OstreamT>
+constexpr size_t batch_writer<OstreamT>::capacity;
+
+/**
+ * @brief Writes container elements into a `batch_writer`. Numbers go by the
+ * number kernels if the stream state allows, which is checked only once per
+ * container, and strings of the stream's character type are copied. Others
+ * flush the buffer and go by operator<<.
+ */
+template <typename OstreamT, typename T, typename = void>
+struct element_writer {
+  explicit element_writer(OstreamT& os) : os(os) {}
+
+  void operator()(batch_writer<OstreamT>& w, const T& v) {
+    w.flush();
+    os << v;
+  }
+
+  OstreamT& os;
+};
+
+template <typename OstreamT, typename T>
+struct element_writer<
+    OstreamT,
+    T,
+    typename std::enable_if<is_batch_number<T>::value>::type> {
+  explicit element_writer(OstreamT& os)
+      : os(os), fast(batch_kernel_applicable<OstreamT, T>(os)) {}
+
+  void operator()(batch_writer<OstreamT>& w, T v) {
+    if (fast) {
+      w.append_number(v);
+    } else {
+      w.flush();
+      os << v;
+    }
+  }
+
+  OstreamT& os;
+  bool      fast;
+};
+
+template <typename CharT, typename TraitsT, typename T>
+struct is_basic_string_of : public std::false_type {};
+
+template <typename CharT, typename TraitsT, typename AllocT>
+struct is_basic_string_of<CharT,
+                          TraitsT,
+                          std::basic_string<CharT, TraitsT, AllocT>>
+    : public std::true_type {};
+
+template <typename OstreamT, typename T>
+struct element_writer<
+    OstreamT,
+    T,
+    typename std::enable_if<
+        std::is_same<T, typename OstreamT::char_type>::value ||
+        is_basic_string_of<typename OstreamT::char_type,
+                           typename OstreamT::traits_type,
+                           T>::value>::type> {
+  explicit element_writer(OstreamT&) {}
+
+  void operator()(batch_writer<OstreamT>& w, const T& v) { w.put(v); }
+};
+
+template <typename OstreamT, typename T>
+using element_writer_by_type =
+    element_writer<OstreamT, typename std::remove_cv<T>::type>;
+
+// output limits
+
+constexpr size_t unknown_size = static_cast<size_t>(-1);
+
+// Size of a container if it has size(), else unknown_size.
+template <typename ContainerT>
+auto container_size(const ContainerT& c, int)
+    -> decltype(static_cast<size_t>(c.size())) {
+  return static_cast<size_t>(c.size());
+}
+
+template <typename ContainerT>
+size_t container_size(const ContainerT&, long) {
+  return unknown_size;
+}
+
+// Distance of random access iterators, else unknown_size without walking.
+template <typename IteratorT>
+size_t cheap_distance(IteratorT                       b,
+                      IteratorT                       e,
+                      std::random_access_iterator_tag) {
+  return static_cast<size_t>(e - b);
+}
+
+template <typename IteratorT>
+size_t cheap_distance(IteratorT, IteratorT, std::input_iterator_tag) {
+  return unknown_size;
+}
+
+template <typename IteratorT>
+size_t cheap_distance(IteratorT b, IteratorT e) {
+  return cheap_distance(
+      b, e, typename std::iterator_traits<IteratorT>::iterator_category());
+}
+
+/**
+ * @brief Stream buffer which forwards all characters to another one and
+ * counts them, installed into a stream while printing an outermost container
+ * with a byte limit.
+ */
+template <typename CharT, typename TraitsT>
+class counting_forward_buf : public std::basic_streambuf<CharT, TraitsT> {
+public:
+  using char_type      = CharT;
+  using traits_type    = TraitsT;
+  using int_type       = typename traits_type::int_type;
+  using streambuf_type = std::basic_streambuf<CharT, TraitsT>;
+
+  explicit counting_forward_buf(streambuf_type* target)
+      : target_(target), count_(0) {}
+
+  size_t          count() const { return count_; }
+  streambuf_type* target() const { return target_; }
+
+protected:
+  int_type overflow(int_type c) override {
+    if (traits_type::eq_int_type(c, traits_type::eof())) {
+      return traits_type::not_eof(c);
+    }
+    int_type r = target_->sputc(traits_type::to_char_type(c));
+    if (!traits_type::eq_int_type(r, traits_type::eof())) ++count_;
+    return r;
+  }
+
+  std::streamsize xsputn(const char_type* s, std::streamsize n) override {
+    std::streamsize r = target_->sputn(s, n);
+    if (r > 0) count_ += static_cast<size_t>(r);
+    return r;
+  }
+
+  int sync() override { return target_->pubsync(); }
+
+private:
+  streambuf_type* target_;
+  size_t          count_;
+};
+
+// Per stream state of output limits.
+template <typename CharT, typename TraitsT>
+struct limit_state {
+  /// Nesting depth of the container being printed.
+  size_t depth = 0;
+  /// Counts characters of the outermost container if bytes are limited.
+  counting_forward_buf<CharT, TraitsT>* counter = nullptr;
+};
+
+template <typename OstreamT>
+inline bool has_output_limits(const OstreamT& os) {
+  const output_limits& l = os.const_preferences().limits;
+  return l.max_items != 0 || l.max_depth != 0 || l.max_bytes != 0;
+}
+
+/**
+ * @brief Applies output limits while printing one container. Does nothing
+ * but one check if no limit is set.
+ */
+template <typename OstreamT>
+class limited_scope {
+  using char_type    = typename OstreamT::char_type;
+  using traits_type  = typename OstreamT::traits_type;
+  using ios_type     = std::basic_ios<char_type, traits_type>;
+  using counter_type = counting_forward_buf<char_type, traits_type>;
+
+public:
+  explicit limited_scope(OstreamT& os)
+      : os_(os), active_(has_output_limits(os)), max_items_(unknown_size) {
+    if (active_) enter();
+  }
+
+  ~limited_scope() {
+    if (active_) leave();
+  }
+
+  limited_scope(const limited_scope&)            = delete;
+  limited_scope& operator=(const limited_scope&) = delete;
+
+  // Whether the i-th item can be printed, with `pending` characters not
+  // written to the stream yet.
+  bool allow(size_t i, size_t pending) const {
+    if (!active_) return true;
+    if (i >= max_items_) return false;
+    auto* counter = os_.limit_state().counter;
+    return !counter || counter->count() + pending < max_bytes_;
+  }
+
+private:
+  void enter() {
+    const output_limits& l  = os_.const_preferences().limits;
+    auto&                st = os_.limit_state();
+    ++st.depth;
+    if (l.max_items != 0) max_items_ = l.max_items;
+    if (l.max_depth != 0 && st.depth > l.max_depth) max_items_ = 0;
+    max_bytes_ = l.max_bytes;
+    if (max_bytes_ != 0 && !st.counter) {
+      ios_type& ios = os_;
+      counter_.reset(new counter_type(ios.rdbuf()));
+      std::ios_base::iostate state = ios.rdstate();
+      ios.rdbuf(counter_.get());
+      ios.setstate(state);
+      st.counter = counter_.get();
+    }
+  }
+
+  void leave() {
+    auto& st = os_.limit_state();
+    --st.depth;
+    if (counter_) {
+      ios_type&              ios   = os_;
+      std::ios_base::iostate state = ios.rdstate();
+      ios.rdbuf(counter_->target());
+      st.counter = nullptr;
+      try {
+        ios.setstate(state);
+      } catch (...) {
+      }
+    }
+  }
+
+  OstreamT&                     os_;
+  bool                          active_;
+  size_t                        max_items_;
+  size_t                        max_bytes_;
+  std::unique_ptr<counter_type> counter_;
+};
+
+// Writes a marker for the rest `total - printed` items, or just "..." if the
+// total is unknown.
+template <typename OstreamT, typename FormatT>
+void write_omitted_marker(batch_writer<OstreamT>& w,
+                          const FormatT&          f,
+                          size_t                  printed,
+                          size_t                  total) {
+  using char_type = typename OstreamT::char_type;
+  if (printed != 0) w.put(f.sep);
+  for (int i = 0; i < 3; ++i) w.put(static_cast<char_type>('.'));
+  if (total == unknown_size) return;
+  w.put(static_cast<char_type>(' '));
+  w.put(static_cast<char_type>('('));
+  w.append_number(total - printed);
+  static const char more[] = " more)";
+  for (const char* p = more; *p; ++p) w.put(static_cast<char_type>(*p));
+}
+
+// parallel output
+
+// Whether this thread is formatting a chunk of a parallel output, so nested
+// containers are formatted serially.
+inline bool& in_parallel_output() {
+  static thread_local bool v = false;
+  return v;
+}
+
+// Stream formatting one chunk of a parallel output into its own buffer.
+template <typename OstreamT>
+using parallel_chunk_stream =
+    basic_ostream<basic_string_builder<typename OstreamT::string_type>,
+                  typename OstreamT::preferences_type>;
+
+// Number of chunks to format `total` items in parallel, 0 means serial.
+template <typename OstreamT>
+size_t parallel_chunks(const OstreamT& os,
+                       size_t          total,
+                       std::forward_iterator_tag) {
+  const auto& p = os.const_preferences();
+  if (p.parallel_min_size == 0 || total == unknown_size ||
+      total < p.parallel_min_size || has_output_limits(os) ||
+      in_parallel_output()) {
+    return 0;
+  }
+  size_t threads = p.parallel_threads != 0
+                       ? p.parallel_threads
+                       : std::thread::hardware_concurrency();
+  if (threads > total) threads = total;
+  return threads > 1 ? threads : 0;
+}
+
+template <typename OstreamT>
+size_t parallel_chunks(const OstreamT&, size_t, std::input_iterator_tag) {
+  return 0;
+}
+
+template <typename OstreamT, typename IteratorT>
+size_t parallel_chunks(const OstreamT& os, size_t total) {
+  return parallel_chunks(
+      os,
+      total,
+      typename std::iterator_traits<IteratorT>::iterator_category());
+}
+
+// Print items in [b, e) separated by f.sep, without borders.
+template <typename OstreamT, typename IteratorT, typename FormatT>
+void output_items(OstreamT&      os,
+                  IteratorT      b,
+                  IteratorT      e,
+                  const FormatT& f) {
+  using value_type = typename std::iterator_traits<IteratorT>::value_type;
+  batch_writer<OstreamT>                       w(os);
+  element_writer_by_type<OstreamT, value_type> write(os);
+  for (IteratorT it = b; it != e; ++it) {
+    if (it != b) w.put(f.sep);
+    write(w, *it);
+  }
+  w.flush();
+}
+
+template <typename OstreamT, typename IteratorT, typename FormatT>
+void output_items(OstreamT&      os,
+                  IteratorT      b,
+                  IteratorT      e,
+                  const FormatT& f,
+                  const FormatT& kv_f) {
+  using value_type  = typename std::iterator_traits<IteratorT>::value_type;
+  using key_type    = typename value_type::first_type;
+  using mapped_type = typename value_type::second_type;
+  batch_writer<OstreamT>                        w(os);
+  element_writer_by_type<OstreamT, key_type>    write_k(os);
+  element_writer_by_type<OstreamT, mapped_type> write_v(os);
+  for (IteratorT it = b; it != e; ++it) {
+    if (it != b) w.put(f.sep);
+    w.put(kv_f.lb);
+    write_k(w, it->first);
+    w.put(kv_f.sep);
+    write_v(w, it->second);
+    w.put(kv_f.rb);
+  }
+  w.flush();
+}
+
+// Calls output_items with the formats for any stream.
+template <typename IteratorT, typename FormatT>
+struct items_writer {
+  template <typename OstreamT>
+  void operator()(OstreamT& os, IteratorT b, IteratorT e) const {
+    output_items(os, b, e, f);
+  }
+
+  const FormatT& f;
+};
+
+template <typename IteratorT, typename FormatT>
+struct kv_items_writer {
+  template <typename OstreamT>
+  void operator()(OstreamT& os, IteratorT b, IteratorT e) const {
+    output_items(os, b, e, f, kv_f);
+  }
+
+  const FormatT& f;
+  const FormatT& kv_f;
+};
+
+// Split `total` items from b into `chunks` chunks of nearly equal size,
+// return the bounds of the chunks.
+template <typename IteratorT>
+std::vector<IteratorT> split_chunks(IteratorT b, size_t total, size_t chunks) {
+  std::vector<IteratorT> bounds;
+  bounds.reserve(chunks + 1);
+  bounds.push_back(b);
+  for (size_t k = 1; k <= chunks; ++k) {
+    IteratorT it = bounds.back();
+    std::advance(it, total * k / chunks - total * (k - 1) / chunks);
+    bounds.push_back(it);
+  }
+  return bounds;
+}
+
+// Call fn(k) for k in [0, chunks), each on its own thread except k = 0 on
+// this thread, and wait for all. The first exception is rethrown.
+template <typename ChunkFnT>
+void run_chunks(size_t chunks, ChunkFnT fn) {
+  std::vector<std::exception_ptr> errors(chunks);
+  auto                            run = [&](size_t k) {
+    bool& in_parallel = in_parallel_output();
+    bool  old         = in_parallel;
+    in_parallel       = true;
+    try {
+      fn(k);
+    } catch (...) {
+      errors[k] = std::current_exception();
+    }
+    in_parallel = old;
+  };
+  std::vector<std::thread> threads;
+  for (size_t k = 1; k < chunks; ++k) {
+    try {
+      threads.emplace_back(run, k);
+    } catch (const std::system_error&) {
+      run(k);
+    }
+  }
+  if (chunks != 0) run(0);
+  for (auto& t : threads) t.join();
+  for (auto& e : errors) {
+    if (e) std::rethrow_exception(e);
+  }
+}
+
+/**
+ * @brief Print `total` items from b split into `chunks` chunks, by
+ * `write_items(stream, chunk_begin, chunk_end)`. The first chunk is written
+ * to os directly, and each other chunk is formatted on its own thread into
+ * its own buffer, by a stream with the same preferences and format state as
+ * os. Then the buffers are appended by f.sep in order, so the output is the
+ * same as serial.
+ */
+template <typename OstreamT,
+          typename IteratorT,
+          typename FormatT,
+          typename ItemsWriterT>
+OstreamT& output_parallel(OstreamT&           os,
+                          IteratorT           b,
+                          size_t              total,
+                          size_t              chunks,
+                          const FormatT&      f,
+                          const ItemsWriterT& write_items) {
+  using stream_type = parallel_chunk_stream<OstreamT>;
+  std::vector<IteratorT> bounds = split_chunks(b, total, chunks);
+
+  std::vector<std::unique_ptr<stream_type>> streams(chunks);
+  for (size_t k = 1; k < chunks; ++k) {
+    streams[k].reset(new stream_type(
+        placeholder::with_preferences_ptr{},
+        const_cast<typename stream_type::preferences_type*>(
+            os.const_preferences_ptr())));
+    streams[k]->copyfmt(os);
+    streams[k]->tie(nullptr);
+    streams[k]->width(0);
+  }
+  run_chunks(chunks, [&](size_t k) {
+    if (k == 0) {
+      {
+        batch_writer<OstreamT> w(os);
+        w.put(f.lb);
+        w.flush();
+      }
+      write_items(os, bounds[0], bounds[1]);
+    } else {
+      write_items(*streams[k], bounds[k], bounds[k + 1]);
+    }
+  });
+  batch_writer<OstreamT> w(os);
+  for (size_t k = 1; k < chunks; ++k) {
+    w.put(f.sep);
+    w.append(streams[k]->view());
+  }
+  w.put(f.rb);
+  w.flush();
+  return os;
+}
+
+// Print items in [b, e), whose count is `total` or unknown_size.
+template <typename OstreamT, typename IteratorT, typename FormatT>
+OstreamT& output_all(OstreamT&      os,
+                     IteratorT      b,
+                     IteratorT      e,
+                     size_t         total,
+                     const FormatT& f) {
+  using value_type = typename std::iterator_traits<IteratorT>::value_type;
+  const size_t chunks = parallel_chunks<OstreamT, IteratorT>(os, total);
+  if (chunks != 0) {
+    return output_parallel(
+        os, b, total, chunks, f, items_writer<IteratorT, FormatT>{f});
+  }
+  limited_scope<OstreamT> scope(os);
+  batch_writer<OstreamT>  w(os);
+  w.put(f.lb);
+  element_writer_by_type<OstreamT, value_type> write(os);
+  size_t                                       i  = 0;
+  IteratorT                                    it = b;
+  for (; it != e; ++it, ++i) {
+    if (!scope.allow(i, w.size())) break;
+    if (i != 0) w.put(f.sep);
+    write(w, *it);
+  }
+  if (it != e) write_omitted_marker(w, f, i, total);
+  w.put(f.rb);
+  w.flush();
+  return os;
+}
+
+template <typename OstreamT, typename IteratorT, typename FormatT>
+OstreamT& output_all(OstreamT&      os,
+                     IteratorT      b,
+                     IteratorT      e,
+                     size_t         total,
+                     const FormatT& f,
+                     const FormatT& kv_f) {
+  using value_type  = typename std::iterator_traits<IteratorT>::value_type;
+  using key_type    = typename value_type::first_type;
+  using mapped_type = typename value_type::second_type;
+  const size_t chunks = parallel_chunks<OstreamT, IteratorT>(os, total);
+  if (chunks != 0) {
+    return output_parallel(os,
+                           b,
+                           total,
+                           chunks,
+                           f,
+                           kv_items_writer<IteratorT, FormatT>{f, kv_f});
+  }
+  limited_scope<OstreamT> scope(os);
+  batch_writer<OstreamT>  w(os);
+  w.put(f.lb);
+  element_writer_by_type<OstreamT, key_type>    write_k(os);
+  element_writer_by_type<OstreamT, mapped_type> write_v(os);
+  size_t                                        i  = 0;
+  IteratorT                                     it = b;
+  for (; it != e; ++it, ++i) {
+    if (!scope.allow(i, w.size())) break;
+    if (i != 0) w.put(f.sep);
+    w.put(kv_f.lb);
+    write_k(w, it->first);
+    w.put(kv_f.sep);
+    write_v(w, it->second);
+    w.put(kv_f.rb);
+  }
+  if (it != e) write_omitted_marker(w, f, i, total);
+  w.put(f.rb);
+  w.flush();
+  return os;
+}
+
+// Write numbers in [b, e) in batch if the stream state allows.
+template <typename OstreamT, typename T, typename FormatT>
+OstreamT& output_numbers(OstreamT&      os,
+                         const T*       b,
+                         const T*       e,
+                         const FormatT& f) {
+  if (!batch_kernel_applicable<OstreamT, T>(os) || has_output_limits(os) ||
+      parallel_chunks<OstreamT, const T*>(os, e - b) != 0) {
+    return output_all(os, b, e, static_cast<size_t>(e - b), f);
+  }
+  batch_writer<OstreamT> w(os);
+  w.append(f.lb);
+  for (const T* it = b; it != e; ++it) {
+    if (it != b) w.append(f.sep);
+    w.append_number(*it);
+  }
+  w.append(f.rb);
+  w.flush();
+  return os;
+}
+
+// summary statistics
+
+template <typename T>
+struct summary_stats {
+  T      min;
+  T      max;
+  double mean;
+  double stddev;
+};
+
+// Sums are shifted by the first item for numeric stability, and kept in 4
+// independent lanes so the loop over contiguous items can be vectorized.
+template <typename T>
+summary_stats<T> compute_summary_stats(const T* b, const T* e) {
+  const size_t n     = e - b;
+  const double shift = static_cast<double>(*b);
+  T            mn[4] = {*b, *b, *b, *b};
+  T            mx[4] = {*b, *b, *b, *b};
+  double       s[4]  = {0, 0, 0, 0};
+  double       sq[4] = {0, 0, 0, 0};
+  size_t       i     = 0;
+  for (; i + 4 <= n; i += 4) {
+    for (int k = 0; k < 4; ++k) {
+      const T      v = b[i + k];
+      const double d = static_cast<double>(v) - shift;
+      mn[k]          = v < mn[k] ? v : mn[k];
+      mx[k]          = mx[k] < v ? v : mx[k];
+      s[k] += d;
+      sq[k] += d * d;
+    }
+  }
+  for (; i < n; ++i) {
+    const double d = static_cast<double>(b[i]) - shift;
+    mn[0]          = b[i] < mn[0] ? b[i] : mn[0];
+    mx[0]          = mx[0] < b[i] ? b[i] : mx[0];
+    s[0] += d;
+    sq[0] += d * d;
+  }
+  summary_stats<T> r;
+  r.min = *std::min_element(mn, mn + 4);
+  r.max = *std::max_element(mx, mx + 4);
+  const double sum   = (s[0] + s[1]) + (s[2] + s[3]);
+  const double sqsum = (sq[0] + sq[1]) + (sq[2] + sq[3]);
+  const double m     = sum / n;
+  r.mean             = shift + m;
+  r.stddev           = std::sqrt(std::max(0.0, sqsum / n - m * m));
+  return r;
+}
+
+template <typename OstreamT>
+void put_ascii(batch_writer<OstreamT>& w, const char* s) {
+  for (; *s; ++s) w.put(static_cast<typename OstreamT::char_type>(*s));
+}
+
+// Keys are separated from values like map keys, by the `map_kv_fmt` separator.
+template <typename OstreamT, typename FormatT>
+void put_summary_key(batch_writer<OstreamT>& w,
+                     OstreamT&               os,
+                     const FormatT&          f,
+                     const char*             key,
+                     bool                    first) {
+  if (!first) w.put(f.sep);
+  put_ascii(w, key);
+  w.put(os.const_preferences().map_kv_fmt.sep);
+}
+
+template <typename OstreamT, typename T>
+void put_summary_value(batch_writer<OstreamT>& w, OstreamT& os, const T& v) {
+  w.flush();
+  os << v;
+}
+
+// Print items in [b, e) as summary statistics in format f. Items are copied
+// only for quantiles.
+template <typename OstreamT, typename T, typename FormatT>
+OstreamT& output_summary(OstreamT&              os,
+                         const T*               b,
+                         const T*               e,
+                         const FormatT&         f,
+                         const summary_options& opt) {
+  static_assert(std::is_arithmetic<T>::value,
+                "summary requires a container of arithmetic values");
+  const size_t           n = e - b;
+  batch_writer<OstreamT> w(os);
+  w.put(f.lb);
+  put_summary_key(w, os, f, "size", true);
+  put_summary_value(w, os, n);
+  if (n != 0) {
+    const summary_stats<T> st = compute_summary_stats(b, e);
+    put_summary_key(w, os, f, "min", false);
+    put_summary_value(w, os, st.min);
+    put_summary_key(w, os, f, "max", false);
+    put_summary_value(w, os, st.max);
+    put_summary_key(w, os, f, "mean", false);
+    put_summary_value(w, os, st.mean);
+    put_summary_key(w, os, f, "stddev", false);
+    put_summary_value(w, os, st.stddev);
+
+    const size_t head = std::min(opt.head, n);
+    const size_t tail = std::min(opt.tail, n - head);
+    if (head != 0) {
+      put_summary_key(w, os, f, "head", false);
+      w.flush();
+      output_all(os, b, b + head, head, f);
+    }
+    if (tail != 0) {
+      put_summary_key(w, os, f, "tail", false);
+      w.flush();
+      output_all(os, e - tail, e, tail, f);
+    }
+
+    // Nearest-rank quantiles, each selected in the rest of the previous one.
+    if (opt.quantiles) {
+      std::vector<T> items(b, e);
+      static const struct {
+        const char* key;
+        int         percent;
+      } qs[] = {{"p50", 50}, {"p90", 90}, {"p99", 99}};
+      size_t from = 0;
+      for (const auto& q : qs) {
+        size_t rank = (n * q.percent + 99) / 100;
+        size_t i    = rank == 0 ? 0 : rank - 1;
+        if (i < from) i = from;
+        std::nth_element(items.begin() + from,
+                         items.begin() + i,
+                         items.end());
+        put_summary_key(w, os, f, q.key, false);
+        put_summary_value(w, os, items[i]);
+        from = i;
+      }
+    }
+  }
+  w.put(f.rb);
+  w.flush();
+  return os;
+}
+
+template <typename OstreamT, typename ContainerT, typename FormatT>
+auto output_summary_of(OstreamT&              os,
+                       const ContainerT&      c,
+                       const FormatT&         f,
+                       const summary_options& opt,
+                       int) -> decltype(c.data(), std::declval<OstreamT&>()) {
+  return output_summary(os, c.data(), c.data() + c.size(), f, opt);
+}
+
+// Non-contiguous containers are copied first.
+template <typename OstreamT, typename ContainerT, typename FormatT>
+OstreamT& output_summary_of(OstreamT&              os,
+                            const ContainerT&      c,
+                            const FormatT&         f,
+                            const summary_options& opt,
+                            long) {
+  using value_type =
+      typename std::remove_cv<typename std::iterator_traits<decltype(
+          std::begin(c))>::value_type>::type;
+  std::vector<value_type> items(std::begin(c), std::end(c));
+  return output_summary(
+      os, items.data(), items.data() + items.size(), f, opt);
+}
+
+// Format of a container type in preferences.
+#define MYOSTREAM_DEFINE_FORMAT_OF(container)                        \
+  template <typename PreferencesT, typename... Args>                 \
+  const typename PreferencesT::format_type& format_of(               \
+      const PreferencesT& p, const std::container<Args...>*) {       \
+    return p.container##_fmt;                                        \
+  }
+
+MYOSTREAM_DEFINE_FORMAT_OF(deque)
+MYOSTREAM_DEFINE_FORMAT_OF(forward_list)
+MYOSTREAM_DEFINE_FORMAT_OF(initializer_list)
+MYOSTREAM_DEFINE_FORMAT_OF(list)
+MYOSTREAM_DEFINE_FORMAT_OF(vector)
+MYOSTREAM_DEFINE_FORMAT_OF(set)
+MYOSTREAM_DEFINE_FORMAT_OF(multiset)
+MYOSTREAM_DEFINE_FORMAT_OF(unordered_set)
+MYOSTREAM_DEFINE_FORMAT_OF(unordered_multiset)
+
+#undef MYOSTREAM_DEFINE_FORMAT_OF
+
+template <typename PreferencesT, typename T, size_t N>
+const typename PreferencesT::format_type& format_of(const PreferencesT& p,
+                                                   const std::array<T, N>*) {
+  return p.array_fmt;
+}
+
+template <typename PreferencesT>
+const typename PreferencesT::format_type& format_of(const PreferencesT& p,
+                                                   const void*) {
+  return p.print_range_fmt;
+}
+
+#define MYOSTREAM_DEFINE_KV_FORMAT_OF(container)                     \
+  template <typename PreferencesT, typename... Args>                 \
+  const typename PreferencesT::format_type& format_of(               \
+      const PreferencesT& p, const std::container<Args...>*) {       \
+    return p.container##_fmt;                                        \
+  }                                                                  \
+  template <typename PreferencesT, typename... Args>                 \
+  const typename PreferencesT::format_type& kv_format_of(            \
+      const PreferencesT& p, const std::container<Args...>*) {       \
+    return p.container##_kv_fmt;                                     \
+  }
+
+MYOSTREAM_DEFINE_KV_FORMAT_OF(map)
+MYOSTREAM_DEFINE_KV_FORMAT_OF(multimap)
+MYOSTREAM_DEFINE_KV_FORMAT_OF(unordered_map)
+MYOSTREAM_DEFINE_KV_FORMAT_OF(unordered_multimap)
+
+#undef MYOSTREAM_DEFINE_KV_FORMAT_OF
+
+// format plans
+//
+// Nested containers, pairs and tuples are written by a tree of element
+// writers built once per outermost output, with every format resolved when
+// the tree is built. Elements then go into the outermost batch_writer
+// without a stream call or a preferences lookup per element. The tree is
+// built again by the next output, so it always sees the current preferences.
+
+template <size_t... Is>
+struct index_sequence {};
+
+template <size_t N, size_t... Is>
+struct make_index_sequence : make_index_sequence<N - 1, N - 1, Is...> {};
+
+template <size_t... Is>
+struct make_index_sequence<0, Is...> {
+  using type = index_sequence<Is...>;
+};
+
+// Whether nested containers can be written by plan. Output limits, summaries
+// and parallel output are decided per container, so they go by operator<<.
+template <typename OstreamT>
+bool plan_applicable(const OstreamT& os) {
+  const auto& p = os.const_preferences();
+  return !has_output_limits(os) && p.summary_min_size == 0 &&
+         (p.parallel_min_size == 0 || in_parallel_output());
+}
+
+template <typename OstreamT, typename ContainerT>
+struct items_plan_writer {
+  using format_type = typename OstreamT::format_type;
+  using value_type  = typename ContainerT::value_type;
+
+  explicit items_plan_writer(OstreamT& os)
+      : os(os),
+        f(format_of(os.const_preferences(),
+                    static_cast<const ContainerT*>(nullptr))),
+        planned(plan_applicable(os)),
+        write(os) {}
+
+  void operator()(batch_writer<OstreamT>& w, const ContainerT& c) {
+    if (!planned) {
+      w.flush();
+      os << c;
+      return;
+    }
+    w.put(f.lb);
+    bool first = true;
+    for (const auto& v : c) {
+      if (!first) w.put(f.sep);
+      first = false;
+      write(w, v);
+    }
+    w.put(f.rb);
+  }
+
+  OstreamT&                                    os;
+  const format_type&                           f;
+  bool                                         planned;
+  element_writer_by_type<OstreamT, value_type> write;
+};
+
+template <typename OstreamT, typename ContainerT>
+struct kv_items_plan_writer {
+  using format_type = typename OstreamT::format_type;
+  using key_type    = typename ContainerT::key_type;
+  using mapped_type = typename ContainerT::mapped_type;
+
+  explicit kv_items_plan_writer(OstreamT& os)
+      : os(os),
+        f(format_of(os.const_preferences(),
+                    static_cast<const ContainerT*>(nullptr))),
+        kv_f(kv_format_of(os.const_preferences(),
+                          static_cast<const ContainerT*>(nullptr))),
+        planned(plan_applicable(os)),
+        write_k(os),
+        write_v(os) {}
+
+  void operator()(batch_writer<OstreamT>& w, const ContainerT& c) {
+    if (!planned) {
+      w.flush();
+      os << c;
+      return;
+    }
+    w.put(f.lb);
+    bool first = true;
+    for (const auto& kv : c) {
+      if (!first) w.put(f.sep);
+      first = false;
+      w.put(kv_f.lb);
+      write_k(w, kv.first);
+      w.put(kv_f.sep);
+      write_v(w, kv.second);
+      w.put(kv_f.rb);
+    }
+    w.put(f.rb);
+  }
+
+  OstreamT&                                     os;
+  const format_type&                            f;
+  const format_type&                            kv_f;
+  bool                                          planned;
+  element_writer_by_type<OstreamT, key_type>    write_k;
+  element_writer_by_type<OstreamT, mapped_type> write_v;
+};
+
+#define MYOSTREAM_DEFINE_PLAN_WRITER(container, plan)                   \
+  template <typename OstreamT, typename... Args>                        \
+  struct element_writer<OstreamT, std::container<Args...>>              \
+      : public plan<OstreamT, std::container<Args...>> {                \
+    explicit element_writer(OstreamT& os)                               \
+        : plan<OstreamT, std::container<Args...>>(os) {}                \
+  };
+
+MYOSTREAM_DEFINE_PLAN_WRITER(deque, items_plan_writer)
+MYOSTREAM_DEFINE_PLAN_WRITER(forward_list, items_plan_writer)
+MYOSTREAM_DEFINE_PLAN_WRITER(list, items_plan_writer)
+MYOSTREAM_DEFINE_PLAN_WRITER(vector, items_plan_writer)
+MYOSTREAM_DEFINE_PLAN_WRITER(set, items_plan_writer)
+MYOSTREAM_DEFINE_PLAN_WRITER(multiset, items_plan_writer)
+MYOSTREAM_DEFINE_PLAN_WRITER(unordered_set, items_plan_writer)
+MYOSTREAM_DEFINE_PLAN_WRITER(unordered_multiset, items_plan_writer)
+MYOSTREAM_DEFINE_PLAN_WRITER(map, kv_items_plan_writer)
+MYOSTREAM_DEFINE_PLAN_WRITER(multimap, kv_items_plan_writer)
+MYOSTREAM_DEFINE_PLAN_WRITER(unordered_map, kv_items_plan_writer)
+MYOSTREAM_DEFINE_PLAN_WRITER(unordered_multimap, kv_items_plan_writer)
+
+#undef MYOSTREAM_DEFINE_PLAN_WRITER
+
+template <typename OstreamT, typename T, size_t N>
+struct element_writer<OstreamT, std::array<T, N>>
+    : public items_plan_writer<OstreamT, std::array<T, N>> {
+  explicit element_writer(OstreamT& os)
+      : items_plan_writer<OstreamT, std::array<T, N>>(os) {}
+};
+
+// Pairs and tuples have no limits of their own, so they are always written by
+// plan, while containers in them may still fall back to operator<<.
+template <typename OstreamT, typename FirstT, typename SecondT>
+struct element_writer<OstreamT, std::pair<FirstT, SecondT>> {
+  using format_type = typename OstreamT::format_type;
+
+  explicit element_writer(OstreamT& os)
+      : f(os.const_preferences().pair_fmt), write_first(os), write_second(os) {}
+
+  void operator()(batch_writer<OstreamT>&           w,
+                  const std::pair<FirstT, SecondT>& p) {
+    w.put(f.lb);
+    write_first(w, p.first);
+    w.put(f.sep);
+    write_second(w, p.second);
+    w.put(f.rb);
+  }
+
+  const format_type&                         f;
+  element_writer_by_type<OstreamT, FirstT>  write_first;
+  element_writer_by_type<OstreamT, SecondT> write_second;
+};
+
+template <typename OstreamT, typename... Args>
+struct element_writer<OstreamT, std::tuple<Args...>> {
+  using format_type = typename OstreamT::format_type;
+
+  explicit element_writer(OstreamT& os)
+      : f(os.const_preferences().tuple_fmt),
+        writers(element_writer_by_type<OstreamT, Args>(os)...) {}
+
+  void operator()(batch_writer<OstreamT>& w, const std::tuple<Args...>& t) {
+    w.put(f.lb);
+    write_fields(w, t, typename make_index_sequence<sizeof...(Args)>::type());
+    w.put(f.rb);
+  }
+
+  template <size_t... Is>
+  void write_fields(batch_writer<OstreamT>&    w,
+                    const std::tuple<Args...>& t,
+                    index_sequence<Is...>) {
+    int expand[] = {
+        0, ((void)(Is != 0 ? w.put(f.sep) : void()),
+            (void)std::get<Is>(writers)(w, std::get<Is>(t)),
+            0)...};
+    (void)expand;
+  }
+
+  const format_type&                                   f;
+  std::tuple<element_writer_by_type<OstreamT, Args>...> writers;
+};
+
+// Output a contiguous container, e.g. std::vector, std::array.
+template <typename OstreamT, typename ContainerT, typename FormatT>
+typename std::enable_if<
+    is_batch_number<typename ContainerT::value_type>::value,
+    OstreamT&>::type
+output_contiguous(OstreamT& os, const ContainerT& c, const FormatT& f) {
+  const size_t summary_min_size = os.const_preferences().summary_min_size;
+  if (summary_min_size != 0 && c.size() >= summary_min_size) {
+    return output_summary(
+        os, c.data(), c.data() + c.size(), f, summary_options());
+  }
+  return output_numbers(os, c.data(), c.data() + c.size(), f);
+}
+
+template <typename OstreamT, typename ContainerT, typename FormatT>
+typename std::enable_if<
+    !is_batch_number<typename ContainerT::value_type>::value,
+    OstreamT&>::type
+output_contiguous(OstreamT& os, const ContainerT& c, const FormatT& f) {
+  return output_all(os, c.begin(), c.end(), c.size(), f);
+}
+
+// Marks an output of a stream. The outermost one lets a stream bound to a
+// preferences holder take the latest preferences.
+template <typename OstreamT>
+class output_scope {
+public:
+  explicit output_scope(OstreamT& os) : os_(os) { os_.enter_output(); }
+  ~output_scope() { os_.leave_output(); }
+
+  output_scope(const output_scope&)            = delete;
+  output_scope& operator=(const output_scope&) = delete;
+
+private:
+  OstreamT& os_;
+};
+
+}  // namespace internal
+
+template <typename OstreamBaseT, typename PreferencesT>
+class basic_ostream : public OstreamBaseT {
+  using base_type = OstreamBaseT;
+
+public:
+  using ostream_base_type = OstreamBaseT;
+  using preferences_type  = PreferencesT;
+  using string_type       = typename preferences_type::string_type;
+  using char_type         = typename preferences_type::char_type;
+  using format_type       = typename preferences_type::format_type;
+  using traits_type       = typename string_type::traits_type;
+  using allocator_type    = typename string_type::allocator_type;
+
+  static_assert(
+      std::is_same<typename OstreamBaseT::char_type, char_type>::value,
+      "OstreamBaseT::char_type must be same type as PreferencesT::char_type");
+  static_assert(
+      std::is_same<typename OstreamBaseT::traits_type, traits_type>::value,
+      "OstreamBaseT::traits_type must be same type as traits_type");
+
+  using holder_type = basic_preferences_holder<
+      typename internal::preferences_traits<preferences_type>::value_type>;
+
+  // Starts with the shared default preferences, which is copied on the first
+  // mutable access by `preferences()` or `preferences_ptr()`.
+  template <typename... Args>
+  explicit basic_ostream(Args&&... args)
+      : base_type(std::forward<Args>(args)...),
+        preferences_ptr_(preferences_traits::shared_default()),
+        owns_preferences_(false) {}
+
+  template <typename... Args>
+  explicit basic_ostream(placeholder::no_init_preferences, Args&&... args)
+      : base_type(std::forward<Args>(args)...),
+        preferences_ptr_(nullptr),
+        owns_preferences_(false) {}
+
+  // The preferences is not owned, it must outlive the usage by this stream.
+  template <typename... Args>
+  explicit basic_ostream(placeholder::with_preferences_ptr,
+                         preferences_type* pref_ptr,
+                         Args&&... args)
+      : base_type(std::forward<Args>(args)...),
+        preferences_ptr_(pref_ptr),
+        owns_preferences_(false) {}
+
+  ~basic_ostream() { delete_preferences_ptr(); }
+
+  // The output scope is entered before reading the format, as it may sync the
+  // preferences from a holder and release the current version.
+  template <typename... Args>
+  basic_ostream& print(const Args&... args) {
+    internal::output_scope<basic_ostream> scope(*this);
+    print(const_preferences().print_fmt, args...);
+    return *this;
+  }
+
+  template <typename... Args>
+  basic_ostream& print(const format_type& fmt, const Args&... args) {
+    internal::output_scope<basic_ostream> scope(*this);
+    *this << fmt.lb;
+    __print(fmt, args...);
+    *this << fmt.rb;
+    return *this;
+  }
+
+  template <typename... Args>
+  basic_ostream& println(const Args&... args) {
+    print(args...) << std::endl;
+    return *this;
+  }
+
+  template <typename... Args>
+  basic_ostream& println(const format_type& fmt, const Args&... args) {
+    print(fmt, args...) << std::endl;
+    return *this;
+  }
+
+  template <typename Iterator>
+  basic_ostream& print_range(Iterator begin, Iterator end) {
+    internal::output_scope<basic_ostream> scope(*this);
+    return print_range(begin, end, const_preferences().print_range_fmt);
+  }
+
+  template <typename Iterator>
+  basic_ostream& print_range(Iterator           begin,
+                             Iterator           end,
+                             const format_type& range_fmt) {
+    internal::output_scope<basic_ostream> scope(*this);
+    return internal::output_all(
+        *this, begin, end, internal::cheap_distance(begin, end), range_fmt);
+  }
+
+  preferences_type&       preferences() { return *preferences_ptr(); }
+  const preferences_type& preferences() const { return *preferences_ptr_; }
+
+  preferences_type* preferences_ptr() {
+    copy_shared_preferences(
+        std::integral_constant<bool, preferences_traits::copy_on_write>());
+    return preferences_ptr_;
+  }
+  const preferences_type* preferences_ptr() const { return preferences_ptr_; }
+
+  /// Read-only access, never copies the shared default preferences.
+  const preferences_type& const_preferences() const {
+    return *preferences_ptr_;
+  }
+  const preferences_type* const_preferences_ptr() const {
+    return preferences_ptr_;
+  }
+
+  /// State of output limits while printing containers, for internal use.
+  internal::limit_state<char_type, traits_type>& limit_state() {
+    return limit_state_;
+  }
+
+  /// Whether the preferences is owned and will be deleted by this stream.
+  bool owns_preferences() const { return owns_preferences_; }
+
+  /// Use a newly allocated default preferences owned by this stream.
+  void new_preferences_ptr() {
+    set_preferences_ptr(std::unique_ptr<preferences_type>(
+        new typename preferences_traits::value_type));
+  }
+
+  /// Delete the preferences if owned, then set it null.
+  void delete_preferences_ptr() {
+    if (owns_preferences_) delete preferences_ptr_;
+    preferences_ptr_  = nullptr;
+    owns_preferences_ = false;
+    holder_           = nullptr;
+    snapshot_.reset();
+  }
+
+  /// Print by the preferences published to holder, the latest version is
+  /// taken at the start of each output. Mutable access to the preferences
+  /// copies the current version and unbinds. The holder must outlive the
+  /// usage by this stream.
+  void bind_preferences(const holder_type& holder) {
+    static_assert(!internal::is_static_preferences<preferences_type>::value,
+                  "static_preferences can not be bound to a holder");
+    delete_preferences_ptr();
+    holder_ = &holder;
+    sync_preferences();
+  }
+
+  /// The holder bound by `bind_preferences`, or null.
+  const holder_type* preferences_holder() const { return holder_; }
+
+  /// Called at the start and end of each output, for internal use. The depth
+  /// is counted even if unbound, as the binding may change inside an output.
+  void enter_output() {
+    if (output_depth_++ == 0 && holder_ != nullptr &&
+        holder_->version() != version_) {
+      sync_preferences();
+    }
+  }
+  void leave_output() {
+    if (output_depth_ != 0) --output_depth_;
+  }
+
+  /// Use a preferences not owned by this stream, it must outlive the usage.
+  void set_preferences_ptr(preferences_type* v) {
+    if (v == preferences_ptr_) return;
+    delete_preferences_ptr();
+    preferences_ptr_ = v;
+  }
+
+  /// Use a preferences owned by this stream.
+  void set_preferences_ptr(std::unique_ptr<preferences_type> v) {
+    delete_preferences_ptr();
+    preferences_ptr_  = v.release();
+    owns_preferences_ = preferences_ptr_ != nullptr;
+  }
+
+  void clear_preferences_ptr() { set_preferences_ptr(nullptr); }
+
+private:
+  basic_ostream& __print(const format_type& fmt) { return *this; }
+
+  template <typename T>
+  basic_ostream& __print(const format_type& fmt, const T& t) {
+    *this << t;
+    return *this;
+  }
+
+  template <typename T, typename... Args>
+  basic_ostream& __print(const format_type& fmt,
+                         const T&           t,
+                         const Args&... args) {
+    *this << t;
+    *this << fmt.sep;
+    __print(fmt, args...);
+    return *this;
+  }
+
+  using preferences_traits = internal::preferences_traits<preferences_type>;
+
+  void copy_shared_preferences(std::true_type) {
+    if (preferences_ptr_ == preferences_traits::shared_default() ||
+        holder_ != nullptr) {
+      preferences_ptr_ =
+          new typename preferences_traits::value_type(*preferences_ptr_);
+      owns_preferences_ = true;
+      holder_           = nullptr;
+      snapshot_.reset();
+    }
+  }
+
+  void copy_shared_preferences(std::false_type) {}
+
+  // Versions are never mutated, only a copy is exposed mutably.
+  void sync_preferences() {
+    version_         = holder_->version();
+    snapshot_        = holder_->load();
+    preferences_ptr_ = const_cast<preferences_type*>(snapshot_.get());
+  }
+
+  preferences_type* preferences_ptr_;
+  bool              owns_preferences_;
+
+  // Binding to a preferences holder.
+  typename holder_type::snapshot_type snapshot_;
+  const holder_type*                  holder_       = nullptr;
+  uint64_t                            version_      = 0;
+  size_t                              output_depth_ = 0;
+
+  internal::limit_state<char_type, traits_type> limit_state_;
+};
+
+namespace internal {
+
+// Discard the output of a string stream, string builders keep capacity.
+template <typename StringT, typename OstreamT>
+void clear_ostream_buf(OstreamT& os) {
+  os.str(StringT{});
+}
+
+template <typename StringT, typename BuilderStringT>
+void clear_ostream_buf(basic_string_builder<BuilderStringT>& os) {
+  os.clear_buf();
+}
+
+}  // namespace internal
+
+template <typename OstreamBaseT, typename PreferencesT>
+class basic_ostringstream : public basic_ostream<OstreamBaseT, PreferencesT> {
+  using base_type = basic_ostream<OstreamBaseT, PreferencesT>;
+
+public:
+  using ostream_base_type  = typename base_type::ostream_base_type;
+  using preferences_type   = typename base_type::preferences_type;
+  using string_type        = typename base_type::string_type;
+  using char_type          = typename base_type::char_type;
+  using format_type        = typename base_type::format_type;
+  using traits_type        = typename base_type::traits_type;
+  using allocator_type     = typename base_type::allocator_type;
+  using string_vector_type = std::vector<string_type>;
+  using string_list_type   = basic_string_list<string_type>;
+
+  static_assert(
+      std::is_same<typename OstreamBaseT::allocator_type,
+                   allocator_type>::value,
+      "OstreamBaseT::allocator_type must be same type as allocator_type");
+
+  template <typename... Args>
+  basic_ostringstream(Args&&... args)
+      : base_type(std::forward<Args>(args)...) {}
+
+  template <typename... Args>
+  explicit basic_ostringstream(placeholder::no_init_preferences no_init_pref,
+                               Args&&... args)
+      : base_type(no_init_pref, std::forward<Args>(args)...) {}
+
+  template <typename... Args>
+  explicit basic_ostringstream(placeholder::with_preferences_ptr with_pref_ptr,
+                               preferences_type*                 pref_ptr,
+                               Args&&... args)
+      : base_type(with_pref_ptr, pref_ptr, std::forward<Args>(args)...) {}
+
+  template <typename... Args>
+  string_vector_type to_string_vector(const Args&... args) {
+    auto old = ostream_base_type::str();
+    clear_buf();
+    string_vector_type ret;
+    __to_string_vector(ret, args...);
+    *this << old;
+    return ret;
+  }
+
+  /// Print each arg into one buffer by this stream's preferences and format
+  /// state, leaving the stream's contents untouched.
+  template <typename... Args>
+  string_list_type to_string_list(const Args&... args) {
+    using builder_type = basic_string_builder<string_type>;
+    basic_ostream<builder_type, PreferencesT> os(
+        placeholder::with_preferences_ptr{},
+        const_cast<preferences_type*>(this->const_preferences_ptr()));
+    os.copyfmt(*this);
+    std::vector<typename string_list_type::size_type> ends;
+    ends.reserve(sizeof...(args));
+    __to_string_list(os, ends, args...);
+    return string_list_type(os.release(), std::move(ends));
+  }
+
+  /// Discard the output. String builders keep their capacity.
+  void clear_buf() {
+    internal::clear_ostream_buf<string_type>(
+        static_cast<ostream_base_type&>(*this));
+  }
+
+private:
+  void __to_string_vector(string_vector_type& ret) {}
+
+  template <typename T, typename... Args>
+  void __to_string_vector(string_vector_type& ret,
+                          const T&            t,
+                          const Args&... args) {
+    *this << t;
+    ret.push_back(ostream_base_type::str());
+    clear_buf();
+    __to_string_vector(ret, args...);
+  }
+
+  template <typename OstreamT, typename EndsT>
+  static void __to_string_list(OstreamT&, EndsT&) {}
+
+  template <typename OstreamT, typename EndsT, typename T, typename... Args>
+  static void __to_string_list(OstreamT&   os,
+                               EndsT&      ends,
+                               const T&    t,
+                               const Args&... args) {
+    os << t;
+    ends.push_back(os.size());
+    __to_string_list(os, ends, args...);
+  }
+};
+
+template <typename OstreamBaseT, typename PreferencesT, typename FloatT>
+typename std::enable_if<std::is_same<FloatT, float>::value ||
+                            std::is_same<FloatT, double>::value,
+                        basic_ostream<OstreamBaseT, PreferencesT>&>::type
+operator<<(basic_ostream<OstreamBaseT, PreferencesT>& os, FloatT v) {
+  using ostream_type = basic_ostream<OstreamBaseT, PreferencesT>;
+  using char_type    = typename ostream_type::char_type;
+  using string_type  = typename ostream_type::string_type;
+  internal::output_scope<ostream_type> scope(os);
+  if (!os.const_preferences_ptr() ||
+      os.const_preferences().float_output != float_format::shortest) {
+    static_cast<OstreamBaseT&>(os) << v;
+    return os;
+  }
+  char_type buf[internal::max_float_chars];
+  const int n = internal::format_shortest(buf, v);
+  if (os.width() == 0) {
+    os.write(buf, n);
+  } else {
+    os << string_type(buf, n);
+  }
+  return os;
+}
+
+template <typename OstreamBaseT,
+          typename PreferencesT,
+          typename FirstT,
+          typename SecondT>
+basic_ostream<OstreamBaseT, PreferencesT>& operator<<(
+    basic_ostream<OstreamBaseT, PreferencesT>& os,
+    const std::pair<FirstT, SecondT>&          p) {
+  using ostream_type = basic_ostream<OstreamBaseT, PreferencesT>;
+  internal::output_scope<ostream_type> scope(os);
+  internal::batch_writer<ostream_type> w(os);
+  internal::element_writer<ostream_type, std::pair<FirstT, SecondT>> write(os);
+  write(w, p);
+  w.flush();
+  return os;
+}
+
+template <typename OstreamBaseT, typename PreferencesT, typename... Args>
+basic_ostream<OstreamBaseT, PreferencesT>& operator<<(
+    basic_ostream<OstreamBaseT, PreferencesT>& os,
+    const std::tuple<Args...>&                 t) {
+  using ostream_type = basic_ostream<OstreamBaseT, PreferencesT>;
+  internal::output_scope<ostream_type> scope(os);
+  internal::batch_writer<ostream_type> w(os);
+  internal::element_writer<ostream_type, std::tuple<Args...>> write(os);
+  write(w, t);
+  w.flush();
+  return os;
+}
+
+template <typename OstreamBaseT,
+          typename PreferencesT,
+          typename T,
+          std::size_t N>
+basic_ostream<OstreamBaseT, PreferencesT>& operator<<(
+    basic_ostream<OstreamBaseT, PreferencesT>& os, const std::array<T, N>& c) {
+  internal::output_scope<basic_ostream<OstreamBaseT, PreferencesT>> scope(os);
+  return internal::output_contiguous(os, c, os.const_preferences().array_fmt);
+}
+
+#define MYOSTREAM_DEFINE_OVERLOAD(container)                             \
+  MYOSTREAM_DECLARE_OVERLOAD(container) {                                \
+    internal::output_scope<basic_ostream<OstreamBaseT, PreferencesT>>    \
+        scope(os);                                                       \
+    return internal::output_all(os,                                      \
+                                c.begin(),                               \
+                                c.end(),                                 \
+                                internal::container_size(c, 0),          \
+                                os.const_preferences().container##_fmt); \
+  }
+
+#define MYOSTREAM_DEFINE_OVERLOAD_FOR_MAP(container)                  \
+  MYOSTREAM_DECLARE_OVERLOAD(container) {                             \
+    internal::output_scope<basic_ostream<OstreamBaseT, PreferencesT>> \
+        scope(os);                                                    \
+    return internal::output_all(                                      \
+        os,                                                           \
+        c.begin(),                                                    \
+        c.end(),                                                      \
+        c.size(),                                                     \
+        os.const_preferences().container##_fmt,                       \
+        os.const_preferences().container##_kv_fmt);                   \
+  }
+
+MYOSTREAM_DEFINE_OVERLOAD(deque)
+MYOSTREAM_DEFINE_OVERLOAD(forward_list)
+MYOSTREAM_DEFINE_OVERLOAD(initializer_list)
+MYOSTREAM_DEFINE_OVERLOAD(list)
+MYOSTREAM_DECLARE_OVERLOAD(vector) {
+  internal::output_scope<basic_ostream<OstreamBaseT, PreferencesT>> scope(os);
+  return internal::output_contiguous(os, c, os.const_preferences().vector_fmt);
+}
+
+MYOSTREAM_DEFINE_OVERLOAD(set)
+MYOSTREAM_DEFINE_OVERLOAD(multiset)
+MYOSTREAM_DEFINE_OVERLOAD(unordered_set)
+MYOSTREAM_DEFINE_OVERLOAD(unordered_multiset)
+
+MYOSTREAM_DEFINE_OVERLOAD_FOR_MAP(map)
+MYOSTREAM_DEFINE_OVERLOAD_FOR_MAP(multimap)
+MYOSTREAM_DEFINE_OVERLOAD_FOR_MAP(unordered_map)
+MYOSTREAM_DEFINE_OVERLOAD_FOR_MAP(unordered_multimap)
+
+#undef MYOSTREAM_DEFINE_OVERLOAD_FOR_MAP
+#undef MYOSTREAM_DEFINE_OVERLOAD
+#undef MYOSTREAM_DECLARE_OVERLOAD
+
+template <typename ContainerT>
+summary_wrapper<ContainerT> summary(const ContainerT&      c,
+                                    const summary_options& options) {
+  return {c, options};
+}
+
+template <typename OstreamBaseT, typename PreferencesT, typename ContainerT>
+basic_ostream<OstreamBaseT, PreferencesT>& operator<<(
+    basic_ostream<OstreamBaseT, PreferencesT>& os,
+    const summary_wrapper<ContainerT>&         s) {
+  internal::output_scope<basic_ostream<OstreamBaseT, PreferencesT>> scope(os);
+  return internal::output_summary_of(
+      os,
+      s.c,
+      internal::format_of(os.const_preferences(), &s.c),
+      s.options,
+      0);
+}
+
+namespace internal {
+
+// Reset the formatting state of a reused stream as if it was newly created.
+template <typename OstreamT>
+void reset_stream_state(OstreamT& os) {
+  os.clear();
+  os.exceptions(std::ios_base::goodbit);
+  os.flags(std::ios_base::skipws | std::ios_base::dec);
+  os.precision(6);
+  os.width(0);
+  os.fill(os.widen(' '));
+  std::locale global_loc;
+  if (os.getloc() != global_loc) os.imbue(global_loc);
+}
+
+/**
+ * @brief A scoped `basic_ostringstream` with constant shared preferences, built
+ * on `basic_string_builder`. Each thread keeps one cached stream per type for
+ * reuse, so its locale setup and buffer capacity survive across calls.
+ * A nested usage on the same thread, e.g. calling `tostr` inside some
+ * operator<<, falls back to a new stream.
+ * @tparam OssT A `basic_ostringstream` type over a `basic_string_builder` with
+ * constant preferences.
+ */
+template <typename OssT>
+class scoped_ostringstream {
+  using string_type = typename OssT::string_type;
+
+  struct slot {
+    slot()
+        : oss(placeholder::with_preferences_ptr{},
+              OssT::preferences_type::const_ins_ptr()),
+          in_use(false) {}
+
+    OssT oss;
+    bool in_use;
+  };
+
+public:
+#ifdef MYOSTREAM_NO_THREAD_LOCAL_CACHE
+  scoped_ostringstream() : slot_(nullptr), own_(new slot) {}
+#else
+  scoped_ostringstream() : slot_(&thread_slot()) {
+    if (slot_->in_use) {
+      slot_ = nullptr;
+      own_.reset(new slot);
+    } else {
+      slot_->in_use = true;
+      reset_stream_state(slot_->oss);
+      builder().clear_buf();
+    }
+  }
+#endif
+
+  ~scoped_ostringstream() {
+    if (!slot_) return;
+    builder().clear_buf();
+    if (builder().capacity() > MYOSTREAM_THREAD_LOCAL_CACHE_CAPACITY) {
+      builder().shrink_to_fit();
+    }
+    slot_->in_use = false;
+  }
+
+  scoped_ostringstream(scoped_ostringstream&& r)
+      : slot_(r.slot_), own_(std::move(r.own_)) {
+    r.slot_ = nullptr;
+  }
+
+  scoped_ostringstream(const scoped_ostringstream&)            = delete;
+  scoped_ostringstream& operator=(const scoped_ostringstream&) = delete;
+
+  OssT& get() { return slot_ ? slot_->oss : own_->oss; }
+
+  /// Whether the thread local cached stream is used, which already has
+  /// capacity reserved by previous calls.
+  bool reused() const { return slot_ != nullptr; }
+
+  /// Get the result. Copy it out exactly sized if the buffer is to be reused.
+  string_type result() {
+    if (!slot_) return own_->oss.release();
+    return string_type(slot_->oss.data(), slot_->oss.size());
+  }
+
+private:
+  static slot& thread_slot() {
+    static thread_local slot s;
+    return s;
+  }
+
+  // Keeps capacity on clear_buf, unlike basic_ostringstream::clear_buf.
+  typename OssT::ostream_base_type& builder() { return get(); }
+
+  slot*                 slot_;
+  std::unique_ptr<slot> own_;
+};
+
+}  // namespace internal
+
+namespace internal {
+
+// Print args into a stream buffer with the constant default preferences, by
+// tostr semantics if `fake_sep`, else by ptostr semantics.
+template <typename OstreamBaseT, bool DenseStyle, typename... Args>
+void print_to_streambuf(
+    std::basic_streambuf<typename OstreamBaseT::char_type,
+                         typename OstreamBaseT::traits_type>* sb,
+    bool fake_sep,
+    const Args&... args) {
+  using os_t = basic_ostream_with_const_default_preferences<
+      std::basic_ostream<typename OstreamBaseT::char_type,
+                         typename OstreamBaseT::traits_type>,
+      DenseStyle>;
+  os_t os(placeholder::with_preferences_ptr{},
+          os_t::preferences_type::const_ins_ptr(),
+          sb);
+  if (fake_sep) {
+    os.print(os.const_preferences().fake_fmt, args...);
+  } else {
+    os.print(args...);
+  }
+}
+
+}  // namespace internal
+
+template <typename OstreamBaseT, bool DenseStyle, typename... Args>
+size_t basic_formatted_size(const Args&... args) {
+  basic_counting_buf<typename OstreamBaseT::char_type,
+                     typename OstreamBaseT::traits_type>
+      buf;
+  internal::print_to_streambuf<OstreamBaseT, DenseStyle>(&buf, true, args...);
+  return buf.count();
+}
+
+template <typename OstreamBaseT, bool DenseStyle, typename... Args>
+size_t basic_pformatted_size(const Args&... args) {
+  basic_counting_buf<typename OstreamBaseT::char_type,
+                     typename OstreamBaseT::traits_type>
+      buf;
+  internal::print_to_streambuf<OstreamBaseT, DenseStyle>(&buf, false, args...);
+  return buf.count();
+}
+
+template <typename OstreamBaseT,
+          bool DenseStyle,
+          typename OutputIt,
+          typename... Args>
+OutputIt basic_format_to(OutputIt out, const Args&... args) {
+  basic_iterator_buf<OutputIt,
+                     typename OstreamBaseT::char_type,
+                     typename OstreamBaseT::traits_type>
+      buf(out);
+  internal::print_to_streambuf<OstreamBaseT, DenseStyle>(&buf, true, args...);
+  return buf.out();
+}
+
+template <typename OstreamBaseT,
+          bool DenseStyle,
+          typename OutputIt,
+          typename... Args>
+OutputIt basic_pformat_to(OutputIt out, const Args&... args) {
+  basic_iterator_buf<OutputIt,
+                     typename OstreamBaseT::char_type,
+                     typename OstreamBaseT::traits_type>
+      buf(out);
+  internal::print_to_streambuf<OstreamBaseT, DenseStyle>(&buf, false, args...);
+  return buf.out();
+}
+
+template <typename OstreamBaseT, bool DenseStyle, typename... Args>
+format_to_n_result<typename OstreamBaseT::char_type*> basic_format_to_n(
+    typename OstreamBaseT::char_type* buf, size_t n, const Args&... args) {
+  basic_truncating_buf<typename OstreamBaseT::char_type,
+                       typename OstreamBaseT::traits_type>
+      tbuf(buf, n);
+  internal::print_to_streambuf<OstreamBaseT, DenseStyle>(&tbuf, true, args...);
+  return {tbuf.out(), tbuf.size()};
+}
+
+template <typename OstreamBaseT, bool DenseStyle, typename... Args>
+format_to_n_result<typename OstreamBaseT::char_type*> basic_pformat_to_n(
+    typename OstreamBaseT::char_type* buf, size_t n, const Args&... args) {
+  basic_truncating_buf<typename OstreamBaseT::char_type,
+                       typename OstreamBaseT::traits_type>
+      tbuf(buf, n);
+  internal::print_to_streambuf<OstreamBaseT, DenseStyle>(
+      &tbuf, false, args...);
+  return {tbuf.out(), tbuf.size()};
+}
+
+template <typename... Args>
+size_t formatted_size(const Args&... args) {
+  return basic_formatted_size<std::ostringstream, false>(args...);
+}
+
+template <typename... Args>
+size_t pformatted_size(const Args&... args) {
+  return basic_pformatted_size<std::ostringstream, false>(args...);
+}
+
+template <typename OutputIt, typename... Args>
+OutputIt format_to(OutputIt out, const Args&... args) {
+  return basic_format_to<std::ostringstream, false>(out, args...);
+}
+
+template <typename OutputIt, typename... Args>
+OutputIt wformat_to(OutputIt out, const Args&... args) {
+  return basic_format_to<std::wostringstream, false>(out, args...);
+}
+
+template <typename OutputIt, typename... Args>
+OutputIt pformat_to(OutputIt out, const Args&... args) {
+  return basic_pformat_to<std::ostringstream, false>(out, args...);
+}
+
+template <typename OutputIt, typename... Args>
+OutputIt pwformat_to(OutputIt out, const Args&... args) {
+  return basic_pformat_to<std::wostringstream, false>(out, args...);
+}
+
+template <typename CharT, typename... Args>
+format_to_n_result<CharT*> format_to_n(CharT*      buf,
+                                       size_t      n,
+                                       const Args&... args) {
+  return basic_format_to_n<std::basic_ostringstream<CharT>, false>(
+      buf, n, args...);
+}
+
+template <typename CharT, typename... Args>
+format_to_n_result<CharT*> pformat_to_n(CharT*      buf,
+                                        size_t      n,
+                                        const Args&... args) {
+  return basic_pformat_to_n<std::basic_ostringstream<CharT>, false>(
+      buf, n, args...);
+}
+
+template <typename OstreamBaseT,
+          bool DenseStyle,
+          typename CallbackT,
+          typename... Args>
+void basic_format_chunks(CallbackT callback, const Args&... args) {
+  basic_chunk_buf<CallbackT&,
+                  typename OstreamBaseT::char_type,
+                  typename OstreamBaseT::traits_type>
+      buf(callback);
+  internal::print_to_streambuf<OstreamBaseT, DenseStyle>(&buf, true, args...);
+  buf.pubsync();
+  if (buf.error()) std::rethrow_exception(buf.error());
+}
+
+template <typename OstreamBaseT,
+          bool DenseStyle,
+          typename CallbackT,
+          typename... Args>
+void basic_pformat_chunks(CallbackT callback, const Args&... args) {
+  basic_chunk_buf<CallbackT&,
+                  typename OstreamBaseT::char_type,
+                  typename OstreamBaseT::traits_type>
+      buf(callback);
+  internal::print_to_streambuf<OstreamBaseT, DenseStyle>(&buf, false, args...);
+  buf.pubsync();
+  if (buf.error()) std::rethrow_exception(buf.error());
+}
+
+template <typename CallbackT, typename... Args>
+void format_chunks(CallbackT callback, const Args&... args) {
+  basic_format_chunks<std::ostringstream, false>(callback, args...);
+}
+
+template <typename CallbackT, typename... Args>
+void wformat_chunks(CallbackT callback, const Args&... args) {
+  basic_format_chunks<std::wostringstream, false>(callback, args...);
+}
+
+template <typename CallbackT, typename... Args>
+void pformat_chunks(CallbackT callback, const Args&... args) {
+  basic_pformat_chunks<std::ostringstream, false>(callback, args...);
+}
+
+template <typename CallbackT, typename... Args>
+void pwformat_chunks(CallbackT callback, const Args&... args) {
+  basic_pformat_chunks<std::wostringstream, false>(callback, args...);
+}
+
+// A newly created buffer is reserved by the exact result size, while a reused
+// one already has capacity.
+template <typename OstreamBaseT, bool DenseStyle, typename... Args>
+string_type_by_ostream<OstreamBaseT> basic_tostr(const Args&... args) {
+  using oss_t = basic_ostringstream_with_const_default_preferences<
+      internal::string_builder_by_ostream<OstreamBaseT>,
+      DenseStyle>;
+  internal::scoped_ostringstream<oss_t> scoped;
+  oss_t&                                oss = scoped.get();
+  if (!scoped.reused()) {
+    oss.reserve(basic_formatted_size<OstreamBaseT, DenseStyle>(args...));
+  }
+  oss.print(oss.const_preferences().fake_fmt, args...);
+  return scoped.result();
+}
+
+template <typename OstreamBaseT, bool DenseStyle, typename... Args>
+string_type_by_ostream<OstreamBaseT> basic_ptostr(const Args&... args) {
+  using oss_t = basic_ostringstream_with_const_default_preferences<
+      internal::string_builder_by_ostream<OstreamBaseT>,
+      DenseStyle>;
+  internal::scoped_ostringstream<oss_t> scoped;
+  oss_t&                                oss = scoped.get();
+  if (!scoped.reused()) {
+    oss.reserve(basic_pformatted_size<OstreamBaseT, DenseStyle>(args...));
+  }
+  oss.print(args...);
+  return scoped.result();
+}
+
+template <typename... Args>
+std::string tostr(const Args&... args) {
+  return basic_tostr<std::ostringstream, false>(args...);
+}
+
+template <typename... Args>
+std::wstring towstr(const Args&... args) {
   return basic_tostr<std::wostringstream, false>(args...);
 }
 
-template <typename... Args>
-std::string ptostr(const Args&... args) {
-  return basic_ptostr<std::ostringstream, false>(args...);
-}
+template <typename... Args>
+std::string ptostr(const Args&... args) {
+  return basic_ptostr<std::ostringstream, false>(args...);
+}
+
+template <typename... Args>
+std::wstring ptowstr(const Args&... args) {
+  return basic_ptostr<std::wostringstream, false>(args...);
+}
+
+template <typename... Args>
+std::string tostr_dense(const Args&... args) {
+  return basic_tostr<std::ostringstream, true>(args...);
+}
+
+template <typename... Args>
+std::wstring towstr_dense(const Args&... args) {
+  return basic_tostr<std::wostringstream, true>(args...);
+}
+
+template <typename... Args>
+std::string ptostr_dense(const Args&... args) {
+  return basic_ptostr<std::ostringstream, true>(args...);
+}
+
+template <typename... Args>
+std::wstring ptowstr_dense(const Args&... args) {
+  return basic_ptostr<std::wostringstream, true>(args...);
+}
+
+namespace internal {
+
+// Results of a chunk of `tostr_batch`, one string per object.
+template <typename StringT>
+struct batch_strings {
+  template <typename OssT>
+  void add(const OssT& oss) {
+    strings.emplace_back(oss.data() + start, oss.size() - start);
+    start = oss.size();
+  }
+
+  template <typename ScopedT>
+  void finish(ScopedT&) {}
+
+  std::vector<StringT> strings;
+  size_t               start = 0;
+};
+
+// Results of a chunk of `tostr_batch_list`, packed in one buffer.
+template <typename StringT>
+struct batch_packed {
+  template <typename OssT>
+  void add(const OssT& oss) {
+    ends.push_back(oss.size());
+  }
+
+  template <typename ScopedT>
+  void finish(ScopedT& scoped) {
+    buf = scoped.result();
+  }
+
+  StringT                                  buf;
+  std::vector<typename StringT::size_type> ends;
+};
+
+// Format objects in [b, e) by tostr semantics one by one into this thread's
+// reused buffer, each with a fresh stream state.
+template <typename OstreamBaseT,
+          bool DenseStyle,
+          typename ForwardIt,
+          typename ResultT>
+void format_batch_chunk(ForwardIt b, ForwardIt e, ResultT& result) {
+  using oss_t = basic_ostringstream_with_const_default_preferences<
+      string_builder_by_ostream<OstreamBaseT>,
+      DenseStyle>;
+  scoped_ostringstream<oss_t> scoped;
+  oss_t&                      oss = scoped.get();
+  for (ForwardIt it = b; it != e; ++it) {
+    if (it != b) reset_stream_state(oss);
+    oss.print(oss.const_preferences().fake_fmt, *it);
+    result.add(oss);
+  }
+  result.finish(scoped);
+}
+
+// Format objects in [first, last) in `threads` chunks, return the results of
+// each chunk.
+template <typename OstreamBaseT,
+          bool DenseStyle,
+          typename ResultT,
+          typename ForwardIt>
+std::vector<ResultT> format_batch(ForwardIt first,
+                                  ForwardIt last,
+                                  size_t    threads) {
+  const size_t total = static_cast<size_t>(std::distance(first, last));
+  if (threads == 0) threads = std::thread::hardware_concurrency();
+  size_t chunks = threads < total ? threads : total;
+  if (chunks == 0) chunks = 1;
+  std::vector<ForwardIt> bounds = split_chunks(first, total, chunks);
+
+  std::vector<ResultT> results(chunks);
+  run_chunks(chunks, [&](size_t k) {
+    format_batch_chunk<OstreamBaseT, DenseStyle>(
+        bounds[k], bounds[k + 1], results[k]);
+  });
+  return results;
+}
+
+}  // namespace internal
+
+template <typename OstreamBaseT,
+          bool DenseStyle,
+          typename ForwardIt,
+          typename OutputIt>
+OutputIt basic_tostr_batch(ForwardIt first,
+                           ForwardIt last,
+                           OutputIt  out,
+                           size_t    threads = 0) {
+  using string_type = string_type_by_ostream<OstreamBaseT>;
+  auto results =
+      internal::format_batch<OstreamBaseT,
+                             DenseStyle,
+                             internal::batch_strings<string_type>>(
+          first, last, threads);
+  for (auto& r : results) {
+    out = std::move(r.strings.begin(), r.strings.end(), out);
+  }
+  return out;
+}
+
+template <typename OstreamBaseT, bool DenseStyle, typename ForwardIt>
+basic_string_list<string_type_by_ostream<OstreamBaseT>> basic_tostr_batch_list(
+    ForwardIt first,
+    ForwardIt last,
+    size_t    threads = 0) {
+  using string_type = string_type_by_ostream<OstreamBaseT>;
+  using size_type   = typename string_type::size_type;
+  auto results =
+      internal::format_batch<OstreamBaseT,
+                             DenseStyle,
+                             internal::batch_packed<string_type>>(
+          first, last, threads);
+  if (results.size() == 1) {
+    return basic_string_list<string_type>(std::move(results[0].buf),
+                                          std::move(results[0].ends));
+  }
+  size_type size = 0, count = 0;
+  for (auto& r : results) {
+    size += r.buf.size();
+    count += r.ends.size();
+  }
+  string_type            buf;
+  std::vector<size_type> ends;
+  buf.reserve(size);
+  ends.reserve(count);
+  for (auto& r : results) {
+    const size_type offset = buf.size();
+    buf.append(r.buf);
+    for (size_type end : r.ends) ends.push_back(offset + end);
+  }
+  return basic_string_list<string_type>(std::move(buf), std::move(ends));
+}
+
+template <typename ForwardIt, typename OutputIt>
+OutputIt tostr_batch(ForwardIt first,
+                     ForwardIt last,
+                     OutputIt  out,
+                     size_t    threads) {
+  return basic_tostr_batch<std::ostringstream, false>(
+      first, last, out, threads);
+}
+
+template <typename ForwardIt>
+string_list tostr_batch_list(ForwardIt first, ForwardIt last, size_t threads) {
+  return basic_tostr_batch_list<std::ostringstream, false>(
+      first, last, threads);
+}
+
+// ==================== watch ====================
+
+template <typename ResultStringT>
+inline std::vector<ResultStringT> split_macro_param_names(const std::string& s,
+                                                          size_t expect_size) {
+  using str_t = ResultStringT;
+  using oss_t = std_basic_ostringstream_by_string<str_t>;
+  oss_t              oss;
+  std::vector<str_t> ret;
+  size_t             n             = s.size();
+  bool               maybe_less_op = false;
+
+  // for ()/{}/[], not for <>
+  // start with s[i] == pair[0]
+  auto find_matched_bracket = [&](size_t i, const char* pair) {
+    MYOSTREAM_ASSERT(i < n && pair && s[i] == pair[0]);
+    for (int sum = 0; i < n; ++i) {
+      if (s[i] == pair[0])
+        --sum;
+      else if (s[i] == pair[1])
+        ++sum;
+      if (sum == 0) break;
+    }
+    return i;
+  };
+
+  auto must_not_left_angle_bracket = [&](const size_t i) {
+    MYOSTREAM_ASSERT(i < n && s[i] == '<');
+    // less or equal "<="
+    if (i + 1 < n && s[i + 1] == '=') return true;
+    // left shift "<<"
+    if (i + 1 < n && s[i + 1] == '<' || i >= 1 && s[i - 1] == '<') return true;
+    return false;
+  };
+
+  auto must_not_right_angle_bracket = [&](const size_t i) {
+    MYOSTREAM_ASSERT(i < n && s[i] == '>');
+    // greater or equal ">="
+    if (i + 1 < n && s[i + 1] == '=') return true;
+    return false;
+  };
+
+  // start with s[i] == '<'
+  auto find_matched_angle_bracket = [&](size_t i) {
+    MYOSTREAM_ASSERT(i < n && s[i] == '<');
+    for (int sum = 0;; ++i) {
+      if (s[i] == '<') {
+        if (!must_not_left_angle_bracket(i)) --sum;
+      } else if (s[i] == '>') {
+        if (!must_not_right_angle_bracket(i)) ++sum;
+      } else if (s[i] == '(') {
+        i = find_matched_bracket(i, "()");
+      } else if (s[i] == '{') {
+        i = find_matched_bracket(i, "{}");
+      } else if (s[i] == '[') {
+        i = find_matched_bracket(i, "[]");
+      }
+      if (sum == 0 || i >= n) break;
+    }
+    return i;
+  };
+
+  for (size_t i = 0; i < n; ++i) {
+    bool found_bracket = false;
+    for (const auto& p : {"()", "{}", "[]"}) {
+      if (s[i] != p[0]) continue;
+      found_bracket = true;
+      for (int sum = 0; i < n; ++i) {
+        oss << s[i];
+        if (s[i] == p[0])
+          --sum;
+        else if (s[i] == p[1])
+          ++sum;
+        if (sum == 0) break;
+      }
+    }
+    if (found_bracket) continue;
+
+    if (s[i] == '<') {
+      if (must_not_left_angle_bracket(i)) {
+        oss << s[i++];
+      } else {
+        maybe_less_op = true;
+        size_t j      = find_matched_angle_bracket(i);
+        if (j < n) {
+          while (i < j) { oss << s[i++]; }
+        }
+      }
+    }
+
+    if (s[i] == ',') {
+      auto v = oss.str();
+      while (!v.empty() && v.back() == ' ') v.pop_back();
+      ret.push_back(std::move(v));
+      oss.str(str_t{});
+      while (i + 1 < n && s[i + 1] == ' ') ++i;
+    } else {
+      oss << s[i];
+    }
+  }
+  ret.push_back(oss.str());
+  if (ret.size() != expect_size && maybe_less_op) {
+    throw std::runtime_error(
+        "try putting angle brackets(maybe less operator) in parenthesis");
+  }
+  MYOSTREAM_ASSERT(ret.size() == expect_size);
+  return ret;
+}
+
+namespace internal {
+
+/**
+ * @brief Identifies a call site of the watch macros, by a lambda which returns
+ * the stringified macro parameters. Since each lambda has a unique type, the
+ * split names can be cached per call site.
+ */
+template <typename NameLineGetterT>
+struct macro_call_site {
+  NameLineGetterT get_name_line;
+};
+
+template <typename NameLineGetterT>
+inline macro_call_site<NameLineGetterT> make_macro_call_site(
+    NameLineGetterT get_name_line) {
+  return macro_call_site<NameLineGetterT>{get_name_line};
+}
+
+// Split the names only on the first call, thread-safe.
+template <typename ResultStringT, typename NameLineGetterT>
+inline const std::vector<ResultStringT>& cached_split_macro_param_names(
+    const macro_call_site<NameLineGetterT>& site, size_t expect_size) {
+  static const std::vector<ResultStringT> names =
+      split_macro_param_names<ResultStringT>(site.get_name_line(),
+                                             expect_size);
+  return names;
+}
+
+}  // namespace internal
+
+template <typename OstreamT,
+          typename KvSepT,
+          typename ParamSepT,
+          typename FinalDelimT,
+          typename StringVectorT,
+          typename FinalArgT>
+inline OstreamT&& watch_to_ostream_aux(OstreamT&&           oss,
+                                       const KvSepT&        kv_sep,
+                                       const ParamSepT&     param_sep,
+                                       const FinalDelimT&   final_delim,
+                                       const StringVectorT& var_names,
+                                       size_t               cur_idx,
+                                       const FinalArgT&     final_arg) {
+  MYOSTREAM_ASSERT(cur_idx == var_names.size() - 1);
+  oss << var_names[cur_idx];
+  oss << kv_sep;
+  oss << final_arg;
+  oss << final_delim;
+  return oss;
+}
+
+template <typename OstreamT,
+          typename KvSepT,
+          typename ParamSepT,
+          typename FinalDelimT,
+          typename StringVectorT,
+          typename FirstArgT,
+          typename... Args>
+inline OstreamT&& watch_to_ostream_aux(OstreamT&&           oss,
+                                       const KvSepT&        kv_sep,
+                                       const ParamSepT&     param_sep,
+                                       const FinalDelimT&   final_delim,
+                                       const StringVectorT& var_names,
+                                       size_t               cur_idx,
+                                       const FirstArgT&     first_arg,
+                                       const Args&... other_args) {
+  MYOSTREAM_ASSERT(cur_idx < var_names.size());
+  oss << var_names[cur_idx];
+  oss << kv_sep;
+  oss << first_arg;
+  oss << param_sep;
+  watch_to_ostream_aux(oss,
+                       kv_sep,
+                       param_sep,
+                       final_delim,
+                       var_names,
+                       cur_idx + 1,
+                       other_args...);
+  return oss;
+}
+
+template <typename OstreamT,
+          typename KvSepT,
+          typename ParamSepT,
+          typename FinalDelimT,
+          typename... Args>
+inline OstreamT&& watch_to_ostream(OstreamT&&         oss,
+                                   const KvSepT&      kv_sep,
+                                   const ParamSepT&   param_sep,
+                                   const FinalDelimT& final_delim,
+                                   const std::string& vars_name_line,
+                                   const Args&... args) {
+  auto names = split_macro_param_names<
+      string_type_by_ostream<typename std::decay<OstreamT>::type>>(
+      vars_name_line, sizeof...(Args));
+  if (names.empty()) return std::forward<OstreamT>(oss);
+  watch_to_ostream_aux(oss, kv_sep, param_sep, final_delim, names, 0, args...);
+  return std::forward<OstreamT>(oss);
+}
+
+template <typename OstreamT,
+          typename KvSepT,
+          typename ParamSepT,
+          typename FinalDelimT,
+          typename NameLineGetterT,
+          typename... Args>
+inline OstreamT&& watch_to_ostream(
+    OstreamT&&                                        oss,
+    const KvSepT&                                     kv_sep,
+    const ParamSepT&                                  param_sep,
+    const FinalDelimT&                                final_delim,
+    const internal::macro_call_site<NameLineGetterT>& site,
+    const Args&... args) {
+  const auto& names = internal::cached_split_macro_param_names<
+      string_type_by_ostream<typename std::decay<OstreamT>::type>>(
+      site, sizeof...(Args));
+  if (names.empty()) return std::forward<OstreamT>(oss);
+  watch_to_ostream_aux(oss, kv_sep, param_sep, final_delim, names, 0, args...);
+  return std::forward<OstreamT>(oss);
+}
+
+template <typename ResultStringT,
+          typename KvSepT,
+          typename ParamSepT,
+          typename FinalDelimT,
+          typename VarsNameT,
+          typename... Args>
+inline ResultStringT watch_to_string(const KvSepT&      kv_sep,
+                                     const ParamSepT&   param_sep,
+                                     const FinalDelimT& final_delim,
+                                     const VarsNameT&   vars_name,
+                                     const Args&... args) {
+  using string_type = ResultStringT;
+  using oss_t =
+      basic_ostringstream<basic_string_builder<string_type>,
+                          const default_preferences<string_type>>;
+  internal::scoped_ostringstream<oss_t> scoped;
+  watch_to_ostream(
+      scoped.get(), kv_sep, param_sep, final_delim, vars_name, args...);
+  return scoped.result();
+}
+
+// ==================== lazy ====================
+
+namespace internal {
+
+// Print args by tostr semantics.
+struct lazy_print {
+  template <typename OstreamT, typename... Args>
+  void operator()(OstreamT& os, const Args&... args) const {
+    int expand[] = {0, ((void)(os << args), 0)...};
+    (void)expand;
+  }
+};
+
+// Print args by MYOSTREAM_WATCH semantics.
+template <typename KvSepT,
+          typename ParamSepT,
+          typename FinalDelimT,
+          typename NameLineGetterT>
+struct lazy_watch {
+  const KvSepT&                    kv_sep;
+  const ParamSepT&                 param_sep;
+  const FinalDelimT&               final_delim;
+  macro_call_site<NameLineGetterT> site;
+
+  template <typename OstreamT, typename... Args>
+  void operator()(OstreamT& os, const Args&... args) const {
+    watch_to_ostream(os, kv_sep, param_sep, final_delim, site, args...);
+  }
+};
+
+}  // namespace internal
+
+/**
+ * @brief Deferred formatting of some args, which are only referenced until
+ * the object is written to an ostream or converted to string, so nothing is
+ * formatted if it is never used, e.g. discarded by a logger's level filter.
+ * Since the args are referenced, use it before they are destroyed, generally
+ * within the same full expression.
+ * @tparam PrinterT How to print the args to a `basic_ostream`.
+ */
+template <typename PrinterT, typename... Args>
+class lazy_wrapper {
+public:
+  explicit lazy_wrapper(const PrinterT& printer, const Args&... args)
+      : printer_(printer), args_(args...) {}
+
+  /// Print the args to a `basic_ostream`.
+  template <typename OstreamT>
+  OstreamT& write_to(OstreamT& os) const {
+    write_to(os,
+             typename internal::make_index_sequence<sizeof...(Args)>::type());
+    return os;
+  }
+
+  /// Convert the args into string with the constant default preferences.
+  template <typename StringT = std::string>
+  StringT str() const {
+    using oss_t = basic_ostringstream<basic_string_builder<StringT>,
+                                      const default_preferences<StringT>>;
+    internal::scoped_ostringstream<oss_t> scoped;
+    write_to(scoped.get());
+    return scoped.result();
+  }
+
+private:
+  template <typename OstreamT, size_t... Is>
+  void write_to(OstreamT& os, internal::index_sequence<Is...>) const {
+    printer_(os, std::get<Is>(args_)...);
+  }
+
+  PrinterT                   printer_;
+  std::tuple<const Args&...> args_;
+};
+
+/// Reference all args and format them by tostr semantics only when used.
+template <typename... Args>
+lazy_wrapper<internal::lazy_print, Args...> lazy(const Args&... args) {
+  return lazy_wrapper<internal::lazy_print, Args...>(internal::lazy_print(),
+                                                     args...);
+}
+
+template <typename KvSepT,
+          typename ParamSepT,
+          typename FinalDelimT,
+          typename NameLineGetterT,
+          typename... Args>
+lazy_wrapper<
+    internal::lazy_watch<KvSepT, ParamSepT, FinalDelimT, NameLineGetterT>,
+    Args...>
+lazy_watch(const KvSepT&                                     kv_sep,
+           const ParamSepT&                                  param_sep,
+           const FinalDelimT&                                final_delim,
+           const internal::macro_call_site<NameLineGetterT>& site,
+           const Args&... args) {
+  using printer_type =
+      internal::lazy_watch<KvSepT, ParamSepT, FinalDelimT, NameLineGetterT>;
+  return lazy_wrapper<printer_type, Args...>(
+      printer_type{kv_sep, param_sep, final_delim, site}, args...);
+}
+
+template <typename OstreamBaseT,
+          typename PreferencesT,
+          typename PrinterT,
+          typename... Args>
+basic_ostream<OstreamBaseT, PreferencesT>& operator<<(
+    basic_ostream<OstreamBaseT, PreferencesT>& os,
+    const lazy_wrapper<PrinterT, Args...>&     l) {
+  internal::output_scope<basic_ostream<OstreamBaseT, PreferencesT>> scope(os);
+  return l.write_to(os);
+}
+
+// For a std::basic_ostream, print by the constant default preferences with
+// its format state: flags, precision, width, fill and locale.
+template <typename CharT, typename TraitsT, typename PrinterT, typename... Args>
+std::basic_ostream<CharT, TraitsT>& operator<<(
+    std::basic_ostream<CharT, TraitsT>&    os,
+    const lazy_wrapper<PrinterT, Args...>& l) {
+  using os_t = basic_ostream_with_const_default_preferences<
+      std::basic_ostream<CharT, TraitsT>,
+      false>;
+  os_t tmp(placeholder::with_preferences_ptr{},
+           os_t::preferences_type::const_ins_ptr(),
+           os.rdbuf());
+  tmp.copyfmt(os);
+  tmp.tie(nullptr);
+  os.width(0);
+  l.write_to(tmp);
+  if (!tmp) os.setstate(tmp.rdstate());
+  return os;
+}
+
+// ==================== cursor ====================
+
+namespace internal {
+
+/**
+ * @brief Output of a format cursor: the caller's buffer of one `next` call,
+ * and the piece which did not fit into it, written first by the next call.
+ * Leaves of the value are formatted into the pending piece by a stream.
+ */
+template <typename PreferencesT>
+class cursor_context {
+public:
+  using preferences_type = PreferencesT;
+  using string_type      = typename preferences_type::string_type;
+  using char_type        = typename preferences_type::char_type;
+  using format_type      = typename preferences_type::format_type;
+  using traits_type      = typename string_type::traits_type;
+  using ostream_type     = basic_ostream<basic_string_builder<string_type>,
+                                     const preferences_type>;
+
+  explicit cursor_context(const preferences_type* p)
+      : os_(placeholder::with_preferences_ptr{}, p),
+        out_(nullptr),
+        left_(0),
+        pos_(0) {}
+
+  const preferences_type& preferences() const {
+    return os_.const_preferences();
+  }
+  ostream_type& stream() { return os_; }
+
+  void set_output(char_type* out, size_t n) {
+    out_  = out;
+    left_ = n;
+  }
+
+  /// Room left in the caller's buffer.
+  size_t left() const { return left_; }
+
+  /// Write the pending piece, return whether all of it is written.
+  bool drain() {
+    size_t n = os_.size() - pos_;
+    if (n > left_) n = left_;
+    traits_type::copy(out_, os_.data() + pos_, n);
+    out_ += n;
+    left_ -= n;
+    pos_ += n;
+    return pos_ == os_.size();
+  }
+
+  /// Write s, the rest which does not fit is pending. Return whether all of
+  /// it is written. Only called when nothing is pending.
+  template <typename StringT>
+  bool put(const StringT& s) {
+    size_t n = s.size() < left_ ? s.size() : left_;
+    traits_type::copy(out_, s.data(), n);
+    out_ += n;
+    left_ -= n;
+    if (n == s.size()) return true;
+    clear_pending();
+    os_.write(s.data() + n, s.size() - n);
+    return false;
+  }
+
+  /// Format v by operator<< and write it as `put`.
+  template <typename T>
+  bool format(const T& v) {
+    clear_pending();
+    os_ << v;
+    return drain();
+  }
+
+  void clear_pending() {
+    os_.clear_buf();
+    pos_ = 0;
+  }
+
+private:
+  ostream_type os_;
+  char_type*   out_;
+  size_t       left_;
+  size_t       pos_;
+};
+
+// Nodes are resumable writers of one value, a tree of them mirrors the type of
+// the formatted value. `fill(ctx, v)` writes v from where the last call
+// stopped, and returns true once all of v is written. `reset()` makes the
+// node write a new value. The value is passed to each call rather than kept,
+// since items of e.g. std::vector<bool> are temporaries.
+
+// Anything not decomposed is formatted at once by operator<<.
+template <typename ContextT, typename T, typename = void>
+class cursor_node {
+public:
+  explicit cursor_node(ContextT&) : started_(false) {}
+
+  void reset() { started_ = false; }
+
+  bool fill(ContextT& ctx, const T& v) {
+    if (started_) return true;
+    started_ = true;
+    return ctx.format(v);
+  }
+
+private:
+  bool started_;
+};
+
+template <typename ContextT, typename T>
+using cursor_node_by_type =
+    cursor_node<ContextT, typename std::remove_cv<T>::type>;
+
+// Containers go by their own operator<< at once when output limits,
+// summaries or parallel output are set, as format plans do.
+template <typename ContextT, typename ContainerT, typename ChildT>
+class items_cursor_node {
+  using format_type = typename ContextT::format_type;
+  using iterator    = typename ContainerT::const_iterator;
+
+public:
+  items_cursor_node(ContextT& ctx, const format_type& f, ChildT child)
+      : f_(&f),
+        planned_(plan_applicable(ctx.stream())),
+        child_(std::move(child)),
+        phase_(0),
+        index_(0),
+        in_item_(false) {}
+
+  void reset() { phase_ = 0; }
+
+  bool fill(ContextT& ctx, const ContainerT& c) {
+    switch (phase_) {
+      case 0:
+        if (!planned_) {
+          phase_ = 2;
+          return ctx.format(c);
+        }
+        it_      = c.begin();
+        index_   = 0;
+        in_item_ = false;
+        phase_   = 1;
+        if (!ctx.put(f_->lb)) return false;
+        // fall through
+      case 1:
+        for (; it_ != c.end(); ++it_) {
+          if (!in_item_) {
+            in_item_ = true;
+            child_.reset();
+            if (index_++ != 0 && !ctx.put(f_->sep)) return false;
+          }
+          if (!child_.fill(ctx, *it_)) return false;
+          in_item_ = false;
+        }
+        phase_ = 2;
+        if (!ctx.put(f_->rb)) return false;
+        // fall through
+      default:
+        return true;
+    }
+  }
+
+private:
+  const format_type* f_;
+  bool               planned_;
+  ChildT             child_;
+  int                phase_;
+  iterator           it_;
+  size_t             index_;
+  bool               in_item_;
+};
+
+// Pairs and key-value items of maps, by the given format.
+template <typename ContextT, typename FirstT, typename SecondT>
+class pair_cursor_node {
+  using format_type = typename ContextT::format_type;
+
+public:
+  pair_cursor_node(ContextT& ctx, const format_type& f)
+      : f_(&f), first_(ctx), second_(ctx), phase_(0) {}
+
+  void reset() { phase_ = 0; }
+
+  template <typename PairT>
+  bool fill(ContextT& ctx, const PairT& p) {
+    switch (phase_) {
+      case 0:
+        first_.reset();
+        second_.reset();
+        phase_ = 1;
+        if (!ctx.put(f_->lb)) return false;
+        // fall through
+      case 1:
+        if (!first_.fill(ctx, p.first)) return false;
+        phase_ = 2;
+        if (!ctx.put(f_->sep)) return false;
+        // fall through
+      case 2:
+        if (!second_.fill(ctx, p.second)) return false;
+        phase_ = 3;
+        if (!ctx.put(f_->rb)) return false;
+        // fall through
+      default:
+        return true;
+    }
+  }
+
+private:
+  const format_type*                      f_;
+  cursor_node_by_type<ContextT, FirstT>  first_;
+  cursor_node_by_type<ContextT, SecondT> second_;
+  int                                     phase_;
+};
+
+template <typename ContextT, typename ContainerT>
+class sequence_cursor_node
+    : public items_cursor_node<
+          ContextT,
+          ContainerT,
+          cursor_node_by_type<ContextT, typename ContainerT::value_type>> {
+  using child_type =
+      cursor_node_by_type<ContextT, typename ContainerT::value_type>;
+
+public:
+  explicit sequence_cursor_node(ContextT& ctx)
+      : items_cursor_node<ContextT, ContainerT, child_type>(
+            ctx,
+            format_of(ctx.preferences(),
+                      static_cast<const ContainerT*>(nullptr)),
+            child_type(ctx)) {}
+};
+
+template <typename ContextT, typename ContainerT>
+class map_cursor_node
+    : public items_cursor_node<
+          ContextT,
+          ContainerT,
+          pair_cursor_node<ContextT,
+                           typename ContainerT::key_type,
+                           typename ContainerT::mapped_type>> {
+  using child_type = pair_cursor_node<ContextT,
+                                      typename ContainerT::key_type,
+                                      typename ContainerT::mapped_type>;
+
+public:
+  explicit map_cursor_node(ContextT& ctx)
+      : items_cursor_node<ContextT, ContainerT, child_type>(
+            ctx,
+            format_of(ctx.preferences(),
+                      static_cast<const ContainerT*>(nullptr)),
+            child_type(ctx,
+                       kv_format_of(ctx.preferences(),
+                                    static_cast<const ContainerT*>(nullptr)))) {
+  }
+};
+
+#define MYOSTREAM_DEFINE_CURSOR_NODE(container, node)            \
+  template <typename ContextT, typename... Args>                 \
+  class cursor_node<ContextT, std::container<Args...>>           \
+      : public node<ContextT, std::container<Args...>> {         \
+  public:                                                        \
+    explicit cursor_node(ContextT& ctx)                          \
+        : node<ContextT, std::container<Args...>>(ctx) {}        \
+  };
+
+MYOSTREAM_DEFINE_CURSOR_NODE(deque, sequence_cursor_node)
+MYOSTREAM_DEFINE_CURSOR_NODE(forward_list, sequence_cursor_node)
+MYOSTREAM_DEFINE_CURSOR_NODE(list, sequence_cursor_node)
+MYOSTREAM_DEFINE_CURSOR_NODE(vector, sequence_cursor_node)
+MYOSTREAM_DEFINE_CURSOR_NODE(set, sequence_cursor_node)
+MYOSTREAM_DEFINE_CURSOR_NODE(multiset, sequence_cursor_node)
+MYOSTREAM_DEFINE_CURSOR_NODE(unordered_set, sequence_cursor_node)
+MYOSTREAM_DEFINE_CURSOR_NODE(unordered_multiset, sequence_cursor_node)
+MYOSTREAM_DEFINE_CURSOR_NODE(map, map_cursor_node)
+MYOSTREAM_DEFINE_CURSOR_NODE(multimap, map_cursor_node)
+MYOSTREAM_DEFINE_CURSOR_NODE(unordered_map, map_cursor_node)
+MYOSTREAM_DEFINE_CURSOR_NODE(unordered_multimap, map_cursor_node)
+
+#undef MYOSTREAM_DEFINE_CURSOR_NODE
+
+template <typename ContextT, typename T, size_t N>
+class cursor_node<ContextT, std::array<T, N>>
+    : public sequence_cursor_node<ContextT, std::array<T, N>> {
+public:
+  explicit cursor_node(ContextT& ctx)
+      : sequence_cursor_node<ContextT, std::array<T, N>>(ctx) {}
+};
+
+template <typename ContextT, typename FirstT, typename SecondT>
+class cursor_node<ContextT, std::pair<FirstT, SecondT>>
+    : public pair_cursor_node<ContextT, FirstT, SecondT> {
+public:
+  explicit cursor_node(ContextT& ctx)
+      : pair_cursor_node<ContextT, FirstT, SecondT>(
+            ctx, ctx.preferences().pair_fmt) {}
+};
+
+// Phase 0 writes the left border, phase I + 1 the I-th field, and phase
+// N + 1 the right border.
+template <typename ContextT, typename... Args>
+class cursor_node<ContextT, std::tuple<Args...>> {
+  using format_type   = typename ContextT::format_type;
+  using tuple_type    = std::tuple<Args...>;
+  using children_type = std::tuple<cursor_node_by_type<ContextT, Args>...>;
+  using indexes_type  = typename make_index_sequence<sizeof...(Args)>::type;
+
+  static constexpr size_t N = sizeof...(Args);
+
+public:
+  explicit cursor_node(ContextT& ctx)
+      : f_(&ctx.preferences().tuple_fmt),
+        children_(cursor_node_by_type<ContextT, Args>(ctx)...),
+        phase_(0) {}
+
+  void reset() { phase_ = 0; }
+
+  bool fill(ContextT& ctx, const tuple_type& t) {
+    if (phase_ == 0) {
+      reset_children(indexes_type());
+      phase_ = 1;
+      if (!ctx.put(f_->lb)) return false;
+    }
+    if (!fill_fields(ctx, t, std::integral_constant<size_t, 0>())) {
+      return false;
+    }
+    if (phase_ == N + 1) {
+      phase_ = N + 2;
+      if (!ctx.put(f_->rb)) return false;
+    }
+    return true;
+  }
+
+private:
+  template <size_t... Is>
+  void reset_children(index_sequence<Is...>) {
+    int expand[] = {0, ((void)std::get<Is>(children_).reset(), 0)...};
+    (void)expand;
+  }
+
+  template <size_t I>
+  bool fill_fields(ContextT&         ctx,
+                   const tuple_type& t,
+                   std::integral_constant<size_t, I>) {
+    if (phase_ == I + 1) {
+      if (!std::get<I>(children_).fill(ctx, std::get<I>(t))) return false;
+      phase_ = I + 2;
+      if (I + 1 < N && !ctx.put(f_->sep)) return false;
+    }
+    return fill_fields(ctx, t, std::integral_constant<size_t, I + 1>());
+  }
+
+  bool fill_fields(ContextT&,
+                   const tuple_type&,
+                   std::integral_constant<size_t, N>) {
+    return true;
+  }
+
+  const format_type* f_;
+  children_type      children_;
+  size_t             phase_;
+};
+
+}  // namespace internal
+
+/**
+ * @brief Resumable formatter of a value, for writers which can not block,
+ * e.g. to a non-blocking socket. Each `next(buf, n)` writes at most n more
+ * characters of the result of `tostr(v)` and returns, keeping its position in
+ * the nested containers, pairs and tuples, so a large value is written in
+ * pieces without formatting it all first. Only one leaf value, border or
+ * separator is buffered at a time.
+ *
+ * The value is referenced, it must outlive the cursor and not be modified
+ * while in use. Containers are written at once when output limits, summaries
+ * or parallel output are set in the preferences.
+ * @tparam T Type of the value.
+ * @tparam PreferencesT A `default_preferences`.
+ */
+template <typename T, typename PreferencesT = default_preferences<std::string>>
+class basic_format_cursor {
+  using context_type = internal::cursor_context<PreferencesT>;
+  using node_type    = internal::cursor_node_by_type<context_type, T>;
+
+public:
+  using preferences_type = PreferencesT;
+  using char_type        = typename preferences_type::char_type;
+
+  /// The preferences must outlive the cursor, the tostr family's on default.
+  explicit basic_format_cursor(
+      const T&                v,
+      const preferences_type* p = preferences_type::const_ins_ptr())
+      : context_(new context_type(p)),
+        root_(*context_),
+        value_(&v),
+        finished_(false) {}
+
+  /// Write at most n characters to buf, return the number written, which is
+  /// less than n only when all is written.
+  size_t next(char_type* buf, size_t n) {
+    context_->set_output(buf, n);
+    if (context_->drain() && !finished_) {
+      finished_ = root_.fill(*context_, *value_);
+    }
+    return n - context_->left();
+  }
+
+  /// Whether all characters are written.
+  bool done() const { return finished_; }
+
+  /// Start over from the first character.
+  void reset() {
+    context_->clear_pending();
+    root_.reset();
+    finished_ = false;
+  }
+
+private:
+  std::unique_ptr<context_type> context_;
+  node_type                     root_;
+  const T*                      value_;
+  bool                          finished_;
+};
+
+/// Cursor writing the result of `tostr(v)` in pieces.
+template <typename T>
+basic_format_cursor<T> format_cursor(const T& v) {
+  return basic_format_cursor<T>(v);
+}
+
+/// Cursor writing the result of `towstr(v)` in pieces.
+template <typename T>
+basic_format_cursor<T, default_preferences<std::wstring>> wformat_cursor(
+    const T& v) {
+  return basic_format_cursor<T, default_preferences<std::wstring>>(v);
+}
+
+// ==================== async ====================
+
+namespace internal {
+
+// A record queued in a `basic_async_sink`.
+template <typename OstreamT>
+struct async_record {
+  virtual ~async_record() {}
+  virtual void write_to(OstreamT& os) = 0;
+  // Called by the consumer after `write_to`.
+  virtual void release() { delete this; }
+};
+
+// Type to store an arg in a record. Pointers to characters may point to a
+// temporary buffer, so they are stored as strings.
+template <typename T, typename StringT>
+struct async_value {
+  using decayed_type = typename std::decay<T>::type;
+  using char_type    = typename StringT::value_type;
+  using type         = typename std::conditional<
+      std::is_same<decayed_type, const char_type*>::value ||
+          std::is_same<decayed_type, char_type*>::value,
+      StringT,
+      decayed_type>::type;
+};
+
+// Owns copies of args, written by tostr semantics.
+template <typename OstreamT, typename... Args>
+struct async_args_record : public async_record<OstreamT> {
+  template <typename... Ts>
+  explicit async_args_record(Ts&&... ts) : args(std::forward<Ts>(ts)...) {}
+
+  void write_to(OstreamT& os) override {
+    write_to(os, typename make_index_sequence<sizeof...(Args)>::type());
+  }
+
+  template <size_t... Is>
+  void write_to(OstreamT& os, index_sequence<Is...>) {
+    lazy_print()(os, std::get<Is>(args)...);
+  }
+
+  std::tuple<Args...> args;
+};
+
+// Flushes the stream, then wakes up the waiting producer. Owned by the
+// producer.
+template <typename OstreamT>
+struct async_flush_record : public async_record<OstreamT> {
+  void write_to(OstreamT& os) override { os.flush(); }
+
+  void release() override {
+    std::lock_guard<std::mutex> lock(mu);
+    done = true;
+    cv.notify_one();
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mu);
+    while (!done) cv.wait_for(lock, std::chrono::milliseconds(100));
+  }
+
+  std::mutex              mu;
+  std::condition_variable cv;
+  bool                    done = false;
+};
+
+// Bounded lock-free queue of pointers for multiple producers and a single
+// consumer. Each slot has a sequence number telling whether it is free for the
+// producer of a position or published for the consumer.
+template <typename T>
+class mpsc_ring {
+public:
+  explicit mpsc_ring(size_t capacity)
+      : mask_(ceil_pow2(capacity) - 1),
+        slots_(new slot[mask_ + 1]),
+        enqueue_pos_(0),
+        dequeue_pos_(0) {
+    for (size_t i = 0; i <= mask_; ++i) {
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Return false if full.
+  bool try_push(T* v) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      slot&     s   = slots_[pos & mask_];
+      size_t    seq = s.seq.load(std::memory_order_acquire);
+      ptrdiff_t dif = static_cast<ptrdiff_t>(seq - pos);
+      if (dif == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1)) {
+          s.value = v;
+          s.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Return nullptr if empty or the next value is not published yet. Only
+  // called by the consumer.
+  T* try_pop() {
+    slot& s = slots_[dequeue_pos_ & mask_];
+    if (s.seq.load(std::memory_order_acquire) != dequeue_pos_ + 1) {
+      return nullptr;
+    }
+    T* v = s.value;
+    s.seq.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+    ++dequeue_pos_;
+    return v;
+  }
+
+  // Number of positions claimed by producers, including the unpublished ones.
+  size_t pushed() const { return enqueue_pos_.load(); }
+
+  // Number of values popped. Only called by the consumer.
+  size_t popped() const { return dequeue_pos_; }
+
+private:
+  struct slot {
+    std::atomic<size_t> seq;
+    T*                  value;
+  };
+
+  static size_t ceil_pow2(size_t n) {
+    size_t ret = 2;
+    while (ret < n) ret <<= 1;
+    return ret;
+  }
+
+  const size_t            mask_;
+  std::unique_ptr<slot[]> slots_;
+  // Keep producers and the consumer on different cache lines.
+  char                    pad0_[64];
+  std::atomic<size_t>     enqueue_pos_;
+  char                    pad1_[64];
+  size_t                  dequeue_pos_;
+};
+
+}  // namespace internal
+
+/**
+ * Records of each producer thread are written in the order they were queued.
+ * Records of different threads are interleaved in the order they reached the
+ * ring buffer.
+ */
+template <typename OstreamBaseT, typename PreferencesT>
+class basic_async_sink {
+public:
+  using ostream_type   = basic_ostream<OstreamBaseT, PreferencesT>;
+  using char_type      = typename OstreamBaseT::char_type;
+  using traits_type    = typename OstreamBaseT::traits_type;
+  using string_type    = typename ostream_type::string_type;
+  using streambuf_type = std::basic_streambuf<char_type, traits_type>;
+
+  explicit basic_async_sink(streambuf_type*      sb,
+                            const async_options& options = async_options())
+      : os_(sb),
+        options_(options),
+        ring_(options.capacity),
+        overflow_size_(0),
+        dropped_(0),
+        sleeping_(false),
+        closed_(false),
+        writers_(0),
+        stopping_(false),
+        consumer_(&basic_async_sink::consume, this) {}
+
+  basic_async_sink(const basic_async_sink&)            = delete;
+  basic_async_sink& operator=(const basic_async_sink&) = delete;
+
+  ~basic_async_sink() {
+    stop();
+    // Records left by writes racing the destruction, which are dropped.
+    while (record_type* r = ring_.try_pop()) {
+      r->release();
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+    for (record_type* r : overflow_) {
+      r->release();
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * @brief Queue args to be written by tostr semantics. Args are copied or
+   * moved, pointers to characters are copied as strings.
+   * @return false if the record is dropped because the ring buffer is full or
+   * the sink is closed.
+   */
+  template <typename... Args>
+  bool write(Args&&... args) {
+    writer_scope scope(*this);
+    if (!scope.open()) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    using record_t = internal::async_args_record<
+        ostream_type,
+        typename internal::async_value<Args, string_type>::type...>;
+    record_t* r = new record_t(std::forward<Args>(args)...);
+    if (push(r, options_.overflow)) return true;
+    delete r;
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
 
-template <typename... Args>
-std::wstring ptowstr(const Args&... args) {
-  return basic_ptostr<std::wostringstream, false>(args...);
-}
+  /**
+   * @brief Wait until records queued by this thread before are written, then
+   * flush the stream buffer. Return at once if the sink is closed.
+   * @throw The first exception thrown by writing a record since the last one
+   * rethrown by `flush` or `close`.
+   */
+  void flush() {
+    {
+      writer_scope scope(*this);
+      if (scope.open()) {
+        internal::async_flush_record<ostream_type> r;
+        push(&r,
+             options_.overflow == async_overflow::grow ? async_overflow::grow
+                                                       : async_overflow::block);
+        r.wait();
+      }
+    }
+    rethrow_error();
+  }
 
-template <typename... Args>
-std::string tostr_dense(const Args&... args) {
-  return basic_tostr<std::ostringstream, true>(args...);
-}
+  /**
+   * @brief Write all queued records, flush and stop the consumer thread.
+   * Records written after it are dropped.
+   * @throw The first exception thrown by writing a record since the last one
+   * rethrown by `flush` or `close`.
+   */
+  void close() {
+    stop();
+    rethrow_error();
+  }
 
-template <typename... Args>
-std::wstring towstr_dense(const Args&... args) {
-  return basic_tostr<std::wostringstream, true>(args...);
-}
+  /// Number of dropped records.
+  size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
 
-template <typename... Args>
-std::string ptostr_dense(const Args&... args) {
-  return basic_ptostr<std::ostringstream, true>(args...);
-}
+  /// The stream used by the consumer thread. Only configure it, e.g. its
+  /// preferences, before the first write.
+  ostream_type& stream() { return os_; }
 
-template <typename... Args>
-std::wstring ptowstr_dense(const Args&... args) {
-  return basic_ptostr<std::wostringstream, true>(args...);
-}
+private:
+  using record_type = internal::async_record<ostream_type>;
+
+  // Registers a producer while it pushes, so `stop` lets the consumer exit
+  // only after every record which passed the closed check is queued.
+  class writer_scope {
+  public:
+    explicit writer_scope(basic_async_sink& sink) : sink_(sink) {
+      sink_.writers_.fetch_add(1);
+      open_ = !sink_.closed_.load();
+    }
+    ~writer_scope() { sink_.writers_.fetch_sub(1); }
 
-// ==================== watch ====================
+    bool open() const { return open_; }
 
-template <typename ResultStringT>
-inline std::vector<ResultStringT> split_macro_param_names(const std::string& s,
-                                                          size_t expect_size) {
-  using str_t = ResultStringT;
-  using oss_t = std_basic_ostringstream_by_string<str_t>;
-  oss_t              oss;
-  std::vector<str_t> ret;
-  size_t             n             = s.size();
-  bool               maybe_less_op = false;
+  private:
+    basic_async_sink& sink_;
+    bool              open_;
+  };
 
-  // for ()/{}/[], not for <>
-  // start with s[i] == pair[0]
-  auto find_matched_bracket = [&](size_t i, const char* pair) {
-    MYOSTREAM_ASSERT(i < n && pair && s[i] == pair[0]);
-    for (int sum = 0; i < n; ++i) {
-      if (s[i] == pair[0])
-        --sum;
-      else if (s[i] == pair[1])
-        ++sum;
-      if (sum == 0) break;
+  void stop() {
+    if (closed_.exchange(true)) return;
+    while (writers_.load() != 0) std::this_thread::yield();
+    stopping_.store(true);
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      cv_.notify_one();
     }
-    return i;
-  };
+    consumer_.join();
+  }
 
-  auto must_not_left_angle_bracket = [&](const size_t i) {
-    MYOSTREAM_ASSERT(i < n && s[i] == '<');
-    // less or equal "<="
-    if (i + 1 < n && s[i + 1] == '=') return true;
-    // left shift "<<"
-    if (i + 1 < n && s[i + 1] == '<' || i >= 1 && s[i - 1] == '<') return true;
-    return false;
-  };
+  void rethrow_error() {
+    std::exception_ptr e;
+    {
+      std::lock_guard<std::mutex> lock(error_mu_);
+      std::swap(e, error_);
+    }
+    if (e) std::rethrow_exception(e);
+  }
 
-  auto must_not_right_angle_bracket = [&](const size_t i) {
-    MYOSTREAM_ASSERT(i < n && s[i] == '>');
-    // greater or equal ">="
-    if (i + 1 < n && s[i + 1] == '=') return true;
-    return false;
-  };
+  // Keep the first exception, so it does not escape the consumer thread.
+  void catch_error() {
+    std::lock_guard<std::mutex> lock(error_mu_);
+    if (!error_) error_ = std::current_exception();
+  }
 
-  // start with s[i] == '<'
-  auto find_matched_angle_bracket = [&](size_t i) {
-    MYOSTREAM_ASSERT(i < n && s[i] == '<');
-    for (int sum = 0;; ++i) {
-      if (s[i] == '<') {
-        if (!must_not_left_angle_bracket(i)) --sum;
-      } else if (s[i] == '>') {
-        if (!must_not_right_angle_bracket(i)) ++sum;
-      } else if (s[i] == '(') {
-        i = find_matched_bracket(i, "()");
-      } else if (s[i] == '{') {
-        i = find_matched_bracket(i, "{}");
-      } else if (s[i] == '[') {
-        i = find_matched_bracket(i, "[]");
+  bool push(record_type* r, async_overflow overflow) {
+    // While the overflow list is not empty, new records go after it to keep
+    // the order of each thread.
+    if (overflow_size_.load() == 0 && ring_.try_push(r)) {
+      wake();
+      return true;
+    }
+    switch (overflow) {
+      case async_overflow::block:
+        while (!ring_.try_push(r)) {
+          wake();
+          std::this_thread::yield();
+        }
+        break;
+      case async_overflow::drop:
+        return false;
+      case async_overflow::grow: {
+        std::lock_guard<std::mutex> lock(overflow_mu_);
+        overflow_.push_back(r);
+        overflow_size_.fetch_add(1);
+        break;
       }
-      if (sum == 0 || i >= n) break;
     }
-    return i;
-  };
+    wake();
+    return true;
+  }
 
-  for (size_t i = 0; i < n; ++i) {
-    bool found_bracket = false;
-    for (const auto& p : {"()", "{}", "[]"}) {
-      if (s[i] != p[0]) continue;
-      found_bracket = true;
-      for (int sum = 0; i < n; ++i) {
-        oss << s[i];
-        if (s[i] == p[0])
-          --sum;
-        else if (s[i] == p[1])
-          ++sum;
-        if (sum == 0) break;
-      }
+  void wake() {
+    if (sleeping_.load()) {
+      std::lock_guard<std::mutex> lock(mu_);
+      cv_.notify_one();
     }
-    if (found_bracket) continue;
+  }
 
-    if (s[i] == '<') {
-      if (must_not_left_angle_bracket(i)) {
-        oss << s[i++];
-      } else {
-        maybe_less_op = true;
-        size_t j      = find_matched_angle_bracket(i);
-        if (j < n) {
-          while (i < j) { oss << s[i++]; }
+  bool has_pending() const {
+    return ring_.pushed() != ring_.popped() || overflow_size_.load() != 0;
+  }
+
+  void write(record_type* r) {
+    try {
+      r->write_to(os_);
+    } catch (...) {
+      catch_error();
+    }
+    r->release();
+  }
+
+  // Write records ready now, return whether any.
+  bool drain() {
+    bool any = false;
+    while (record_type* r = ring_.try_pop()) {
+      write(r);
+      any = true;
+    }
+    if (overflow_size_.load() != 0) {
+      std::deque<record_type*> batch;
+      size_t                   ring_end;
+      {
+        std::lock_guard<std::mutex> lock(overflow_mu_);
+        ring_end = ring_.pushed();
+        batch.swap(overflow_);
+        overflow_size_.store(0);
+      }
+      // Records in the ring before the batch, maybe not published yet.
+      while (ring_.popped() < ring_end) {
+        if (record_type* r = ring_.try_pop()) {
+          write(r);
+        } else {
+          std::this_thread::yield();
         }
       }
+      for (record_type* r : batch) write(r);
+      any = true;
     }
+    return any;
+  }
 
-    if (s[i] == ',') {
-      auto v = oss.str();
-      while (!v.empty() && v.back() == ' ') v.pop_back();
-      ret.push_back(std::move(v));
-      oss.str(str_t{});
-      while (i + 1 < n && s[i + 1] == ' ') ++i;
-    } else {
-      oss << s[i];
+  void consume() {
+    while (true) {
+      if (drain()) continue;
+      std::unique_lock<std::mutex> lock(mu_);
+      sleeping_.store(true);
+      // Read before checking pending records, all pushes are done once set.
+      const bool stopping = stopping_.load();
+      if (has_pending()) {
+        sleeping_.store(false);
+        continue;
+      }
+      if (stopping) break;
+      cv_.wait_for(lock, std::chrono::milliseconds(100));
+      sleeping_.store(false);
+    }
+    try {
+      os_.flush();
+    } catch (...) {
+      catch_error();
     }
   }
-  ret.push_back(oss.str());
-  if (ret.size() != expect_size && maybe_less_op) {
-    throw std::runtime_error(
-        "try putting angle brackets(maybe less operator) in parenthesis");
+
+  ostream_type                     os_;
+  async_options                    options_;
+  internal::mpsc_ring<record_type> ring_;
+  std::mutex                       overflow_mu_;
+  std::deque<record_type*>         overflow_;
+  std::atomic<size_t>              overflow_size_;
+  std::atomic<size_t>              dropped_;
+  std::mutex                       mu_;
+  std::condition_variable          cv_;
+  std::atomic<bool>                sleeping_;
+  std::atomic<bool>                closed_;
+  // Number of producers between the closed check and the end of their push.
+  std::atomic<size_t>              writers_;
+  std::atomic<bool>                stopping_;
+  std::mutex                       error_mu_;
+  std::exception_ptr               error_;
+  std::thread                      consumer_;
+};
+
+// ==================== line ====================
+
+template <typename OstreamBaseT, typename PreferencesT>
+class basic_line_ostream {
+public:
+  using preferences_type = PreferencesT;
+  using char_type        = typename OstreamBaseT::char_type;
+  using traits_type      = typename OstreamBaseT::traits_type;
+  using string_type      = typename preferences_type::string_type;
+  using streambuf_type   = std::basic_streambuf<char_type, traits_type>;
+  using std_ostream_type = std::basic_ostream<char_type, traits_type>;
+  using line_stream_type =
+      basic_ostringstream<basic_string_builder<string_type>,
+                          const preferences_type>;
+
+  /**
+   * @brief One line in progress, formatted into the thread local buffer and
+   * written to the stream buffer on destruction. Generally used as a
+   * temporary, e.g. `out.line() << a << b << '\n'` or
+   * `MYOSTREAM_WATCH(out.line(), " = ", "\n", "\n", a, b)`.
+   */
+  class line_writer {
+  public:
+    using char_type   = typename basic_line_ostream::char_type;
+    using traits_type = typename basic_line_ostream::traits_type;
+    using string_type = typename basic_line_ostream::string_type;
+
+    explicit line_writer(basic_line_ostream& owner) : owner_(&owner) {
+      stream().set_preferences_ptr(&owner.const_preferences());
+    }
+
+    line_writer(line_writer&& r)
+        : owner_(r.owner_), scoped_(std::move(r.scoped_)) {
+      r.owner_ = nullptr;
+    }
+
+    line_writer(const line_writer&)            = delete;
+    line_writer& operator=(const line_writer&) = delete;
+
+    ~line_writer() {
+      if (!owner_) return;
+      owner_->write(stream().data(), stream().size());
+      // The thread local stream is shared by all users of the same type.
+      stream().set_preferences_ptr(
+          line_stream_type::preferences_type::const_ins_ptr());
+    }
+
+    /// The stream to write the line with, e.g. by `print` or `println`.
+    line_stream_type& stream() { return scoped_.get(); }
+
+    template <typename T>
+    line_writer& operator<<(const T& v) {
+      stream() << v;
+      return *this;
+    }
+
+    // For manipulators like std::endl.
+    line_writer& operator<<(std_ostream_type& (*f)(std_ostream_type&)) {
+      f(stream());
+      return *this;
+    }
+
+  private:
+    basic_line_ostream*                              owner_;
+    internal::scoped_ostringstream<line_stream_type> scoped_;
+  };
+
+  explicit basic_line_ostream(streambuf_type* sb) : sb_(sb) {}
+
+  basic_line_ostream(const basic_line_ostream&)            = delete;
+  basic_line_ostream& operator=(const basic_line_ostream&) = delete;
+
+  /// Only modify it before the stream is shared by threads.
+  preferences_type&       preferences() { return preferences_; }
+  const preferences_type& const_preferences() const { return preferences_; }
+
+  /// Start a line, which is written when the returned object is destroyed.
+  line_writer line() { return line_writer(*this); }
+
+  /// Write args as one line by `basic_ostream::print` semantics, without
+  /// newline.
+  template <typename... Args>
+  basic_line_ostream& print(const Args&... args) {
+    line().stream().print(args...);
+    return *this;
   }
-  MYOSTREAM_ASSERT(ret.size() == expect_size);
-  return ret;
-}
 
-template <typename OstreamT,
-          typename KvSepT,
-          typename ParamSepT,
-          typename FinalDelimT,
-          typename StringVectorT,
-          typename FinalArgT>
-inline OstreamT&& watch_to_ostream_aux(OstreamT&&           oss,
-                                       const KvSepT&        kv_sep,
-                                       const ParamSepT&     param_sep,
-                                       const FinalDelimT&   final_delim,
-                                       const StringVectorT& var_names,
-                                       size_t               cur_idx,
-                                       const FinalArgT&     final_arg) {
-  MYOSTREAM_ASSERT(cur_idx == var_names.size() - 1);
-  oss << var_names[cur_idx];
-  oss << kv_sep;
-  oss << final_arg;
-  oss << final_delim;
-  return oss;
-}
+  /// Write args as one line by `basic_ostream::println` semantics.
+  template <typename... Args>
+  basic_line_ostream& println(const Args&... args) {
+    line().stream().println(args...);
+    return *this;
+  }
 
-template <typename OstreamT,
-          typename KvSepT,
-          typename ParamSepT,
-          typename FinalDelimT,
-          typename StringVectorT,
-          typename FirstArgT,
-          typename... Args>
-inline OstreamT&& watch_to_ostream_aux(OstreamT&&           oss,
-                                       const KvSepT&        kv_sep,
-                                       const ParamSepT&     param_sep,
-                                       const FinalDelimT&   final_delim,
-                                       const StringVectorT& var_names,
-                                       size_t               cur_idx,
-                                       const FirstArgT&     first_arg,
-                                       const Args&... other_args) {
-  MYOSTREAM_ASSERT(cur_idx < var_names.size());
-  oss << var_names[cur_idx];
-  oss << kv_sep;
-  oss << first_arg;
-  oss << param_sep;
-  watch_to_ostream_aux(oss,
-                       kv_sep,
-                       param_sep,
-                       final_delim,
-                       var_names,
-                       cur_idx + 1,
-                       other_args...);
-  return oss;
-}
+  /// Flush the stream buffer.
+  void flush() {
+    std::lock_guard<std::mutex> lock(mu_);
+    sb_->pubsync();
+  }
 
-template <typename OstreamT,
-          typename KvSepT,
-          typename ParamSepT,
-          typename FinalDelimT,
-          typename... Args>
-inline OstreamT&& watch_to_ostream(OstreamT&&         oss,
-                                   const KvSepT&      kv_sep,
-                                   const ParamSepT&   param_sep,
-                                   const FinalDelimT& final_delim,
-                                   const std::string& vars_name_line,
-                                   const Args&... args) {
-  auto names = split_macro_param_names<
-      string_type_by_ostream<typename std::decay<OstreamT>::type>>(
-      vars_name_line, sizeof...(Args));
-  if (names.empty()) return oss;
-  watch_to_ostream_aux(oss, kv_sep, param_sep, final_delim, names, 0, args...);
-  return oss;
-}
+private:
+  void write(const char_type* p, size_t n) {
+    if (n == 0) return;
+    std::lock_guard<std::mutex> lock(mu_);
+    sb_->sputn(p, static_cast<std::streamsize>(n));
+  }
 
-template <typename ResultStringT,
-          typename KvSepT,
-          typename ParamSepT,
-          typename FinalDelimT,
-          typename... Args>
-inline ResultStringT watch_to_string(const KvSepT&      kv_sep,
-                                     const ParamSepT&   param_sep,
-                                     const FinalDelimT& final_delim,
-                                     const std::string& vars_name_line,
-                                     const Args&... args) {
-  using string_type = ResultStringT;
-  using oss_t =
-      basic_ostringstream_by_string<string_type,
-                                    const default_preferences<string_type>>;
-  oss_t oss(placeholder::with_preferences_ptr{},
-            oss_t::preferences_type::const_ins_ptr());
-  watch_to_ostream(
-      oss, kv_sep, param_sep, final_delim, vars_name_line, args...);
-  oss.clear_preferences_ptr();
-  return oss.str();
-}
+  streambuf_type*  sb_;
+  preferences_type preferences_;
+  std::mutex       mu_;
+};
 
 }  // namespace myostream
 
+// The lambda makes a unique type per call site, so names of the watched
+// parameters are split only once per call site.
 #define MYOSTREAM_WATCH(out_stream, kv_sep, param_sep, final_delim, ...) \
   myostream::watch_to_ostream(                                           \
-      out_stream, kv_sep, param_sep, final_delim, #__VA_ARGS__, __VA_ARGS__)
+      out_stream,                                                        \
+      kv_sep,                                                            \
+      param_sep,                                                         \
+      final_delim,                                                       \
+      myostream::internal::make_macro_call_site(                         \
+          [] { return #__VA_ARGS__; }),                                  \
+      __VA_ARGS__)
 
 #define MYOSTREAM_WATCH_TO_STRING(                    \
     string_type, kv_sep, param_sep, final_delim, ...) \
   myostream::watch_to_string<string_type>(            \
-      kv_sep, param_sep, final_delim, #__VA_ARGS__, __VA_ARGS__)
+      kv_sep,                                         \
+      param_sep,                                      \
+      final_delim,                                    \
+      myostream::internal::make_macro_call_site(      \
+          [] { return #__VA_ARGS__; }),               \
+      __VA_ARGS__)
+
+// Like MYOSTREAM_WATCH, but returns a `lazy_wrapper` to be written to a stream
+// later, so neither the names nor the values are formatted if it is unused.
+#define MYOSTREAM_LAZY_WATCH(kv_sep, param_sep, final_delim, ...) \
+  myostream::lazy_watch(                                          \
+      kv_sep,                                                     \
+      param_sep,                                                  \
+      final_delim,                                                \
+      myostream::internal::make_macro_call_site(                  \
+          [] { return #__VA_ARGS__; }),                           \
+      __VA_ARGS__)
 
 #endif  // MYOSTREAM_H_
@@ -13,6 +13,13 @@
 // the License.
 // =============================================================================
 
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
 #include "main.h"
 
 using namespace myostream;
@@ -196,3 +203,1083 @@ TEST(Watch, Operator) {
                 std::string, " = ", ", ", "", std::array<int, 0 <= 1>{1}),
             "std::array<int, 0 <= 1>{1} = [1]");
 }
+
+TEST(StringBuilder, Basic) {
+  string_builder sb;
+  sb << "abc" << 123 << 'x';
+  EXPECT_EQ(sb.str(), "abc123x");
+  EXPECT_EQ(sb.size(), 7u);
+  EXPECT_EQ(sb.tellp(), 7);
+  EXPECT_EQ(sb.release(), "abc123x");
+  EXPECT_EQ(sb.size(), 0u);
+  EXPECT_EQ(sb.str(), "");
+
+  sb.str("old");
+  sb << std::string(1000, 'a');
+  EXPECT_EQ(sb.str(), "old" + std::string(1000, 'a'));
+  sb.clear_buf();
+  EXPECT_GE(sb.capacity(), 1003u);
+  sb << 1.5;
+  EXPECT_EQ(sb.str(), "1.5");
+
+  wstring_builder wsb;
+  wsb << L"w" << 1;
+  EXPECT_EQ(wsb.release(), L"w1");
+}
+
+TEST(StringBuilder, SameAsStdOstringstream) {
+  std::vector<std::map<int, std::string>> v(300, {{1, "a"}, {22, "bb"}});
+  myostream::ostringstream                                 oss;
+  myostream::basic_ostringstream<myostream::string_builder> obs;
+  oss << v;
+  obs << v;
+  EXPECT_EQ(oss.str(), obs.str());
+  EXPECT_EQ(tostr(v), oss.str());
+  EXPECT_EQ(obs.to_string_vector(1, v[0]),
+            (std::vector<std::string>{"1", "{1: a, 22: bb}"}));
+  EXPECT_EQ(obs.str(), oss.str());
+}
+
+namespace {
+struct nested_tostr_type {
+  int v;
+};
+std::ostream& operator<<(std::ostream& os, const nested_tostr_type& x) {
+  return os << tostr("nested", std::vector<int>{x.v});
+}
+struct hex_leaking_type {};
+std::ostream& operator<<(std::ostream& os, const hex_leaking_type&) {
+  return os << std::hex << std::setprecision(2) << std::setfill('*') << "h";
+}
+}  // namespace
+
+TEST(Tostr, ThreadLocalCacheReuse) {
+  EXPECT_EQ(tostr(nested_tostr_type{5}, 1), "nested[5]1");
+  EXPECT_EQ(ptostr(std::vector<nested_tostr_type>{{1}, {2}}),
+            "[nested[1], nested[2]]");
+
+  EXPECT_EQ(tostr(hex_leaking_type{}, 255), "hff");
+  EXPECT_EQ(tostr(255, 3.14159, std::setfill(' ')), "2553.14159");
+
+  std::string big = tostr(std::vector<int>(100000, 1));
+  EXPECT_EQ(big.size(), 300000u);
+  EXPECT_EQ(tostr(1, 2), "12");
+
+  std::vector<std::string> rs(8);
+  std::vector<std::thread> ts;
+  for (int i = 0; i < 8; ++i) {
+    ts.emplace_back([&rs, i] {
+      for (int j = 0; j < 1000; ++j) rs[i] = ptostr(i, std::set<int>{j, i});
+    });
+  }
+  for (auto& t : ts) t.join();
+  EXPECT_EQ(rs[3], "3, {3, 999}");
+}
+
+TEST(Watch, CachedNamesPerCallSite) {
+  std::vector<std::string> got;
+  for (int i = 0; i < 3; ++i) {
+    got.push_back(
+        MYOSTREAM_WATCH_TO_STRING(std::string, "=", ",", ";", i, i * 2));
+    got.push_back(
+        MYOSTREAM_WATCH_TO_STRING(std::string, "=", ",", ";", INT_MAX));
+  }
+  EXPECT_EQ(got,
+            (std::vector<std::string>{"i=0,i * 2=0;",
+                                      "INT_MAX=2147483647;",
+                                      "i=1,i * 2=2;",
+                                      "INT_MAX=2147483647;",
+                                      "i=2,i * 2=4;",
+                                      "INT_MAX=2147483647;"}));
+
+  myostream::wostringstream woss;
+  for (int i = 0; i < 2; ++i) MYOSTREAM_WATCH(woss, L"=", L" ", L";", i);
+  EXPECT_EQ(woss.str(), L"i=0;i=1;");
+
+  // Names are still split for direct calls.
+  EXPECT_EQ(watch_to_string<std::string>("=", ",", "", "a, b", 1, 2),
+            "a=1,b=2");
+}
+
+TEST(Tostr, IntegerKernel) {
+  std::vector<int64_t> vi{0,
+                          -1,
+                          9,
+                          10,
+                          99,
+                          100,
+                          -12345,
+                          INT32_MIN,
+                          INT32_MAX,
+                          INT64_MIN,
+                          INT64_MAX};
+  std::vector<uint64_t> vu{0, 1, 999999999, 1000000000, UINT64_MAX};
+  for (uint64_t p = 1; p && p <= UINT64_MAX / 10; p *= 10) {
+    vu.push_back(p - 1);
+    vu.push_back(p);
+  }
+  std::ostringstream expect;
+  expect << '[';
+  for (size_t i = 0; i < vu.size(); ++i) expect << (i ? ", " : "") << vu[i];
+  expect << ']';
+  EXPECT_EQ(tostr(vu), expect.str());
+  EXPECT_EQ(tostr(vi),
+            "[0, -1, 9, 10, 99, 100, -12345, -2147483648, 2147483647, "
+            "-9223372036854775808, 9223372036854775807]");
+  EXPECT_EQ(tostr(std::set<short>{-3, 7}, std::list<unsigned>{4294967295u}),
+            "{-3, 7}[4294967295]");
+  EXPECT_EQ(tostr(std::map<long, unsigned long long>{{-1, 2}}), "{-1: 2}");
+  EXPECT_EQ(tostr(std::vector<char>{'a', 'b'}, std::vector<bool>{true, false}),
+            "[a, b][1, 0]");
+  EXPECT_EQ(towstr(std::vector<int>{-10, 20}), L"[-10, 20]");
+
+  // Falls back to std::num_put if the stream state needs it.
+  myostream::ostringstream oss;
+  oss << std::hex << std::showbase;
+  oss << std::vector<int>{255, 16};
+  EXPECT_EQ(oss.str(), "[0xff, 0x10]");
+  oss.clear_buf();
+  oss << std::dec << std::noshowbase << std::showpos;
+  oss << std::set<int>{0, 1};
+  EXPECT_EQ(oss.str(), "{+0, +1}");
+
+  struct grouping : std::numpunct<char> {
+    std::string do_grouping() const override { return "\3"; }
+  };
+  myostream::ostringstream oss_grouping;
+  oss_grouping.imbue(std::locale(std::locale::classic(), new grouping));
+  oss_grouping << std::vector<int>{1234567};
+  EXPECT_EQ(oss_grouping.str(), "[1,234,567]");
+}
+
+TEST(FloatFormat, Shortest) {
+  myostream::ostringstream oss;
+  oss << std::vector<double>{0.1, 1.0 / 3, 2.5, 100, 1e16, 1e15, 1e-5};
+  EXPECT_EQ(oss.str(),
+            "[0.1, 0.333333, 2.5, 100, 1e+16, 1e+15, 1e-05]");
+
+  oss.clear_buf();
+  oss.preferences().float_output = float_format::shortest;
+  oss << std::vector<double>{0.1, 1.0 / 3, 2.5, 100, 1e16, 1e15, 1e-5};
+  EXPECT_EQ(oss.str(),
+            "[0.1, 0.3333333333333333, 2.5, 100, 1e+16, 1000000000000000, "
+            "1e-05]");
+
+  oss.clear_buf();
+  oss << std::map<std::string, double>{{"pi", 3.141592653589793},
+                                       {"tiny", 5e-324},
+                                       {"max", 1.7976931348623157e308}};
+  EXPECT_EQ(oss.str(),
+            "{max: 1.7976931348623157e+308, pi: 3.141592653589793, tiny: "
+            "5e-324}");
+
+  oss.clear_buf();
+  oss.print(-0.0, 0.0001, 123456789.125, std::make_pair(0.1f, 16777216.0f));
+  EXPECT_EQ(oss.str(), "-0, 0.0001, 123456789.125, (0.1, 16777216)");
+
+  oss.clear_buf();
+  std::vector<double> special{std::numeric_limits<double>::infinity(),
+                              -std::numeric_limits<double>::infinity(),
+                              std::numeric_limits<double>::quiet_NaN()};
+  oss.print_range(special.begin(), special.end());
+  EXPECT_EQ(oss.str(), "inf, -inf, nan");
+
+  oss.clear_buf();
+  oss << std::setw(6) << std::setfill('_') << 1.5;
+  EXPECT_EQ(oss.str(), "___1.5");
+
+  myostream::wostringstream woss;
+  woss.preferences().float_output = float_format::shortest;
+  woss << std::vector<double>{0.3, 2e-7};
+  EXPECT_EQ(woss.str(), L"[0.3, 2e-07]");
+
+  // Round trip
+  std::mt19937_64 rng(20211);
+  for (int i = 0; i < 10000; ++i) {
+    uint64_t bits = rng();
+    double   d;
+    std::memcpy(&d, &bits, sizeof(d));
+    if (std::isnan(d)) continue;
+    oss.clear_buf();
+    oss << d;
+    EXPECT_EQ(std::strtod(oss.str().c_str(), nullptr), d) << oss.str();
+  }
+}
+
+TEST(Tostr, BatchContiguousNumbers) {
+  std::mt19937_64      rng(7);
+  std::vector<int64_t> vi(5000);
+  std::vector<double>  vd(5000);
+  for (auto& x : vi) x = static_cast<int64_t>(rng()) >> (rng() % 64);
+  for (auto& x : vd) x = static_cast<double>(static_cast<int64_t>(rng())) / 7;
+
+  myostream::ostringstream batch, single;
+  batch.preferences().float_output  = float_format::shortest;
+  single.preferences().float_output = float_format::shortest;
+  batch << vi << vd;
+  internal::output_all(single,
+                       vi.begin(),
+                       vi.end(),
+                       vi.size(),
+                       single.preferences().vector_fmt);
+  internal::output_all(single,
+                       vd.begin(),
+                       vd.end(),
+                       vd.size(),
+                       single.preferences().vector_fmt);
+  EXPECT_EQ(batch.str(), single.str());
+
+  // Long borders and separators.
+  myostream::ostringstream oss;
+  oss.preferences().array_fmt.with(
+      std::string(3000, '<'), std::string(600, ','), std::string(3000, '>'));
+  oss << std::array<unsigned, 3>{1, 2, 3};
+  EXPECT_EQ(oss.str(),
+            std::string(3000, '<') + "1" + std::string(600, ',') + "2" +
+                std::string(600, ',') + "3" + std::string(3000, '>'));
+
+  EXPECT_EQ(tostr(std::array<int, 0>{}, std::vector<short>{}), "[][]");
+  EXPECT_EQ(towstr_dense(std::array<int, 2>{-1, 1}), L"[-1,1]");
+  EXPECT_EQ(tostr(std::vector<float>{0.1f, 2.5f}), "[0.1, 2.5]");
+}
+
+TEST(FormattedSize, SameAsTostr) {
+  std::map<std::string, std::vector<std::pair<int, double>>> m{
+      {"a", {{1, 1.5}, {2, -3.25}}}, {"bc", {}}};
+  std::tuple<int, std::string, char> t{42, "hello", 'x'};
+  std::vector<std::string>           vs(100, std::string(50, 'v'));
+
+  EXPECT_EQ(formatted_size(), 0u);
+  EXPECT_EQ(formatted_size(m), tostr(m).size());
+  EXPECT_EQ(formatted_size(m, t, vs), tostr(m, t, vs).size());
+  EXPECT_EQ(pformatted_size(1, m, t), ptostr(1, m, t).size());
+  std::map<int, std::vector<double>> wm{{1, {0.5, 2}}, {-3, {}}};
+  EXPECT_EQ((myostream::basic_formatted_size<std::wostringstream, true>(wm)),
+            towstr_dense(wm).size());
+
+  myostream::basic_ostream<myostream::counting_ostream> cnt;
+  cnt << m << std::string(1000, 'x') << 'c';
+  EXPECT_EQ(cnt.count(), tostr(m).size() + 1001);
+  EXPECT_EQ(static_cast<size_t>(cnt.tellp()), cnt.count());
+  cnt.reset();
+  EXPECT_EQ(cnt.count(), 0u);
+}
+
+TEST(FormatTo, Basic) {
+  std::map<int, std::vector<std::string>> m{{1, {"a", "bc"}}, {2, {}}};
+  std::string                             expect  = tostr(m, 3.5, "end");
+  std::string                             pexpect = ptostr(m, 3.5, "end");
+
+  std::string out;
+  format_to(std::back_inserter(out), m, 3.5, "end");
+  EXPECT_EQ(out, expect);
+  out.clear();
+  pformat_to(std::back_inserter(out), m, 3.5, "end");
+  EXPECT_EQ(out, pexpect);
+
+  std::vector<char> big(expect.size() * 2 + 1000, '#');
+  char*             e = format_to(big.data(), std::string(900, 'x'), m);
+  EXPECT_EQ(std::string(big.data(), e), std::string(900, 'x') + tostr(m));
+  EXPECT_EQ(*e, '#');
+
+  std::wstring wout;
+  std::map<int, std::vector<double>> wm{{1, {0.5, 2}}};
+  wformat_to(std::back_inserter(wout), wm, L"!");
+  EXPECT_EQ(wout, towstr(wm, L"!"));
+  wout.clear();
+  pwformat_to(std::back_inserter(wout), wm, 1);
+  EXPECT_EQ(wout, ptowstr(wm, 1));
+}
+
+TEST(FormatTo, N) {
+  std::vector<int> v{1, 2, 3};
+  std::string      expect = tostr(v, "tail");
+
+  char buf[64];
+  std::memset(buf, '#', sizeof(buf));
+  auto r = format_to_n(buf, sizeof(buf), v, "tail");
+  EXPECT_EQ(r.size, expect.size());
+  EXPECT_EQ(std::string(buf, r.out), expect);
+  EXPECT_EQ(buf[expect.size()], '#');
+
+  for (size_t n = 0; n <= expect.size(); ++n) {
+    std::memset(buf, '#', sizeof(buf));
+    r = format_to_n(buf, n, v, "tail");
+    EXPECT_EQ(r.size, expect.size());
+    EXPECT_EQ(std::string(buf, r.out), expect.substr(0, n));
+    EXPECT_EQ(buf[n], '#');
+  }
+
+  r = pformat_to_n(buf, 5, v, 1);
+  EXPECT_EQ(r.size, ptostr(v, 1).size());
+  EXPECT_EQ(std::string(buf, r.out), ptostr(v, 1).substr(0, 5));
+
+  wchar_t wbuf[4];
+  auto    wr = format_to_n(wbuf, 4, v);
+  EXPECT_EQ(wr.size, towstr(v).size());
+  EXPECT_EQ(std::wstring(wbuf, wr.out), towstr(v).substr(0, 4));
+}
+
+struct angle_vector_preferences
+    : public myostream::static_preferences<std::string> {
+  static constexpr format_type vector_fmt{"<", "|", ">"};
+};
+constexpr angle_vector_preferences::format_type
+    angle_vector_preferences::vector_fmt;
+
+TEST(StaticPreferences, SameAsDefault) {
+  std::map<int, std::vector<std::pair<double, char>>> m{
+      {1, {{1.5, 'a'}, {2, 'b'}}}, {2, {}}};
+  std::tuple<int, std::set<int>, std::list<int>> t{1, {2, 3}, {4}};
+
+  myostream::basic_ostringstream<std::ostringstream,
+                                 myostream::static_preferences<std::string>>
+      oss;
+  oss << m << t;
+  oss.print(1, "x", 2);
+  EXPECT_EQ(oss.str(), tostr(m, t) + ptostr(1, "x", 2));
+
+  myostream::basic_ostringstream<
+      std::wostringstream,
+      const myostream::static_preferences<std::wstring, true>>
+      woss;
+  std::unordered_map<int, std::deque<int>> um{{7, {8, 9}}};
+  woss << um << std::make_pair(1, 2);
+  EXPECT_EQ(woss.str(), towstr_dense(um, std::make_pair(1, 2)));
+
+  // No allocation, all streams share one instance.
+  myostream::basic_ostringstream<std::ostringstream,
+                                 myostream::static_preferences<std::string>>
+      other;
+  EXPECT_EQ(oss.preferences_ptr(), other.preferences_ptr());
+  EXPECT_EQ(myostream::static_preferences<std::string>::vector_fmt.sep.size(),
+            2u);
+
+  myostream::basic_ostringstream<std::ostringstream, angle_vector_preferences>
+      custom;
+  custom << std::vector<std::vector<int>>{{1, 2}, {}} << std::list<int>{3};
+  custom << std::setw(4);
+  custom << std::vector<int>{5};
+  EXPECT_EQ(custom.str(), "<<1|2>|<>>[3]   <5>");
+}
+
+TEST(Preferences, SharedDefaultCopyOnWrite) {
+  myostream::ostringstream a, b;
+  EXPECT_EQ(a.const_preferences_ptr(), b.const_preferences_ptr());
+  EXPECT_FALSE(a.owns_preferences());
+
+  a << std::vector<int>{1, 2};
+  EXPECT_EQ(a.const_preferences_ptr(), b.const_preferences_ptr());
+
+  a.preferences().vector_fmt.with("<", "|", ">");
+  EXPECT_TRUE(a.owns_preferences());
+  EXPECT_NE(a.const_preferences_ptr(), b.const_preferences_ptr());
+  a << std::vector<int>{3, 4};
+  b << std::vector<int>{3, 4};
+  EXPECT_EQ(a.str(), "[1, 2]<3|4>");
+  EXPECT_EQ(b.str(), "[3, 4]");
+  EXPECT_EQ(myostream::ostringstream().const_preferences().vector_fmt.sep,
+            ", ");
+
+  // Not owned preferences are never deleted by the stream.
+  myostream::default_preferences<std::string> outer;
+  outer.list_fmt.with("(", "/", ")");
+  a.set_preferences_ptr(&outer);
+  EXPECT_FALSE(a.owns_preferences());
+  EXPECT_EQ(a.preferences_ptr(), &outer);
+  a << std::list<int>{5, 6};
+  a.clear_preferences_ptr();
+  a.set_preferences_ptr(&outer);
+  a.set_preferences_ptr(&outer);
+  EXPECT_EQ(a.preferences_ptr(), &outer);
+
+  // Owned preferences are deleted when replaced.
+  std::unique_ptr<myostream::default_preferences<std::string>> owned(
+      new myostream::default_preferences<std::string>);
+  owned->list_fmt.with("{", ";", "}");
+  a.set_preferences_ptr(std::move(owned));
+  EXPECT_TRUE(a.owns_preferences());
+  a << std::list<int>{7, 8};
+  a.new_preferences_ptr();
+  EXPECT_TRUE(a.owns_preferences());
+  a << std::list<int>{9};
+  a.delete_preferences_ptr();
+  EXPECT_EQ(a.const_preferences_ptr(), nullptr);
+  EXPECT_EQ(a.str(), "[1, 2]<3|4>(5/6){7;8}[9]");
+}
+
+TEST(Tostr, WriteCombining) {
+  std::map<int, std::string> m;
+  for (int i = 0; i < 3000; ++i) m[i - 1000] = std::string(i % 7, 'a' + i % 26);
+  std::ostringstream expect;
+  expect << '{';
+  for (auto it = m.begin(); it != m.end(); ++it) {
+    if (it != m.begin()) expect << ", ";
+    expect << it->first << ": " << it->second;
+  }
+  expect << '}';
+  EXPECT_EQ(tostr(m), expect.str());
+
+  std::vector<char>                      vc{'a', 'b'};
+  std::list<std::vector<std::string>>    nested{{"x", "yz"}, {}, {"w"}};
+  std::map<std::string, std::set<short>> ms{{"k", {3, 1}}, {"", {}}};
+  EXPECT_EQ(tostr(vc, nested, ms),
+            "[a, b][[x, yz], [], [w]]{: {}, k: {1, 3}}");
+  EXPECT_EQ(towstr_dense(std::deque<wchar_t>{L'x', L'y'},
+                         std::list<std::wstring>{L"p", L"q"}),
+            L"[x,y][p,q]");
+
+  // Width applies to the left border only.
+  myostream::ostringstream oss;
+  oss << std::setw(3);
+  oss << std::list<std::string>{"a", "b"};
+  EXPECT_EQ(oss.str(), "  [a, b]");
+
+  // Not classic locale or not decimal falls back to operator<<.
+  oss.str("");
+  oss << std::hex;
+  oss << std::map<int, int>{{10, 255}};
+  EXPECT_EQ(oss.str(), "{a: ff}");
+
+  // Output of the container is complete before endl flushes it.
+  myostream::ostringstream flushed;
+  flushed << std::set<int>{1, 2} << std::endl;
+  EXPECT_EQ(flushed.str(), "{1, 2}\n");
+
+  // A failing sink throws out of the output with exceptions(badbit).
+  struct failing_buf : std::streambuf {
+    int_type overflow(int_type) override { return traits_type::eof(); }
+  };
+  failing_buf        fb;
+  myostream::ostream fos(&fb);
+  fos.exceptions(std::ios_base::badbit);
+  EXPECT_THROW(fos << std::vector<std::string>{"a"}, std::exception);
+  EXPECT_TRUE(fos.bad());
+}
+
+TEST(StringBuilder, ViewAndRelease) {
+  myostream::builder_ostringstream oss;
+  std::vector<int>                 v(1000, 7);
+  oss << v;
+  auto view = oss.view();
+  EXPECT_EQ(std::string(view.begin(), view.end()), tostr(v));
+  EXPECT_EQ(view.data(), oss.data());
+  EXPECT_EQ(view[0], '[');
+
+  oss.clear_buf();
+  EXPECT_EQ(oss.size(), 0u);
+  EXPECT_GE(oss.capacity(), tostr(v).size());
+  const char* storage = oss.data();
+  oss << std::make_pair(1, 2);
+  EXPECT_EQ(oss.data(), storage);
+  EXPECT_EQ(oss.str(), "(1, 2)");
+
+  std::string released = oss.release();
+  EXPECT_EQ(released, "(1, 2)");
+  EXPECT_EQ(released.data(), storage);
+  EXPECT_EQ(oss.size(), 0u);
+
+  myostream::wbuilder_ostringstream_dense woss;
+  woss << std::list<int>{1, 2};
+  EXPECT_EQ(std::wstring(woss.view().data(), woss.view().size()), L"[1,2]");
+  EXPECT_EQ(woss.to_string_vector(1, std::set<int>{3}),
+            (std::vector<std::wstring>{L"1", L"{3}"}));
+  EXPECT_EQ(woss.str(), L"[1,2]");
+}
+
+TEST(Ostringstream, ToStringList) {
+  myostream::ostringstream oss;
+  oss << "keep";
+  oss.preferences().vector_fmt.with("<", " ", ">");
+  oss << std::hex;
+  std::vector<int> v{10, 11};
+
+  auto list = oss.to_string_list(1, v, std::string(), std::make_pair(255, 'c'));
+  ASSERT_EQ(list.size(), 4u);
+  EXPECT_EQ(list.str(0), "1");
+  EXPECT_EQ(list.str(1), "<a b>");
+  EXPECT_EQ(list.str(2), "");
+  EXPECT_EQ(list.str(3), "(ff, c)");
+  EXPECT_EQ(std::string(list[1].begin(), list[1].end()), "<a b>");
+  EXPECT_EQ(list.offset(3), 6u);
+  EXPECT_EQ(list.length(3), 7u);
+  EXPECT_EQ(list.buffer(), "1<a b>(ff, c)");
+  EXPECT_EQ(oss.str(), "keep");
+  EXPECT_EQ(oss.to_string_vector(1, v, std::string(), std::make_pair(255, 'c')),
+            (std::vector<std::string>{"1", "<a b>", "", "(ff, c)"}));
+  EXPECT_TRUE(oss.to_string_list().empty());
+
+  myostream::wostringstream_dense woss;
+  auto wlist = woss.to_string_list(std::set<int>{1, 2}, L"x");
+  EXPECT_EQ(wlist.str(0), L"{1,2}");
+  EXPECT_EQ(wlist.str(1), L"x");
+}
+
+TEST(OutputLimits, Basic) {
+  myostream::ostringstream oss;
+  auto&                    limits = oss.preferences().limits;
+
+  limits.max_items = 3;
+  oss << std::vector<int>(10000000, 1);
+  EXPECT_EQ(oss.str(), "[1, 1, 1, ... (9999997 more)]");
+  oss.str("");
+  oss << std::vector<int>{1, 2, 3} << std::map<int, char>{{1, 'a'}};
+  EXPECT_EQ(oss.str(), "[1, 2, 3]{1: a}");
+  oss.str("");
+  oss << std::forward_list<int>{1, 2, 3, 4, 5} << std::set<int>{1, 2, 3, 4};
+  EXPECT_EQ(oss.str(), "[1, 2, 3, ...]{1, 2, 3, ... (1 more)}");
+  oss.str("");
+  std::list<int> li{5, 6, 7, 8};
+  oss.print_range(li.begin(), li.end());
+  oss << ' ';
+  std::vector<int> vi{9, 8, 7, 6};
+  oss.print_range(vi.begin(), vi.end());
+  EXPECT_EQ(oss.str(), "5, 6, 7, ... 9, 8, 7, ... (1 more)");
+
+  limits.max_items = 0;
+  limits.max_depth = 2;
+  oss.str("");
+  std::vector<std::vector<std::vector<int>>> deep{{{1, 2}, {}}, {{3}}};
+  oss << deep;
+  EXPECT_EQ(oss.str(), "[[[... (2 more)], []], [[... (1 more)]]]");
+
+  limits.max_items = 1;
+  limits.max_depth = 1;
+  oss.str("");
+  oss << std::map<std::string, std::vector<int>>{{"a", {1}}, {"b", {2}}};
+  EXPECT_EQ(oss.str(), "{a: [... (1 more)], ... (1 more)}");
+
+  limits.max_items = 0;
+  limits.max_depth = 0;
+  limits.max_bytes = 20;
+  oss.str("");
+  oss << std::vector<std::string>(100, "abcdefgh") << std::endl;
+  EXPECT_EQ(oss.str(), "[abcdefgh, abcdefgh, abcdefgh, ... (97 more)]\n");
+  oss.str("");
+  oss << std::vector<std::vector<int>>(1000, std::vector<int>(100, 1));
+  EXPECT_LT(oss.str().size(), 200u);
+  EXPECT_EQ(oss.str().substr(oss.str().size() - 17), ", ... (999 more)]");
+  // Still writes to the original buffer after the limited output.
+  oss << "end";
+  EXPECT_EQ(oss.str().substr(oss.str().size() - 3), "end");
+
+  myostream::builder_ostringstream_dense boss;
+  boss.preferences().limits.max_bytes = 5;
+  boss << std::set<int>{10, 20, 30, 40};
+  EXPECT_EQ(boss.str(), "{10,20,... (2 more)}");
+}
+
+TEST(Summary, Basic) {
+  std::vector<int> v{5, 1, 4, 2, 3};
+  EXPECT_EQ(tostr(myostream::summary(v)),
+            "[size: 5, min: 1, max: 5, mean: 3, stddev: 1.41421, "
+            "head: [5, 1, 4], tail: [2, 3], p50: 3, p90: 5, p99: 5]");
+  EXPECT_EQ(v, (std::vector<int>{5, 1, 4, 2, 3}));
+
+  myostream::summary_options opt;
+  opt.head      = 1;
+  opt.tail      = 1;
+  opt.quantiles = false;
+  EXPECT_EQ(tostr_dense(myostream::summary(std::list<double>{1, 2.5, -2}, opt)),
+            "[size:3,min:-2,max:2.5,mean:0.5,stddev:1.87083,"
+            "head:[1],tail:[-2]]");
+  EXPECT_EQ(tostr(myostream::summary(std::set<int64_t>{})), "{size: 0}");
+  EXPECT_EQ(tostr(myostream::summary(std::array<unsigned, 2>{{7, 7}})),
+            "[size: 2, min: 7, max: 7, mean: 7, stddev: 0, head: [7, 7], "
+            "p50: 7, p90: 7, p99: 7]");
+
+  // Large values keep precision.
+  std::vector<int64_t> big;
+  for (int i = 0; i < 1001; ++i) big.push_back(1000000000000LL + i);
+  myostream::ostringstream oss;
+  oss.preferences().summary_min_size = 1000;
+  oss << std::setprecision(13);
+  oss << big;
+  oss << ' ';
+  oss << std::vector<int>{1, 2};
+  EXPECT_EQ(oss.str(),
+            "[size: 1001, min: 1000000000000, max: 1000000001000, "
+            "mean: 1000000000500, stddev: 288.963665536, "
+            "head: [1000000000000, 1000000000001, 1000000000002], "
+            "tail: [1000000000998, 1000000000999, 1000000001000], "
+            "p50: 1000000000500, p90: 1000000000900, p99: 1000000000990] "
+            "[1, 2]");
+}
+
+namespace {
+
+struct output_counter {
+  int* count;
+};
+
+std::ostream& operator<<(std::ostream& os, const output_counter& c) {
+  ++*c.count;
+  return os << "c";
+}
+
+}  // namespace
+
+TEST(Lazy, Basic) {
+  int              count = 0;
+  output_counter   c{&count};
+  std::vector<int> v{1, 2};
+  int              i = 3;
+  auto             l = myostream::lazy(c, v, i);
+  EXPECT_EQ(count, 0);
+
+  myostream::ostringstream oss;
+  oss << l;
+  EXPECT_EQ(oss.str(), "c[1, 2]3");
+  EXPECT_EQ(count, 1);
+  EXPECT_EQ(l.str(), "c[1, 2]3");
+  EXPECT_EQ(tostr(myostream::lazy(v), '|', myostream::lazy()), "[1, 2]|");
+
+  std::ostringstream soss;
+  soss << std::setw(4) << myostream::lazy(std::set<int>{1}) << 1.5;
+  EXPECT_EQ(soss.str(), "   {1}1.5");
+  soss.str("");
+  soss << std::setfill('*') << std::setw(8) << myostream::lazy(42) << '|'
+       << std::setw(4) << 42;
+  EXPECT_EQ(soss.str(), "******42|**42");
+
+  EXPECT_EQ(MYOSTREAM_LAZY_WATCH(" = ", ", ", ";", i, v).str(),
+            "i = 3, v = [1, 2];");
+  count = 0;
+  auto w = MYOSTREAM_LAZY_WATCH("=", ",", "", c);
+  EXPECT_EQ(count, 0);
+  oss.clear_buf();
+  oss << w;
+  EXPECT_EQ(oss.str(), "c=c");
+  EXPECT_EQ(count, 1);
+}
+
+namespace {
+
+// Check each thread's lines "t:i" come in order and none is lost.
+void check_async_output(const std::string& s,
+                        int                threads,
+                        int                n,
+                        size_t             dropped) {
+  std::vector<int>   next(threads, 0);
+  std::istringstream iss(s);
+  std::string        line;
+  size_t             lines = 0;
+  while (std::getline(iss, line)) {
+    int  t = 0, i = 0;
+    char colon;
+    std::istringstream(line) >> t >> colon >> i;
+    ASSERT_GE(i, next[t]) << line;
+    next[t] = i + 1;
+    ++lines;
+  }
+  EXPECT_EQ(lines + dropped, static_cast<size_t>(threads) * n);
+}
+
+struct throwing_item {};
+
+std::ostream& operator<<(std::ostream&, const throwing_item&) {
+  throw std::runtime_error("throwing_item");
+}
+
+}  // namespace
+
+TEST(AsyncSink, Basic) {
+  std::ostringstream oss;
+  {
+    myostream::async_sink sink(oss.rdbuf());
+    sink.stream().preferences().vector_fmt.with("<", ",", ">");
+    std::string s = "str";
+    char        buf[8];
+    std::strcpy(buf, "buf");
+    sink.write(std::vector<int>{1, 2}, ' ', s, ' ', buf, ' ', 1.5);
+    std::strcpy(buf, "xxx");
+    sink.flush();
+    EXPECT_EQ(oss.str(), "<1,2> str buf 1.5");
+  }
+  EXPECT_EQ(oss.str(), "<1,2> str buf 1.5");
+
+  for (auto overflow : {myostream::async_overflow::block,
+                        myostream::async_overflow::drop,
+                        myostream::async_overflow::grow}) {
+    std::ostringstream out;
+    myostream::async_options opt;
+    opt.capacity = 4;
+    opt.overflow = overflow;
+    myostream::async_sink    sink(out.rdbuf(), opt);
+    const int                threads = 4, n = 2000;
+    std::vector<std::thread> ts;
+    for (int t = 0; t < threads; ++t) {
+      ts.emplace_back([&, t] {
+        for (int i = 0; i < n; ++i) sink.write(t, ':', i, '\n');
+      });
+    }
+    for (auto& th : ts) th.join();
+    sink.flush();
+    check_async_output(out.str(), threads, n, sink.dropped());
+    if (overflow != myostream::async_overflow::drop) {
+      EXPECT_EQ(sink.dropped(), 0u);
+    }
+    sink.close();
+    EXPECT_FALSE(sink.write(1));
+  }
+}
+
+TEST(AsyncSink, ErrorAndClose) {
+  // An exception of a record is rethrown by flush once, later records are
+  // still written.
+  std::ostringstream out;
+  {
+    myostream::async_sink sink(out.rdbuf());
+    sink.write(1, throwing_item(), 2);
+    sink.write(3);
+    EXPECT_THROW(sink.flush(), std::runtime_error);
+    sink.flush();
+    EXPECT_EQ(out.str(), "13");
+    sink.write(throwing_item());
+    EXPECT_THROW(sink.close(), std::runtime_error);
+  }
+
+  // Producers racing close with a full ring neither hang nor lose records
+  // silently, and flush returns.
+  for (auto overflow : {myostream::async_overflow::block,
+                        myostream::async_overflow::grow}) {
+    std::ostringstream       oss;
+    myostream::async_options opt;
+    opt.capacity = 2;
+    opt.overflow = overflow;
+    myostream::async_sink    sink(oss.rdbuf(), opt);
+    const int                threads = 3, n = 3000;
+    std::vector<std::thread> ts;
+    for (int t = 0; t < threads; ++t) {
+      ts.emplace_back([&, t] {
+        for (int i = 0; i < n; ++i) {
+          sink.write(t, ':', i, '\n');
+          if (i % 100 == 0) sink.flush();
+        }
+      });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    sink.close();
+    for (auto& th : ts) th.join();
+    check_async_output(oss.str(), threads, n, sink.dropped());
+  }
+}
+
+TEST(LineOstream, Basic) {
+  std::ostringstream      oss;
+  myostream::line_ostream out(oss.rdbuf());
+  out.preferences().vector_fmt.with("<", ",", ">");
+  std::vector<int> v{1, 2};
+  out.println(v, 3);
+  out.line() << "v=" << v << std::endl;
+  MYOSTREAM_WATCH(out.line(), " = ", ", ", "\n", v);
+  out.print(std::set<int>{1});
+  EXPECT_EQ(oss.str(), "<1,2>, 3\nv=<1,2>\nv = <1,2>\n{1}");
+  // The thread local stream is restored to the default preferences.
+  EXPECT_EQ(tostr(v), "[1, 2]");
+
+  oss.str("");
+  const int                threads = 4, n = 1000;
+  std::vector<std::thread> ts;
+  for (int t = 0; t < threads; ++t) {
+    ts.emplace_back([&, t] {
+      std::vector<int> items(t + 1, t);
+      for (int i = 0; i < n; ++i) out.println(t, i, items);
+    });
+  }
+  for (auto& th : ts) th.join();
+  // Each line is "t, i, <t,t,...>" with t + 1 items.
+  std::istringstream iss(oss.str());
+  std::string        line;
+  std::vector<int>   next(threads, 0);
+  while (std::getline(iss, line)) {
+    int         t = line[0] - '0';
+    std::string items(2 * t + 1, ',');
+    for (int i = 0; i <= t; ++i) items[2 * i] = line[0];
+    ASSERT_EQ(line, tostr(t, ", ", next[t]++, ", <", items, ">"));
+  }
+  EXPECT_EQ(next, std::vector<int>(threads, n));
+}
+
+TEST(ParallelOutput, SameAsSerial) {
+  std::vector<int64_t> vi;
+  for (int i = 0; i < 1000; ++i) vi.push_back(i * 1234567 - 99999);
+  std::vector<std::string> vs;
+  for (int i = 0; i < 100; ++i) vs.push_back(std::string(i % 7, 'a' + i % 26));
+  std::map<int, std::vector<double>> m;
+  for (int i = 0; i < 100; ++i) m[i] = {i / 3.0, 0.1 * i};
+  std::list<std::set<int>> l(50, std::set<int>{1, 2, 3});
+
+  myostream::ostringstream serial;
+  serial << std::setprecision(10) << std::setw(5);
+  serial << vi;
+  serial << vs << m << l;
+  for (size_t threads : {2, 3, 16}) {
+    myostream::ostringstream parallel;
+    parallel.preferences().parallel_min_size = 10;
+    parallel.preferences().parallel_threads  = threads;
+    parallel << std::setprecision(10) << std::setw(5);
+    parallel << vi;
+    parallel << vs << m << l;
+    EXPECT_EQ(parallel.str(), serial.str());
+  }
+
+  // The tostr family uses the global preferences.
+  std::string expected = tostr(m, vi);
+  auto&       p        = default_preferences<std::string>::ins();
+  p.parallel_min_size  = 2;
+  p.parallel_threads   = 4;
+  EXPECT_EQ(tostr(m, vi), expected);
+  p.reset();
+}
+
+TEST(TostrBatch, SameAsTostr) {
+  std::vector<std::map<int, std::string>> records;
+  for (int i = 0; i < 100; ++i) {
+    records.push_back({{i, std::string(i % 5, 'x')}, {-i, "y"}});
+  }
+  std::vector<std::string> expected;
+  for (const auto& r : records) expected.push_back(tostr(r));
+
+  for (size_t threads : {0, 1, 3, 200}) {
+    std::vector<std::string> got;
+    tostr_batch(
+        records.begin(), records.end(), std::back_inserter(got), threads);
+    EXPECT_EQ(got, expected);
+
+    string_list list =
+        tostr_batch_list(records.begin(), records.end(), threads);
+    ASSERT_EQ(list.size(), expected.size());
+    for (size_t i = 0; i < list.size(); ++i) {
+      EXPECT_EQ(list.str(i), expected[i]);
+    }
+  }
+
+  std::list<std::tuple<int, double>> l{std::make_tuple(1, 0.5),
+                                       std::make_tuple(2, 1.5)};
+  std::vector<std::string>           got;
+  tostr_batch(l.begin(), l.end(), std::back_inserter(got), 2);
+  EXPECT_EQ(got, (std::vector<std::string>{"<1, 0.5>", "<2, 1.5>"}));
+  EXPECT_TRUE(tostr_batch_list(l.end(), l.end()).empty());
+}
+
+TEST(FormatPlan, NestedTypes) {
+  std::map<std::string, std::vector<std::pair<int, double>>> m{
+      {"a", {{1, 1.5}, {2, -0.25}}}, {"b", {}}};
+  auto t = std::make_tuple(1, 'c', std::make_tuple(), std::set<int>{2, 3});
+
+  myostream::ostringstream oss;
+  oss << m;
+  oss << t;
+  EXPECT_EQ(oss.str(), "{a: [(1, 1.5), (2, -0.25)], b: []}<1, c, <>, {2, 3}>");
+
+  // Formats changed between two outputs are seen by the next one.
+  oss.str("");
+  oss.preferences().pair_fmt.with("(", "=", ")");
+  oss.preferences().tuple_fmt.sep = ";";
+  oss << m;
+  oss << t;
+  EXPECT_EQ(oss.str(), "{a: [(1=1.5), (2=-0.25)], b: []}<1;c;<>;{2, 3}>");
+
+  // Nested containers still follow output limits.
+  oss.str("");
+  oss.preferences().limits.max_items = 1;
+  oss << m;
+  EXPECT_EQ(oss.str(), "{a: [(1=1.5), ... (1 more)], ... (1 more)}");
+}
+
+TEST(PreferencesHolder, Basic) {
+  preferences_holder<std::string> holder;
+  myostream::ostringstream        oss;
+  oss.bind_preferences(holder);
+  EXPECT_EQ(oss.preferences_holder(), &holder);
+
+  std::vector<int> v{1, 2};
+  oss << v;
+  holder.update([](default_preferences<std::string>& p) {
+    p.vector_fmt.with("<", "|", ">");
+  });
+  oss << v;
+  EXPECT_EQ(oss.str(), "[1, 2]<1|2>");
+
+  // Mutable access copies the current version and unbinds.
+  oss.str("");
+  oss.preferences().vector_fmt.sep = ",";
+  EXPECT_EQ(oss.preferences_holder(), nullptr);
+  holder.store(default_preferences<std::string>());
+  oss << v;
+  EXPECT_EQ(oss.str(), "<1,2>");
+
+  // Unbinding inside an output, then binding again, still syncs later.
+  oss.enter_output();
+  oss.preferences();
+  oss.leave_output();
+  oss.bind_preferences(holder);
+  holder.update([](default_preferences<std::string>& p) {
+    p.vector_fmt.sep = "+";
+  });
+  oss.str("");
+  oss << v;
+  EXPECT_EQ(oss.str(), "[1+2]");
+
+  // print, println and print_range take their formats from the new version.
+  holder.update([](default_preferences<std::string>& p) {
+    p.print_fmt.with("(", "; ", ")");
+  });
+  oss.str("");
+  oss.print(1, 2);
+  EXPECT_EQ(oss.str(), "(1; 2)");
+  holder.update([](default_preferences<std::string>& p) {
+    p.print_fmt.with("{", "/", "}");
+  });
+  oss.str("");
+  oss.println(1, 2);
+  EXPECT_EQ(oss.str(), "{1/2}\n");
+  holder.update([](default_preferences<std::string>& p) {
+    p.print_range_fmt.with("<", "&", ">");
+  });
+  oss.str("");
+  oss.print_range(v.begin(), v.end());
+  EXPECT_EQ(oss.str(), "<1&2>");
+
+  // Each output uses one version while another thread keeps publishing.
+  std::vector<std::vector<int>> vv(100, v);
+  std::atomic<bool>             stop(false);
+  std::thread                   writer([&] {
+    for (int i = 0; !stop; ++i) {
+      holder.update([i](default_preferences<std::string>& p) {
+        p.vector_fmt.sep = i % 2 == 0 ? ";" : "/";
+      });
+    }
+  });
+  myostream::ostringstream reader;
+  reader.bind_preferences(holder);
+  for (int i = 0; i < 200; ++i) {
+    reader.str("");
+    reader << vv;
+    std::string s = reader.str();
+    EXPECT_TRUE(s.find(';') == std::string::npos ||
+                s.find('/') == std::string::npos);
+  }
+  stop = true;
+  writer.join();
+}
+
+#ifdef MYOSTREAM_HAS_MMAP
+TEST(MmapOfstream, Basic) {
+  const std::string path = testing::TempDir() + "myostream_mmap_test.txt";
+  std::vector<int>  v(3000);
+  for (int i = 0; i < 3000; ++i) v[i] = i;
+  std::map<int, std::string> m{{1, "one"}, {2, "two"}};
+
+  // A window of one page, so the output spans many windows.
+  myostream::basic_ostream<mmap_ofstream> out(path, 1);
+  ASSERT_TRUE(out.is_open());
+  myostream::ostringstream oss;
+  out << v;
+  oss << v;
+  out.print_range(v.begin(), v.begin() + 3);
+  oss.print_range(v.begin(), v.begin() + 3);
+  out << m;
+  oss << m;
+  std::string expected = oss.str();
+  EXPECT_EQ(out.size(), expected.size());
+  EXPECT_EQ(out.tellp(), std::streampos(expected.size()));
+  out.close();
+  EXPECT_TRUE(out.good());
+  EXPECT_FALSE(out.is_open());
+
+  std::ifstream in(path);
+  std::string   content((std::istreambuf_iterator<char>(in)),
+                      std::istreambuf_iterator<char>());
+  EXPECT_EQ(content, expected);
+  std::remove(path.c_str());
+
+  mmap_ofstream bad("/nonexistent-dir/myostream_mmap_test.txt");
+  EXPECT_FALSE(bad.is_open());
+  EXPECT_TRUE(bad.fail());
+}
+#endif  // MYOSTREAM_HAS_MMAP
+
+TEST(FormatChunks, SameAsTostr) {
+  std::map<int, std::vector<int>> m;
+  for (int i = 0; i < 20000; ++i) m[i] = {i, -i};
+  std::vector<size_t> sizes;
+  std::string         joined;
+  format_chunks(
+      [&](const char* data, size_t n) {
+        sizes.push_back(n);
+        joined.append(data, n);
+      },
+      m,
+      std::make_pair(1, 2));
+  EXPECT_EQ(joined, tostr(m, std::make_pair(1, 2)));
+  ASSERT_GT(sizes.size(), 1u);
+  for (size_t i = 0; i + 1 < sizes.size(); ++i) EXPECT_EQ(sizes[i], 65536u);
+
+  std::wstring wjoined;
+  pwformat_chunks(
+      [&](const wchar_t* data, size_t n) { wjoined.append(data, n); }, 1, m);
+  EXPECT_EQ(wjoined, ptowstr(1, m));
+
+  // A stream on a chunk buffer prints the same as on a string.
+  auto                                    t = std::make_tuple(1, "a", 2.5);
+  std::vector<int>                        v{1, 2, 3};
+  std::string                             chunked;
+  myostream::basic_ostream<chunk_ostream> out(
+      [&](const char* data, size_t n) { chunked.append(data, n); }, 4);
+  myostream::ostringstream oss;
+  out << m << t;
+  oss << m << t;
+  out.print_range(v.begin(), v.end());
+  oss.print_range(v.begin(), v.end());
+  EXPECT_EQ(out.size(), oss.str().size());
+  out.flush();
+  EXPECT_EQ(chunked, oss.str());
+
+  // An exception of the callback stops the output and is rethrown.
+  size_t calls = 0;
+  EXPECT_THROW(format_chunks(
+                   [&](const char*, size_t) {
+                     if (++calls == 2) throw std::runtime_error("full");
+                   },
+                   m),
+               std::runtime_error);
+  EXPECT_EQ(calls, 2u);
+}
+
+TEST(FormatCursor, SameAsTostr) {
+  std::map<std::string, std::vector<std::pair<int, double>>> m{
+      {"alpha", {{1, 1.5}, {2, -0.25}}}, {"b", {}}};
+  auto t = std::make_tuple(
+      1, std::string(100, 'z'), std::vector<bool>{true, false}, m);
+
+  // Pieces of every size up to 9 characters, with empty calls between.
+  for (size_t n = 1; n < 10; ++n) {
+    auto        c = format_cursor(t);
+    std::string got;
+    char        buf[9];
+    for (int i = 0; !c.done() && i < 10000; ++i) {
+      EXPECT_EQ(c.next(buf, 0), 0u);
+      size_t k = c.next(buf, n);
+      EXPECT_TRUE(k == n || c.done());
+      got.append(buf, k);
+    }
+    EXPECT_EQ(got, tostr(t));
+  }
+
+  // Output limits write each container at once, with the same result.
+  auto& p            = default_preferences<std::string>::ins();
+  p.limits.max_items = 1;
+  auto        c      = format_cursor(m);
+  std::string got;
+  char        buf[4];
+  while (!c.done()) got.append(buf, c.next(buf, sizeof(buf)));
+  EXPECT_EQ(got, tostr(m));
+  p.reset();
+
+  got.clear();
+  c.reset();
+  while (!c.done()) got.append(buf, c.next(buf, sizeof(buf)));
+  EXPECT_EQ(got, "{alpha: [(1, 1.5), (2, -0.25)], b: []}");
+}